@@ -4,6 +4,8 @@
 #include "npfga.hpp"
 #include "kernel.hpp"
 #include "dmap.hpp"
+#include "hnsw.hpp"
+#include "sampling.hpp"
 #include "cgraph.hpp"
 
 namespace soap {
@@ -46,12 +48,16 @@ BOOST_PYTHON_MODULE(_soapxx)
     soap::TopKernelFactory::registerAll();
     soap::BaseKernelFactory::registerAll();
     soap::Kernel::registerPython();
+    soap::KernelDotCache::registerPython();
+    soap::KernelFile::registerPython();
     soap::KernelInterface::registerPython();
 
     soap::DMap::registerPython();
     soap::GradMap::registerPython();
     soap::DMapMatrix::registerPython();
     soap::DMapMatrixSet::registerPython();
+    soap::HnswIndex::registerPython();
+    soap::DMapSampler::registerPython();
     soap::TypeEncoder::registerPython();
     soap::BlockLaplacian::registerPython();
     soap::Proto::registerPython();
@@ -1,6 +1,9 @@
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/archive/binary_iarchive.hpp>
+#include <fstream>
 #include <sstream>
 
 #include "soap/dmap.hpp"
@@ -12,11 +15,12 @@
 
 namespace soap {
 
-DMap::DMap() : size1(-1), size2(-1) {
+DMap::DMap() : size1(-1), size2(-1), n_slotted(-1), revision(0), qtype(QNONE) {
     ;
 }
 
-DMap::DMap(std::string filter_type) : filter(filter_type), size1(-1), size2(-1) {
+DMap::DMap(std::string filter_type) : filter(filter_type), size1(-1), size2(-1),
+        n_slotted(-1), revision(0), qtype(QNONE) {
     ;
 }
 
@@ -32,11 +36,14 @@ DMap::~DMap() {
 }
 
 bpy::object DMap::val(int chidx, std::string np_dtype) {
+    this->assertNotQuantized("val");
     soap::linalg::numpy_converter npc(np_dtype.c_str());
     return npc.ublas_to_numpy<dtype_t>(*dmap[chidx].second);
 }
 
 void DMap::slice(std::vector<int> &idcs) {
+    this->assertNotQuantized("slice");
+    revision += 1;
     for (auto it=begin(); it!=end(); ++it) {
         vec_t *new_v = new vec_t(idcs.size(), 0.); 
         for (int ii=0; ii<idcs.size(); ++ii) {
@@ -55,6 +62,8 @@ bpy::object DMap::dotOuterNumpy(DMap *other, std::string np_dtype) {
 }
 
 void DMap::dotOuter(DMap *other, matrix_t &output) {
+    this->assertNotQuantized("dotOuter");
+    other->assertNotQuantized("dotOuter");
     int i = 0;
     int j = 0;
     for (auto it=begin(); it!=end(); ++it, ++i) {
@@ -69,6 +78,7 @@ void DMap::dotOuter(DMap *other, matrix_t &output) {
 
 double DMap::dot(DMap *other) {
     if (other->size() < this->size()) return other->dot(this);
+    if (qtype != QNONE || other->qtype != QNONE) return this->dotQuantized(other);
     dtype_t res = 0.0;
     dtype_t r12 = 0.0;
     // NOTE This is clear but inefficient, see improved version below.
@@ -87,6 +97,16 @@ double DMap::dot(DMap *other) {
     //        res += r12;
     //    }
     //}
+    if (other->n_slotted == other->size()) {
+        // Look up the channels of this (the smaller map) in other
+        for (auto it=this->begin(); it!=this->end(); ++it) {
+            int s = other->slot(it->first);
+            if (s < 0) continue;
+            soap::linalg::linalg_dot(*(it->second), *(other->dmap[s].second), r12);
+            res += r12;
+        }
+        return double(res);
+    }
     auto it=this->begin();
     auto jt=other->begin();
     while (it != this->end()) {
@@ -111,23 +131,21 @@ void DMap::add(DMap *other, double scale) {
 }
 
 void DMap::addIgnoreGradients(DMap *other, double scale) {
+    this->assertNotQuantized("add");
+    other->assertNotQuantized("add");
+    revision += 1;
     dmap_t add_entries; 
-    auto it = this->begin();
-    auto jt = other->begin();
-    while (jt != other->end()) {
-        if (it == this->end() || jt->first < it->first) {
+    for (auto jt=other->begin(); jt!=other->end(); ++jt) {
+        int s = this->slot(jt->first);
+        if (s >= 0) {
+            *(dmap[s].second) += *(jt->second)*scale;
+        } else {
             vec_t *add_vec = new vec_t(jt->second->size());
             *add_vec = *(jt->second)*scale;
             add_entries.push_back(channel_t(jt->first, add_vec));
-            ++jt;
-        } else if (jt->first == it->first) {
-            *(it->second) += *(jt->second)*scale;
-            ++it;
-            ++jt;
-        } else if (jt->first > it->first) {
-            ++it;
         }
     }
+    if (add_entries.size() == 0) return;
     for (auto it=add_entries.begin(); it!=add_entries.end(); ++it) {
         dmap.push_back(*it);
     }
@@ -161,23 +179,50 @@ void DMap::addGradients(DMap *other, double scale) {
 void DMap::sort() {
     std::sort(dmap.begin(), dmap.end(), 
         [](DMap::channel_t c1, DMap::channel_t c2) {
-            return c1.first <= c2.first;
+            return c1.first < c2.first;
         }
     );
+    this->buildSlots();
+}
+
+void DMap::buildSlots() {
+    int max_code = -1;
+    for (int s=0; s<this->size(); ++s) max_code = std::max(max_code, int(this->code(s)));
+    slots.assign(max_code+1, -1);
+    for (int s=0; s<this->size(); ++s) slots[this->code(s)] = s;
+    n_slotted = this->size();
+    revision += 1;
+}
+
+int DMap::slot(TypeEncoder::code_t code) {
+    // O(1) via the slot table if in sync with the channels, otherwise bisection
+    if (n_slotted == this->size()) {
+        if (code >= slots.size()) return -1;
+        int s = slots[code];
+        if (s < 0 || this->code(s) == code) return s;
+    }
+    int lo = 0;
+    int hi = this->size();
+    while (lo < hi) {
+        int mid = (lo + hi)/2;
+        if (this->code(mid) < code) lo = mid+1;
+        else hi = mid;
+    }
+    return (lo < this->size() && this->code(lo) == code) ? lo : -1;
 }
 
 void DMap::sortGradients() {
     std::sort(pid_gradmap.begin(), pid_gradmap.end(),
         [](GradMap *g1, GradMap *g2) {
-            return g1->getPid() <= g2->getPid();
+            return g1->getPid() < g2->getPid();
         }
     );
 }
 
 boost::python::list DMap::listChannels() {
     boost::python::list channel_keys;
-    for (auto it=begin(); it!=end(); ++it) {
-        std::string c12 = ENCODER.decode(it->first);
+    for (int s=0; s<this->size(); ++s) {
+        std::string c12 = ENCODER.decode(this->code(s));
         channel_keys.append(c12);
     }
     return channel_keys;
@@ -189,6 +234,11 @@ double DMap::dotFilter(DMap *other) {
 }
 
 void DMap::multiply(double c) {
+    revision += 1;
+    for (auto it=qdmap.begin(); it!=qdmap.end(); ++it) {
+        it->scale *= c;
+        it->offset *= c;
+    }
     for (auto it=begin(); it!=end(); ++it) {
         auto &v = *(it->second);
         v *= c;
@@ -284,6 +334,7 @@ void DMap::adaptPidGradients(
 }
 
 void DMap::convolve(int N, int L) {
+    this->assertNotQuantized("convolve");
     dmap_t out;
     size1 = 0;
     for (auto it=begin(); it!=end(); ++it) {
@@ -385,6 +436,177 @@ DMap *DMap::dotGradLeft(DMap *other, double coeff, double power, DMap *res) {
     return res;
 }
 
+static inline float fp16_to_float(unsigned short h) {
+    // Exponent and mantissa shifted into place, then rebiased by 2^112,
+    // which covers normal and subnormal values (no inf/nan)
+    uint32_t bits = uint32_t(h & 0x7fff) << 13;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    f *= 5.192296858534828e+33f;
+    return (h & 0x8000) ? -f : f;
+}
+
+static unsigned short float_to_fp16(float f) {
+    // Inverse of fp16_to_float, round to nearest even, saturating
+    float a = std::min(std::fabs(f), 65504.0f)*1.925929944387236e-34f;
+    uint32_t bits;
+    std::memcpy(&bits, &a, sizeof(bits));
+    bits += 0xfff + ((bits >> 13) & 1);
+    unsigned short h = std::min(bits >> 13, uint32_t(0x7bff));
+    return (f < 0.0f) ? (h | 0x8000) : h;
+}
+
+static inline double qchannel_combine(const QChannel &a, const QChannel &b, double qq) {
+    // sum_k (sa*qa_k + oa)*(sb*qb_k + ob), given qq = sum_k qa_k*qb_k
+    return double(a.scale)*b.scale*qq + double(a.scale)*b.offset*a.sum
+        + double(a.offset)*b.scale*b.sum + double(a.n)*a.offset*b.offset;
+}
+
+static double qchannel_dot_int8(const QChannel &a, const signed char *qa,
+        const QChannel &b, const signed char *qb) {
+    // Exact in int32 for n < 2^31/127^2 ~ 133000
+    int32_t acc = 0;
+    for (int k=0; k<a.n; ++k) acc += int32_t(qa[k])*int32_t(qb[k]);
+    return qchannel_combine(a, b, acc);
+}
+
+static double qchannel_dot_fp16(const QChannel &a, const unsigned short *qa,
+        const QChannel &b, const unsigned short *qb) {
+    float acc = 0.0f;
+    for (int k=0; k<a.n; ++k) acc += fp16_to_float(qa[k])*fp16_to_float(qb[k]);
+    return qchannel_combine(a, b, acc);
+}
+
+void DMap::quantize(std::string dtype) {
+    // Per channel, the values are mapped onto [-1, 1] via the offset (centre)
+    // and half-width of their range, then stored with 8 bits (int8, x 127)
+    // or as half-precision floats (fp16). The double channels are released.
+    int qtype_new = QNONE;
+    if (dtype == "int8") qtype_new = QINT8;
+    else if (dtype == "fp16" || dtype == "float16") qtype_new = QFP16;
+    else throw soap::base::OutOfRange("Quantization type '" + dtype + "'");
+    if (qtype != QNONE) this->dequantize();
+    std::size_t n_values = 0;
+    for (auto it=begin(); it!=end(); ++it) n_values += it->second->size();
+    qdmap.clear();
+    qdmap.reserve(dmap.size());
+    if (qtype_new == QINT8) qint8.reserve(n_values);
+    else qfp16.reserve(n_values);
+    for (auto it=begin(); it!=end(); ++it) {
+        vec_t &v = *(it->second);
+        QChannel c;
+        c.code = it->first;
+        c.begin = (qtype_new == QINT8) ? qint8.size() : qfp16.size();
+        c.n = v.size();
+        double v_min = (c.n > 0) ? v(0) : 0.0;
+        double v_max = v_min;
+        for (int k=1; k<c.n; ++k) {
+            v_min = std::min(v_min, v(k));
+            v_max = std::max(v_max, v(k));
+        }
+        c.offset = 0.5*(v_max + v_min);
+        c.scale = 0.5*(v_max - v_min)/((qtype_new == QINT8) ? 127. : 1.);
+        c.sum = 0.0f;
+        double inv_scale = (c.scale > 0.0f) ? 1./c.scale : 0.0;
+        for (int k=0; k<c.n; ++k) {
+            double u = (v(k) - c.offset)*inv_scale;
+            if (qtype_new == QINT8) {
+                int q = std::max(-127, std::min(127, int(std::lround(u))));
+                qint8.push_back(q);
+                c.sum += q;
+            } else {
+                unsigned short h = float_to_fp16(u);
+                qfp16.push_back(h);
+                c.sum += fp16_to_float(h);
+            }
+        }
+        qdmap.push_back(c);
+        delete it->second;
+    }
+    dmap_t().swap(dmap);
+    qtype = qtype_new;
+    this->buildSlots();
+}
+
+void DMap::dequantize() {
+    if (qtype == QNONE) return;
+    dmap_t restored;
+    restored.reserve(qdmap.size());
+    std::vector<dtype_t> buffer;
+    for (int s=0; s<this->size(); ++s) {
+        const dtype_t *values = this->channelValues(s, buffer);
+        vec_t *v = new vec_t(qdmap[s].n);
+        std::copy(values, values+qdmap[s].n, v->begin());
+        restored.push_back(channel_t(qdmap[s].code, v));
+    }
+    dmap.swap(restored);
+    qdmap_t().swap(qdmap);
+    std::vector<signed char>().swap(qint8);
+    std::vector<unsigned short>().swap(qfp16);
+    qtype = QNONE;
+    this->buildSlots();
+}
+
+std::string DMap::getQuantization() {
+    if (qtype == QINT8) return "int8";
+    else if (qtype == QFP16) return "fp16";
+    return "";
+}
+
+void DMap::assertNotQuantized(std::string op) {
+    if (qtype != QNONE) throw soap::base::SanityCheckFailed(
+        "<DMap::" + op + "> not available for quantized storage");
+}
+
+const DMap::dtype_t *DMap::channelValues(int s, std::vector<dtype_t> &buffer) {
+    // Values of channel s, dequantized into buffer if required
+    if (qtype == QNONE) return dmap[s].second->data().begin();
+    QChannel &c = qdmap[s];
+    buffer.resize(c.n);
+    if (qtype == QINT8) {
+        const signed char *q = qint8.data() + c.begin;
+        for (int k=0; k<c.n; ++k) buffer[k] = double(c.scale)*q[k] + c.offset;
+    } else {
+        const unsigned short *q = qfp16.data() + c.begin;
+        for (int k=0; k<c.n; ++k) buffer[k] = double(c.scale)*fp16_to_float(q[k]) + c.offset;
+    }
+    return buffer.data();
+}
+
+double DMap::dotQuantized(DMap *other) {
+    // Channels of this (the smaller map) looked up in other. Equal storage
+    // types are contracted on the quantized values (int8: int32, fp16: float
+    // accumulation), mixed types via dequantized channels.
+    double res = 0.0;
+    std::vector<dtype_t> buffer_a;
+    std::vector<dtype_t> buffer_b;
+    for (int a=0; a<this->size(); ++a) {
+        int b = other->slot(this->code(a));
+        if (b < 0) continue;
+        if (qtype == QINT8 && other->qtype == QINT8) {
+            QChannel &ca = qdmap[a];
+            QChannel &cb = other->qdmap[b];
+            assert(ca.n == cb.n && "Inconsistent channel dimension");
+            res += qchannel_dot_int8(ca, qint8.data() + ca.begin,
+                cb, other->qint8.data() + cb.begin);
+        } else if (qtype == QFP16 && other->qtype == QFP16) {
+            QChannel &ca = qdmap[a];
+            QChannel &cb = other->qdmap[b];
+            assert(ca.n == cb.n && "Inconsistent channel dimension");
+            res += qchannel_dot_fp16(ca, qfp16.data() + ca.begin,
+                cb, other->qfp16.data() + cb.begin);
+        } else {
+            int n = this->channelSize(a);
+            const dtype_t *x = this->channelValues(a, buffer_a);
+            const dtype_t *y = other->channelValues(b, buffer_b);
+            dtype_t r12 = 0.0;
+            for (int k=0; k<n; ++k) r12 += x[k]*y[k];
+            res += r12;
+        }
+    }
+    return res;
+}
+
 void DMap::registerPython() {
     using namespace boost::python;
     dtype_t (DMap::*val_scalar)()
@@ -400,6 +622,7 @@ void DMap::registerPython() {
         .add_property("filter", &DMap::getFilter)
         .add_property("size1", &DMap::getSize1)
         .add_property("size2", &DMap::getSize2)
+        .add_property("quantization", &DMap::getQuantization)
 	    .add_property("gradients", range<return_value_policy<reference_existing_object> >(
             &DMap::beginGradients, &DMap::endGradients))
         .def("listChannels", &DMap::listChannels)
@@ -413,7 +636,9 @@ void DMap::registerPython() {
         .def("val", val_vector)
         .def("multiply", &DMap::multiply)
         .def("convolve", &DMap::convolve)
-        .def("dotFilter", &DMap::dotFilter);
+        .def("dotFilter", &DMap::dotFilter)
+        .def("quantize", &DMap::quantize)
+        .def("dequantize", &DMap::dequantize);
 
     class_<DMap::pid_gradmap_t>("GradMapVector")
         .def(vector_indexing_suite<DMap::pid_gradmap_t>());
@@ -534,15 +759,15 @@ void GradMap::registerPython() {
         .def("getZ", &GradMap::z, return_value_policy<reference_existing_object>());
 }
 
-DMapMatrix::DMapMatrix() : is_view(false) {
+DMapMatrix::DMapMatrix() : is_view(false), is_packed(false) {
     ;
 }
 
-DMapMatrix::DMapMatrix(std::string archfile) : is_view(false) {
+DMapMatrix::DMapMatrix(std::string archfile) : is_view(false), is_packed(false) {
     this->load(archfile);
 }
 
-DMapMatrix::DMapMatrix(bool set_as_view) : is_view(set_as_view) {
+DMapMatrix::DMapMatrix(bool set_as_view) : is_view(set_as_view), is_packed(false) {
     ;
 }
 
@@ -557,6 +782,111 @@ void DMapMatrix::clear() {
     dmm.clear();
     for (auto it=views.begin(); it!=views.end(); ++it) delete it->second;
     views.clear();
+    if (is_packed) this->pack();
+}
+
+void DMapMatrix::pack() {
+    // Exact sizes first, such that the buffer is allocated only once
+    std::size_t n_values = 0;
+    std::size_t n_channels = 0;
+    for (auto it=begin(); it!=end(); ++it) {
+        n_channels += (*it)->size();
+        for (int s=0; s<(*it)->size(); ++s) n_values += (*it)->channelSize(s);
+    }
+    pack_values.clear();
+    pack_offsets.clear();
+    pack_codes.clear();
+    pack_rows.clear();
+    pack_revisions.clear();
+    pack_values.reserve(n_values);
+    pack_offsets.reserve(n_channels+1);
+    pack_codes.reserve(n_channels);
+    pack_rows.reserve(dmm.size()+1);
+    pack_revisions.reserve(dmm.size());
+    pack_offsets.push_back(0);
+    pack_rows.push_back(0);
+    is_packed = true;
+    for (auto it=begin(); it!=end(); ++it) this->packRow(*it);
+}
+
+void DMapMatrix::unpack() {
+    std::vector<dtype_t>().swap(pack_values);
+    std::vector<std::size_t>().swap(pack_offsets);
+    std::vector<TypeEncoder::code_t>().swap(pack_codes);
+    std::vector<int>().swap(pack_rows);
+    std::vector<unsigned int>().swap(pack_revisions);
+    is_packed = false;
+}
+
+void DMapMatrix::packRow(DMap *dmap) {
+    std::vector<dtype_t> buffer;
+    for (int s=0; s<dmap->size(); ++s) {
+        const dtype_t *v = dmap->channelValues(s, buffer);
+        pack_values.insert(pack_values.end(), v, v+dmap->channelSize(s));
+        pack_offsets.push_back(pack_values.size());
+        pack_codes.push_back(dmap->code(s));
+    }
+    pack_rows.push_back(pack_codes.size());
+    pack_revisions.push_back(dmap->revision);
+}
+
+void DMapMatrix::syncPack() {
+    // Repacks if rows were modified after packing
+    if (!is_packed) return;
+    for (int i=0; i<this->rows(); ++i) {
+        if (dmm[i]->revision != pack_revisions[i]) {
+            this->pack();
+            return;
+        }
+    }
+}
+
+double DMapMatrix::dotPacked(int i, DMapMatrix *other, int j) {
+    // Same as DMap::dot: Merge over the (sorted) channel codes
+    if (dmm[i]->revision != pack_revisions[i] 
+            || other->dmm[j]->revision != other->pack_revisions[j])
+        return dmm[i]->dot(other->dmm[j]);
+    const TypeEncoder::code_t *ca = pack_codes.data();
+    const TypeEncoder::code_t *cb = other->pack_codes.data();
+    const std::size_t *oa = pack_offsets.data();
+    const std::size_t *ob = other->pack_offsets.data();
+    const dtype_t *va = pack_values.data();
+    const dtype_t *vb = other->pack_values.data();
+    int a = pack_rows[i];
+    int a_end = pack_rows[i+1];
+    int b = other->pack_rows[j];
+    int b_end = other->pack_rows[j+1];
+    dtype_t res = 0.0;
+    while (a < a_end && b < b_end) {
+        if (ca[a] < cb[b]) ++a;
+        else if (cb[b] < ca[a]) ++b;
+        else {
+            const dtype_t *x = va + oa[a];
+            const dtype_t *y = vb + ob[b];
+            int n = oa[a+1] - oa[a];
+            dtype_t r12 = 0.0;
+            for (int k=0; k<n; ++k) r12 += x[k]*y[k];
+            res += r12;
+            ++a;
+            ++b;
+        }
+    }
+    return double(res);
+}
+
+void DMapMatrix::quantize(std::string dtype) {
+    // The packed layout holds double copies, released here
+    this->unpack();
+    for (auto it=begin(); it!=end(); ++it) (*it)->quantize(dtype);
+}
+
+void DMapMatrix::dequantize() {
+    for (auto it=begin(); it!=end(); ++it) (*it)->dequantize();
+}
+
+bool DMapMatrix::isQuantized() {
+    for (auto it=begin(); it!=end(); ++it) if ((*it)->isQuantized()) return true;
+    return false;
 }
 
 void DMapMatrix::addView(std::string filter) {
@@ -566,6 +896,7 @@ void DMapMatrix::addView(std::string filter) {
             view->dmm.push_back(*it);
         }
     }
+    if (is_packed) view->pack();
     auto it = views.find(filter);
     if (it != views.end()) delete it->second;
     views[filter] = view;
@@ -581,7 +912,9 @@ DMapMatrix *DMapMatrix::getView(std::string filter) {
 void DMapMatrix::append(DMap *dmap_arg) {
     DMap *new_dmap = new DMap(dmap_arg->filter);
     new_dmap->dmap = dmap_arg->dmap;
+    new_dmap->buildSlots();
     dmm.push_back(new_dmap);
+    if (is_packed) this->packRow(new_dmap);
 }
 
 void DMapMatrix::append(Spectrum *spectrum) {
@@ -589,6 +922,7 @@ void DMapMatrix::append(Spectrum *spectrum) {
         DMap *new_dmap = new DMap();
         new_dmap->adapt(*it);
         dmm.push_back(new_dmap);
+        if (is_packed) this->packRow(new_dmap);
     }
 }
 
@@ -597,6 +931,7 @@ void DMapMatrix::appendCoherent(Spectrum *spectrum) {
         DMap *new_dmap = new DMap();
         new_dmap->adaptCoherent(*it);
         dmm.push_back(new_dmap);
+        if (is_packed) this->packRow(new_dmap);
     }
 }
 
@@ -608,18 +943,21 @@ void DMapMatrix::sum() {
     }
     this->clear();
     dmm.push_back(summed); 
+    if (is_packed) this->packRow(summed);
 }
 
 void DMapMatrix::normalize() {
     for (auto it=begin(); it!=end(); ++it) {
         (*it)->normalize();
     }
+    if (is_packed) this->pack();
 }
 
 void DMapMatrix::convolve(int N, int L) {
     for (auto it=begin(); it!=end(); ++it) {
         (*it)->convolve(N, L);
     }
+    if (is_packed) this->pack();
 }
 
 void DMapMatrix::slicePython(bpy::list &py_idcs) {
@@ -634,11 +972,20 @@ void DMapMatrix::slice(std::vector<int> &idcs) {
     for (auto it=begin(); it!=end(); ++it) {
         (*it)->slice(idcs);
     }
+    if (is_packed) this->pack();
 }
 
 void DMapMatrix::dot(DMapMatrix *other, matrix_t &output) {
     assert(output.size1() == this->rows() && output.size2() == other->rows() &&
         "Output matrix dimensions incompatible with input"); 
+    if (this->isPacked() && other->isPacked()) {
+        for (int i=0; i<this->rows(); ++i) {
+            for (int j=0; j<other->rows(); ++j) {
+                output(i,j) = this->dotPacked(i, other, j);
+            }
+        }
+        return;
+    }
     int i = 0;
     for (auto it=begin(); it!=end(); ++it, ++i) {
         int j = 0;
@@ -651,6 +998,15 @@ void DMapMatrix::dot(DMapMatrix *other, matrix_t &output) {
 void DMapMatrix::dotFilter(DMapMatrix *other, matrix_t &output) {
     assert(output.size1() == this->rows() && output.size2() == other->rows() &&
         "Output matrix dimensions incompatible with input"); 
+    if (this->isPacked() && other->isPacked()) {
+        for (int i=0; i<this->rows(); ++i) {
+            for (int j=0; j<other->rows(); ++j) {
+                output(i,j) = (dmm[i]->filter == other->dmm[j]->filter) ?
+                    this->dotPacked(i, other, j) : 0.0;
+            }
+        }
+        return;
+    }
     int i = 0;
     for (auto it=begin(); it!=end(); ++it, ++i) {
         int j = 0;
@@ -664,7 +1020,16 @@ void dmm_inner_product(DMapMatrix &AX, DMapMatrix &BX, double power,
         bool filter, DMapMatrix::matrix_t &output) {
     assert(output.size1() == AX.rows() && output.size2() == BX.rows() &&
         "Output matrix dimensions incompatible with input"); 
-    if (filter) {
+    if (AX.isPacked() && BX.isPacked()) {
+        for (int i=0; i<AX.rows(); ++i) {
+            DMap *a = AX.getRow(i);
+            for (int j=0; j<BX.rows(); ++j) {
+                double k = (filter && a->filter != BX.getRow(j)->filter) ?
+                    0.0 : AX.dotPacked(i, &BX, j);
+                output(i,j) = std::pow(k, power);
+            }
+        }
+    } else if (filter) {
         int i = 0;
         for (auto it=AX.begin(); it!=AX.end(); ++it, ++i) {
             int j = 0;
@@ -683,9 +1048,210 @@ void dmm_inner_product(DMapMatrix &AX, DMapMatrix &BX, double power,
     }
 }
 
+void dmm_inner_product_gemm(DMapMatrix &AX, DMapMatrix &BX, double power, 
+        bool filter, DMapMatrix::matrix_t &output) {
+    assert(output.size1() == AX.rows() && output.size2() == BX.rows() &&
+        "Output matrix dimensions incompatible with input"); 
+    typedef std::pair<int, DMap::vec_t*> row_channel_t;
+    typedef std::map<TypeEncoder::code_t, std::vector<row_channel_t> > channel_rows_t;
+    typedef std::pair<std::vector<int>, std::vector<int> > block_t;
+    // Quantized rows are contracted pairwise, without dense copies
+    if (AX.isQuantized() || BX.isQuantized()) {
+        dmm_inner_product(AX, BX, power, filter, output);
+        return;
+    }
+    for (int i=0; i<output.size1(); ++i)
+        for (int j=0; j<output.size2(); ++j) output(i,j) = 0.0;
+    // Row blocks: All rows or, if filter, rows grouped by filter
+    std::map<std::string, block_t> blocks;
+    for (int i=0; i<AX.rows(); ++i)
+        blocks[(filter) ? AX.getRow(i)->filter : ""].first.push_back(i);
+    for (int j=0; j<BX.rows(); ++j)
+        blocks[(filter) ? BX.getRow(j)->filter : ""].second.push_back(j);
+    DMapMatrix::matrix_t A;
+    DMapMatrix::matrix_t B;
+    DMapMatrix::matrix_t C;
+    for (auto bt=blocks.begin(); bt!=blocks.end(); ++bt) {
+        std::vector<int> &rows_a = bt->second.first;
+        std::vector<int> &rows_b = bt->second.second;
+        if (rows_a.size() == 0 || rows_b.size() == 0) continue;
+        // Rows that carry a given channel
+        channel_rows_t channels_a;
+        channel_rows_t channels_b;
+        for (int i : rows_a) {
+            DMap *a = AX.getRow(i);
+            for (auto it=a->begin(); it!=a->end(); ++it)
+                channels_a[it->first].push_back(row_channel_t(i, it->second));
+        }
+        for (int j : rows_b) {
+            DMap *b = BX.getRow(j);
+            for (auto jt=b->begin(); jt!=b->end(); ++jt)
+                channels_b[jt->first].push_back(row_channel_t(j, jt->second));
+        }
+        // K += A_c.B_c^T for every shared channel c
+        for (auto it=channels_a.begin(); it!=channels_a.end(); ++it) {
+            auto jt = channels_b.find(it->first);
+            if (jt == channels_b.end()) continue;
+            std::vector<row_channel_t> &ca = it->second;
+            std::vector<row_channel_t> &cb = jt->second;
+            int na = ca.size();
+            int nb = cb.size();
+            int dim = ca[0].second->size();
+            if (dim == 0) continue;
+            A.resize(na, dim, false);
+            B.resize(nb, dim, false);
+            C.resize(na, nb, false);
+            for (int r=0; r<na; ++r) {
+                assert(ca[r].second->size() == dim && "Inconsistent channel dimension");
+                std::copy(ca[r].second->begin(), ca[r].second->end(), &A(r,0));
+            }
+            for (int s=0; s<nb; ++s) {
+                assert(cb[s].second->size() == dim && "Inconsistent channel dimension");
+                std::copy(cb[s].second->begin(), cb[s].second->end(), &B(s,0));
+            }
+            soap::linalg::linalg_matrix_dot(A, B, C, 1.0, 0.0, false, true);
+            for (int r=0; r<na; ++r) {
+                int i = ca[r].first;
+                for (int s=0; s<nb; ++s) output(i, cb[s].first) += C(r,s);
+            }
+        }
+    }
+    if (power != 1.0) {
+        for (int i=0; i<output.size1(); ++i)
+            for (int j=0; j<output.size2(); ++j)
+                output(i,j) = std::pow(output(i,j), power);
+    }
+}
+
+void DMapMatrix::dotGradLeft(DMapMatrix *other, double power, matrix_t &K,
+        matrix_t &dK, std::vector<int> &pids) {
+    // Batched version of DMap::dotGradLeft (with coeff = 1) for all
+    // environments (rows, with gradients) of one structure and all rows of
+    // other (e.g., sparse points):
+    // K(i,j)       = (x_i.y_j)^power
+    // dK(3*p+d, j) = sum_i power*(x_i.y_j)^(power-1) * dx_i/dr_{pids[p],d}.y_j
+    // The channels of other are gathered into dense matrices Y_c once, the
+    // gradients of each environment are then contracted per channel with one
+    // GEMM, (grad. components of channel c) x Y_c^T.
+    typedef std::pair<int, vec_t*> row_channel_t;
+    typedef std::map<TypeEncoder::code_t, std::vector<row_channel_t> > channel_rows_t;
+    int n_env = this->rows();
+    int n_other = other->rows();
+    // Dense channels of other, rows without the channel stay zero
+    std::map<TypeEncoder::code_t, matrix_t> Y;
+    for (int j=0; j<n_other; ++j) {
+        DMap *y = other->getRow(j);
+        std::vector<dtype_t> buffer;
+        for (int s=0; s<y->size(); ++s) {
+            int dim = y->channelSize(s);
+            auto yt = Y.find(y->code(s));
+            if (yt == Y.end()) yt = Y.insert(std::make_pair(y->code(s),
+                matrix_t(ub::zero_matrix<dtype_t>(n_other, dim)))).first;
+            assert(yt->second.size2() == dim && "Inconsistent channel dimension");
+            const dtype_t *v = y->channelValues(s, buffer);
+            std::copy(v, v+dim, &(yt->second)(j,0));
+        }
+    }
+    // Particle ids of all gradients
+    std::map<int, int> pid_index;
+    for (auto it=begin(); it!=end(); ++it)
+        for (auto gt=(*it)->beginGradients(); gt!=(*it)->endGradients(); ++gt)
+            pid_index[(*gt)->pid] = 0;
+    pids.clear();
+    for (auto pt=pid_index.begin(); pt!=pid_index.end(); ++pt) {
+        pt->second = pids.size();
+        pids.push_back(pt->first);
+    }
+    int n_pids = pids.size();
+    K.resize(n_env, n_other, false);
+    dK = ub::zero_matrix<dtype_t>(3*n_pids, n_other);
+    #pragma omp parallel
+    {
+        matrix_t dK_thread = ub::zero_matrix<dtype_t>(3*n_pids, n_other);
+        std::vector<dtype_t> k(n_other);
+        std::vector<dtype_t> w(n_other);
+        channel_rows_t channels;
+        matrix_t G;
+        matrix_t P;
+        std::vector<dtype_t> buffer;
+        #pragma omp for schedule(dynamic)
+        for (int i=0; i<n_env; ++i) {
+            DMap *x = this->getRow(i);
+            std::fill(k.begin(), k.end(), 0.0);
+            for (int s=0; s<x->size(); ++s) {
+                auto yt = Y.find(x->code(s));
+                int dim = x->channelSize(s);
+                if (yt == Y.end() || dim == 0) continue;
+                const dtype_t *xc = x->channelValues(s, buffer);
+                for (int j=0; j<n_other; ++j) {
+                    const dtype_t *yc = &(yt->second)(j,0);
+                    dtype_t r12 = 0.0;
+                    for (int a=0; a<dim; ++a) r12 += xc[a]*yc[a];
+                    k[j] += r12;
+                }
+            }
+            for (int j=0; j<n_other; ++j) {
+                K(i,j) = std::pow(k[j], power);
+                w[j] = power*std::pow(k[j], power-1);
+            }
+            // Gradient components grouped by channel
+            for (auto ct=channels.begin(); ct!=channels.end(); ++ct) ct->second.clear();
+            for (auto gt=x->beginGradients(); gt!=x->endGradients(); ++gt) {
+                int p = pid_index.find((*gt)->pid)->second;
+                for (int d=0; d<3; ++d) {
+                    DMap *g = (*gt)->get(d);
+                    for (auto it=g->begin(); it!=g->end(); ++it)
+                        channels[it->first].push_back(row_channel_t(3*p+d, it->second));
+                }
+            }
+            for (auto ct=channels.begin(); ct!=channels.end(); ++ct) {
+                std::vector<row_channel_t> &rows_c = ct->second;
+                auto yt = Y.find(ct->first);
+                if (rows_c.size() == 0 || yt == Y.end()) continue;
+                int n_rows = rows_c.size();
+                int dim = yt->second.size2();
+                if (dim == 0) continue;
+                G.resize(n_rows, dim, false);
+                P.resize(n_rows, n_other, false);
+                for (int r=0; r<n_rows; ++r) {
+                    assert(rows_c[r].second->size() == dim && "Inconsistent channel dimension");
+                    std::copy(rows_c[r].second->begin(), rows_c[r].second->end(), &G(r,0));
+                }
+                soap::linalg::linalg_matrix_dot(G, yt->second, P, 1.0, 0.0, false, true);
+                for (int r=0; r<n_rows; ++r) {
+                    int row = rows_c[r].first;
+                    for (int j=0; j<n_other; ++j) dK_thread(row,j) += w[j]*P(r,j);
+                }
+            }
+        }
+        #pragma omp critical
+        {
+            dK += dK_thread;
+        }
+    }
+}
+
+boost::python::tuple DMapMatrix::dotGradLeftNumpy(DMapMatrix *other, double power,
+        std::string np_dtype) {
+    // (K, dK, pids), see dotGradLeft
+    soap::linalg::numpy_converter npc(np_dtype.c_str());
+    matrix_t K;
+    matrix_t dK;
+    std::vector<int> pids;
+    this->dotGradLeft(other, power, K, dK, pids);
+    boost::python::list py_pids;
+    for (int pid : pids) py_pids.append(pid);
+    return boost::python::make_tuple(
+        npc.ublas_to_numpy<double>(K),
+        npc.ublas_to_numpy<double>(dK),
+        py_pids);
+}
+
 boost::python::object DMapMatrix::dotNumpy(DMapMatrix *other, std::string np_dtype) {
     soap::linalg::numpy_converter npc(np_dtype.c_str());
     DMapMatrix::matrix_t output(this->rows(), other->rows(), 0.0);
+    this->syncPack();
+    other->syncPack();
     this->dot(other, output);
     return npc.ublas_to_numpy<double>(output);
 }
@@ -693,6 +1259,8 @@ boost::python::object DMapMatrix::dotNumpy(DMapMatrix *other, std::string np_dty
 boost::python::object DMapMatrix::dotFilterNumpy(DMapMatrix *other, std::string np_dtype) {
     soap::linalg::numpy_converter npc(np_dtype.c_str());
     DMapMatrix::matrix_t output(this->rows(), other->rows(), 0.0);
+    this->syncPack();
+    other->syncPack();
     this->dotFilter(other, output);
     return npc.ublas_to_numpy<double>(output);
 }
@@ -705,6 +1273,7 @@ void DMapMatrix::save(std::string archfile) {
 }
 
 void DMapMatrix::load(std::string archfile) {
+    this->unpack();
 	std::ifstream ifs(archfile.c_str());
 	boost::archive::binary_iarchive arch(ifs);
 	arch >> (*this);
@@ -719,6 +1288,7 @@ std::string DMapMatrix::dumps() {
 }
 
 void DMapMatrix::loads(std::string pstr) {
+    this->unpack();
     std::stringstream ss;
     ss << pstr;
     boost::archive::binary_iarchive arch(ss);
@@ -742,6 +1312,9 @@ void DMapMatrix::registerPython() {
         .def("append", appendDMap)
         .def("append", appendSpectrum)
         .def("appendCoherent", &DMapMatrix::appendCoherent)
+        .add_property("packed", &DMapMatrix::isPacked)
+        .def("pack", &DMapMatrix::pack)
+        .def("unpack", &DMapMatrix::unpack)
         .def("clear", &DMapMatrix::clear)
         .def("sum", &DMapMatrix::sum)
         .def("slice", &DMapMatrix::slicePython)
@@ -749,31 +1322,217 @@ void DMapMatrix::registerPython() {
         .def("convolve", &DMapMatrix::convolve)
         .def("dot", &DMapMatrix::dotNumpy)
         .def("dotFilter", &DMapMatrix::dotFilterNumpy)
+        .def("dotGradLeft", &DMapMatrix::dotGradLeftNumpy)
+        .def("quantize", &DMapMatrix::quantize)
+        .def("dequantize", &DMapMatrix::dequantize)
         .def("dumps", &DMapMatrix::dumps)
         .def("loads", &DMapMatrix::loads)
         .def("load", &DMapMatrix::load)
         .def("save", &DMapMatrix::save);
 }
 
-DMapMatrixSet::DMapMatrixSet() : is_view(false) {
+// Indexed archive: magic, position of the index (int64), the matrices as
+// separate binary archives, the index (binary archive)
+const char DMapMatrixLoader::magic[9] = "SOAPDMI1";
+
+DMapMatrixLoader::DMapMatrixLoader(std::string archfile_arg, double budget_mb,
+        int n_prefetch_arg) : archfile(archfile_arg), n_bytes(0),
+        n_prefetch(n_prefetch_arg), n_reads(0), last_idx(-1) {
+    if (!DMapMatrixLoader::readIndex(archfile, index)) throw soap::base::IOError(
+        "'" + archfile + "' is not an indexed archive");
+    budget = (budget_mb > 0.) ? long(budget_mb*1024*1024) : 0;
+    resident.resize(index.offsets.size(), NULL);
+    lru_pos.resize(index.offsets.size());
+    n_pins.resize(index.offsets.size(), 0);
+}
+
+DMapMatrixLoader::~DMapMatrixLoader() {
+    if (prefetch_job.valid()) prefetch_job.wait();
+    for (auto it=resident.begin(); it!=resident.end(); ++it) delete *it;
+    resident.clear();
+    lru.clear();
+}
+
+void DMapMatrixLoader::writeIndex(std::ostream &ofs, index_t &index) {
+    std::int64_t pos = ofs.tellp();
+    {
+        boost::archive::binary_oarchive arch(ofs);
+        arch << index;
+    }
+    ofs.seekp(sizeof(magic)-1);
+    ofs.write(reinterpret_cast<const char*>(&pos), sizeof(pos));
+    ofs.seekp(0, std::ios::end);
+}
+
+bool DMapMatrixLoader::readIndex(std::string archfile, index_t &index) {
+    std::ifstream ifs(archfile.c_str(), std::ios::binary);
+    if (!ifs) throw soap::base::IOError("Cannot open '" + archfile + "'");
+    char head[sizeof(magic)] = { 0 };
+    ifs.read(head, sizeof(magic)-1);
+    if (!ifs || std::string(head) != std::string(magic)) return false;
+    std::int64_t pos = 0;
+    ifs.read(reinterpret_cast<char*>(&pos), sizeof(pos));
+    ifs.seekg(pos);
+    if (!ifs || pos <= 0) throw soap::base::IOError(
+        "Corrupt index in '" + archfile + "'");
+    boost::archive::binary_iarchive arch(ifs);
+    arch >> index;
+    return true;
+}
+
+DMapMatrix *DMapMatrixLoader::readMatrix(std::istream &ifs, long int offset) {
+    DMapMatrix *dmm = new DMapMatrix();
+    ifs.seekg(offset);
+    boost::archive::binary_iarchive arch(ifs);
+    arch >> (*dmm);
+    return dmm;
+}
+
+DMapMatrix *DMapMatrixLoader::get(int idx) {
+    return this->acquire(idx, false);
+}
+
+DMapMatrix *DMapMatrixLoader::pin(int idx) {
+    return this->acquire(idx, true);
+}
+
+int DMapMatrixLoader::pinResident(DMapMatrix *dmm) {
+    // Index of dmm if resident (then pinned), -1 otherwise
+    std::lock_guard<std::mutex> lock(mutex);
+    if (dmm == NULL) return -1;
+    for (int idx=0; idx<this->size(); ++idx) {
+        if (resident[idx] == dmm) {
+            n_pins[idx] += 1;
+            return idx;
+        }
+    }
+    return -1;
+}
+
+void DMapMatrixLoader::unpin(int idx) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (idx < 0 || idx >= this->size() || n_pins[idx] <= 0)
+        throw soap::base::SanityCheckFailed(
+            "Matrix " + lexical_cast<std::string>(idx, "") + " not pinned");
+    n_pins[idx] -= 1;
+    if (n_pins[idx] == 0) this->evict(idx);
+}
+
+DMapMatrix *DMapMatrixLoader::acquire(int idx, bool pin) {
+    if (idx < 0 || idx >= this->size()) throw soap::base::OutOfRange(
+        "Index " + lexical_cast<std::string>(idx, ""));
+    DMapMatrix *dmm = NULL;
+    bool sequential = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        sequential = (idx == last_idx+1);
+        last_idx = idx;
+        dmm = resident[idx];
+        if (dmm) {
+            this->touch(idx);
+            if (pin) n_pins[idx] += 1;
+        }
+    }
+    if (dmm == NULL) {
+        // Read without holding the lock, another thread (or the read-ahead)
+        // may meanwhile have read the same matrix: Keep the first copy.
+        std::ifstream ifs(archfile.c_str(), std::ios::binary);
+        DMapMatrix *loaded = DMapMatrixLoader::readMatrix(ifs, index.offsets[idx]);
+        std::lock_guard<std::mutex> lock(mutex);
+        n_reads += 1;
+        if (resident[idx] == NULL) this->insert(idx, loaded);
+        else delete loaded;
+        dmm = resident[idx];
+        this->touch(idx);
+        if (pin) n_pins[idx] += 1;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (sequential && n_prefetch > 0 && idx+1 < this->size()) {
+        // One read-ahead at a time
+        if (!prefetch_job.valid() || prefetch_job.wait_for(
+                std::chrono::seconds(0)) == std::future_status::ready) {
+            prefetch_job = std::async(std::launch::async, &DMapMatrixLoader::prefetch,
+                this, idx+1, std::min(idx+1+n_prefetch, this->size()));
+        }
+    }
+    this->evict(idx);
+    return dmm;
+}
+
+void DMapMatrixLoader::prefetch(int first, int last) {
+    std::ifstream ifs(archfile.c_str(), std::ios::binary);
+    for (int idx=first; idx<last; ++idx) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (resident[idx] != NULL) continue;
+        }
+        DMapMatrix *loaded = DMapMatrixLoader::readMatrix(ifs, index.offsets[idx]);
+        std::lock_guard<std::mutex> lock(mutex);
+        n_reads += 1;
+        if (resident[idx] == NULL) this->insert(idx, loaded);
+        else delete loaded;
+    }
+}
+
+void DMapMatrixLoader::insert(int idx, DMapMatrix *dmm) {
+    // Requires lock
+    resident[idx] = dmm;
+    lru.push_front(idx);
+    lru_pos[idx] = lru.begin();
+    n_bytes += index.sizes[idx];
+}
+
+void DMapMatrixLoader::touch(int idx) {
+    // Requires lock
+    lru.splice(lru.begin(), lru, lru_pos[idx]);
+}
+
+void DMapMatrixLoader::evict(int keep) {
+    // Requires lock. Releases unpinned matrices other than keep, least
+    // recently used first
+    auto it = lru.end();
+    while (budget > 0 && n_bytes > budget && it != lru.begin()) {
+        --it;
+        int idx = *it;
+        if (idx == keep || n_pins[idx] > 0) continue;
+        it = lru.erase(it);
+        delete resident[idx];
+        resident[idx] = NULL;
+        n_bytes -= index.sizes[idx];
+    }
+}
+
+int DMapMatrixLoader::countResident() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return lru.size();
+}
+
+int DMapMatrixLoader::countPinned() {
+    std::lock_guard<std::mutex> lock(mutex);
+    int n = 0;
+    for (auto it=n_pins.begin(); it!=n_pins.end(); ++it) if (*it > 0) ++n;
+    return n;
+}
+
+double DMapMatrixLoader::getResidentMB() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return double(n_bytes)/(1024*1024);
+}
+
+DMapMatrixSet::DMapMatrixSet() : is_view(false), loader(NULL) {
     ;
 }
 
-DMapMatrixSet::DMapMatrixSet(bool set_as_view) : is_view(set_as_view) {
+DMapMatrixSet::DMapMatrixSet(bool set_as_view) : is_view(set_as_view), loader(NULL) {
     ;
 }
 
-DMapMatrixSet::DMapMatrixSet(std::string archfile) : is_view(false) {
+DMapMatrixSet::DMapMatrixSet(std::string archfile) : is_view(false), loader(NULL) {
     this->load(archfile);
 }
 
 DMapMatrixSet::~DMapMatrixSet() {
-    if (!is_view) {
-        for (auto it=begin(); it!=end(); ++it) delete *it;
-    }
-    dset.clear();
-    for (auto it=views.begin(); it!=views.end(); ++it) delete *it;
-    views.clear();
+    this->clear();
 }
 
 void DMapMatrixSet::clear() {
@@ -783,9 +1542,31 @@ void DMapMatrixSet::clear() {
     dset.clear();
     for (auto it=views.begin(); it!=views.end(); ++it) delete *it;
     views.clear();
+    if (loader) delete loader;
+    loader = NULL;
+}
+
+void DMapMatrixSet::assertNotLazy(std::string op) {
+    if (loader) throw soap::base::SanityCheckFailed(
+        op + " not permitted on lazily loaded matrix set");
+}
+
+bpy::object DMapMatrixSet::getItemPython(int idx) {
+    // Matrices of a lazy set may be released by any later access, hence
+    // Python owns a copy of these
+    if (loader) {
+        DMapMatrixPin pin(this, idx);
+        DMapMatrix *copy = new DMapMatrix();
+        copy->loads(pin.get()->dumps());
+        bpy::manage_new_object::apply<DMapMatrix*>::type convert;
+        return bpy::object(bpy::handle<>(convert(copy)));
+    }
+    bpy::reference_existing_object::apply<DMapMatrix*>::type convert;
+    return bpy::object(bpy::handle<>(convert(dset[idx])));
 }
 
 DMapMatrixSet *DMapMatrixSet::getView(boost::python::list idcs) {
+    this->assertNotLazy("View of");
     DMapMatrixSet *view = new DMapMatrixSet(false);
     for (int i=0; i<boost::python::len(idcs); ++i) {
         int idx = boost::python::extract<int>(idcs[i]);
@@ -797,12 +1578,15 @@ DMapMatrixSet *DMapMatrixSet::getView(boost::python::list idcs) {
 }
 
 void DMapMatrixSet::append(DMapMatrix *dmap) {
+    this->assertNotLazy("Appending to");
     dset.push_back(dmap);
 }
 
 void DMapMatrixSet::extend(DMapMatrixSet *other) {
     if (this->is_view) throw soap::base::SanityCheckFailed(
         "Extending matrix view not permitted.");
+    this->assertNotLazy("Extending");
+    other->assertNotLazy("Extending by");
     for (auto it=other->begin(); it!=other->end(); ++it) {
         dset.push_back(*it);
     }
@@ -810,19 +1594,93 @@ void DMapMatrixSet::extend(DMapMatrixSet *other) {
 }
 
 void DMapMatrixSet::save(std::string archfile) {
+    this->assertNotLazy("Saving");
+    encoder_types = ENCODER.getOrder();
     std::ofstream ofs(archfile.c_str());
     boost::archive::binary_oarchive arch(ofs);
     arch << (*this);
     return;
 }
 
+void DMapMatrixSet::saveIndexed(std::string archfile) {
+    // Layout see DMapMatrixLoader, read with load(...) or loadLazy(...)
+    this->assertNotLazy("Saving");
+    encoder_types = ENCODER.getOrder();
+    DMapMatrixLoader::index_t index;
+    index.encoder_types = encoder_types;
+    std::ofstream ofs(archfile.c_str(), std::ios::binary);
+    std::int64_t pos = 0;
+    ofs.write(DMapMatrixLoader::magic, sizeof(DMapMatrixLoader::magic)-1);
+    ofs.write(reinterpret_cast<const char*>(&pos), sizeof(pos));
+    for (auto it=begin(); it!=end(); ++it) {
+        long int offset = ofs.tellp();
+        {
+            boost::archive::binary_oarchive arch(ofs);
+            arch << (**it);
+        }
+        index.offsets.push_back(offset);
+        index.sizes.push_back(long(ofs.tellp()) - offset);
+    }
+    DMapMatrixLoader::writeIndex(ofs, index);
+    if (!ofs) throw soap::base::IOError("Failed to write '" + archfile + "'");
+}
+
 void DMapMatrixSet::load(std::string archfile) {
+    // Plain or indexed archive, the latter is read completely
+    if (loader) this->clear();
+    encoder_types.clear();
+    DMapMatrixLoader::index_t index;
+    if (DMapMatrixLoader::readIndex(archfile, index)) {
+        std::ifstream ifs(archfile.c_str(), std::ios::binary);
+        dset.clear();
+        is_view = false;
+        for (auto it=index.offsets.begin(); it!=index.offsets.end(); ++it)
+            dset.push_back(DMapMatrixLoader::readMatrix(ifs, *it));
+        encoder_types = index.encoder_types;
+        this->checkEncoder(archfile);
+        return;
+    }
 	std::ifstream ifs(archfile.c_str());
 	boost::archive::binary_iarchive arch(ifs);
 	arch >> (*this);
+    this->checkEncoder(archfile);
 	return;
 }
 
+void DMapMatrixSet::loadLazy(std::string archfile, double budget_mb, int n_prefetch) {
+    this->clear();
+    is_view = false;
+    loader = new DMapMatrixLoader(archfile, budget_mb, n_prefetch);
+    encoder_types = loader->getEncoderTypes();
+    this->checkEncoder(archfile);
+}
+
+void DMapMatrixSet::checkEncoder(std::string archfile) {
+    // The channel codes of the archive are only meaningful with the types
+    // they were encoded with. Codes agree if one order is a prefix of the
+    // other: Missing types are then appended to the (unfrozen) encoder, so
+    // that DMaps already in memory keep their codes. Any other order is
+    // rejected. Archives written before the types were stored are not checked.
+    if (encoder_types.size() == 0) return;
+    TypeEncoder::order_t current = ENCODER.getOrder();
+    std::size_t n_common = std::min(current.size(), encoder_types.size());
+    bool is_prefix = std::equal(encoder_types.begin(),
+        encoder_types.begin()+n_common, current.begin());
+    if (is_prefix && encoder_types.size() <= current.size()) return;
+    std::string types = "";
+    for (auto it=encoder_types.begin(); it!=encoder_types.end(); ++it)
+        types += ((it == encoder_types.begin()) ? "" : ",") + (*it);
+    if (!is_prefix) throw soap::base::SanityCheckFailed(
+        "Dataset '" + archfile + "' encoded with types " + types
+        + ", inconsistent with type encoder");
+    if (ENCODER.isFrozen()) throw soap::base::SanityCheckFailed(
+        "Dataset '" + archfile + "' encoded with types " + types
+        + ", not all of which are known to the frozen type encoder");
+    GLOG() << "Extending type encoder for '" << archfile << "': " << types << std::endl;
+    for (std::size_t i=current.size(); i<encoder_types.size(); ++i)
+        ENCODER.add(encoder_types[i]);
+}
+
 void DMapMatrixSet::slicePython(bpy::list &py_idcs) {
     std::vector<int> idcs;
     for (int i=0; i<bpy::len(py_idcs); ++i) {
@@ -832,6 +1690,7 @@ void DMapMatrixSet::slicePython(bpy::list &py_idcs) {
 }
 
 void DMapMatrixSet::slice(std::vector<int> &idcs) {
+    this->assertNotLazy("Slicing");
     for (auto it=begin(); it!=end(); ++it) {
         (*it)->slice(idcs);
     }
@@ -842,22 +1701,28 @@ void DMapMatrixSet::registerPython() {
     class_<DMapMatrixSet, DMapMatrixSet*>("DMapMatrixSet", init<>())
         .def(init<std::string>())
         .def("__len__", &DMapMatrixSet::size)
-        .def("__getitem__", &DMapMatrixSet::get, return_value_policy<reference_existing_object>())
+        .def("__getitem__", &DMapMatrixSet::getItemPython)
         .def("__getitem__", &DMapMatrixSet::getView, return_value_policy<reference_existing_object>())
         .add_property("size", &DMapMatrixSet::size)
+        .add_property("is_lazy", &DMapMatrixSet::isLazy)
+        .add_property("n_resident", &DMapMatrixSet::countResident)
+        .add_property("n_pinned", &DMapMatrixSet::countPinned)
         .def("save", &DMapMatrixSet::save)
+        .def("saveIndexed", &DMapMatrixSet::saveIndexed)
         .def("load", &DMapMatrixSet::load)
+        .def("loadLazy", &DMapMatrixSet::loadLazy)
         .def("slice", &DMapMatrixSet::slicePython)
         .def("clear", &DMapMatrixSet::clear)
         .def("append", &DMapMatrixSet::append)
         .def("extend", &DMapMatrixSet::extend);
 }
 
-BlockLaplacian::BlockLaplacian() : n_rows(0), n_cols(0) {
+BlockLaplacian::BlockLaplacian() : n_rows(0), n_cols(0), max_fill(0.1) {
     ;
 }
 
-BlockLaplacian::BlockLaplacian(std::string archfile) : n_rows(0), n_cols(0) {
+BlockLaplacian::BlockLaplacian(std::string archfile) : n_rows(0), n_cols(0),
+        max_fill(0.1) {
     this->load(archfile);
 }
 
@@ -866,6 +1731,10 @@ BlockLaplacian::~BlockLaplacian() {
         delete *it;
     }
     blocks.clear();
+    for (auto it=sparse_blocks.begin(); it!=sparse_blocks.end(); ++it) {
+        if (*it) delete *it;
+    }
+    sparse_blocks.clear();
 }
 
 BlockLaplacian::block_t *BlockLaplacian::addBlock(int n_rows_block, int n_cols_block) {
@@ -873,14 +1742,42 @@ BlockLaplacian::block_t *BlockLaplacian::addBlock(int n_rows_block, int n_cols_b
     n_rows += n_rows_block;
     n_cols += n_cols_block;
     blocks.push_back(new_block);
+    sparse_blocks.push_back(NULL);
     return new_block;
 }
 
+int BlockLaplacian::blockRows(int idx) {
+    return (sparse_blocks[idx]) ? sparse_blocks[idx]->n_rows : blocks[idx]->size1();
+}
+
+int BlockLaplacian::blockCols(int idx) {
+    return (sparse_blocks[idx]) ? sparse_blocks[idx]->n_cols : blocks[idx]->size2();
+}
+
 boost::python::object BlockLaplacian::getBlockNumpy(int idx, std::string np_dtype) {
     soap::linalg::numpy_converter npc(np_dtype.c_str());
+    if (idx < 0 || idx >= int(blocks.size())) throw soap::base::OutOfRange(
+        "Block " + lexical_cast<std::string>(idx, ""));
+    if (sparse_blocks[idx]) {
+        block_t block;
+        this->getBlockDense(idx, block);
+        return npc.ublas_to_numpy<dtype_t>(block);
+    }
     return npc.ublas_to_numpy<dtype_t>(*blocks[idx]);
 }
 
+void BlockLaplacian::getBlockDense(int idx, block_t &output) {
+    // Dense copy of a block, also if stored as CSR
+    if (!sparse_blocks[idx]) {
+        output = *blocks[idx];
+        return;
+    }
+    csr_block_t &csr = *sparse_blocks[idx];
+    output = ub::zero_matrix<dtype_t>(csr.n_rows, csr.n_cols);
+    for (int i=0; i<csr.n_rows; ++i)
+        for (int p=csr.ptr[i]; p<csr.ptr[i+1]; ++p) output(i, csr.idx[p]) = csr.val[p];
+}
+
 void BlockLaplacian::appendNumpy(boost::python::object &np_array, std::string np_dtype) {
     soap::linalg::numpy_converter npc(np_dtype.c_str());
     block_t *new_block = new block_t();
@@ -888,6 +1785,50 @@ void BlockLaplacian::appendNumpy(boost::python::object &np_array, std::string np
     n_rows += new_block->size1();
     n_cols += new_block->size2();
     blocks.push_back(new_block);
+    sparse_blocks.push_back(NULL);
+    this->compressBlock(blocks.size()-1);
+}
+
+void BlockLaplacian::compress() {
+    // Dense blocks filled after addBlock(...) are converted only here
+    for (int idx=0; idx<int(blocks.size()); ++idx) this->compressBlock(idx);
+}
+
+void BlockLaplacian::compressBlock(int idx) {
+    // Converts a dense block to CSR if its fill ratio is <= max_fill
+    if (sparse_blocks[idx]) return;
+    block_t &block = *blocks[idx];
+    int nr = block.size1();
+    int nc = block.size2();
+    std::size_t nnz = 0;
+    for (int i=0; i<nr; ++i)
+        for (int j=0; j<nc; ++j)
+            if (block(i,j) != 0.0) ++nnz;
+    if (nr*nc == 0 || double(nnz) > max_fill*double(nr)*double(nc)) return;
+    csr_block_t *csr = new csr_block_t();
+    csr->n_rows = nr;
+    csr->n_cols = nc;
+    csr->ptr.reserve(nr+1);
+    csr->idx.reserve(nnz);
+    csr->val.reserve(nnz);
+    csr->ptr.push_back(0);
+    for (int i=0; i<nr; ++i) {
+        for (int j=0; j<nc; ++j) {
+            if (block(i,j) == 0.0) continue;
+            csr->idx.push_back(j);
+            csr->val.push_back(block(i,j));
+        }
+        csr->ptr.push_back(csr->idx.size());
+    }
+    block.resize(0, 0, false);
+    sparse_blocks[idx] = csr;
+}
+
+int BlockLaplacian::countSparse() {
+    int n_sparse = 0;
+    for (auto it=sparse_blocks.begin(); it!=sparse_blocks.end(); ++it)
+        if (*it) ++n_sparse;
+    return n_sparse;
 }
 
 void BlockLaplacian::save(std::string archfile) {
@@ -914,31 +1855,72 @@ boost::python::object BlockLaplacian::dotNumpy(
     return npc.ublas_to_numpy<double>(output);
 }
 
+static void csr_block_dot(BlockLaplacian::csr_block_t &csr, 
+        BlockLaplacian::block_t &other, BlockLaplacian::block_t &output, 
+        int i_off, int j_off) {
+    // output[i_off+i,:] += sum_p val[p]*other[j_off+idx[p],:]
+    int n = other.size2();
+    for (int i=0; i<csr.n_rows; ++i) {
+        double *out_i = &output(i_off+i, 0);
+        for (int p=csr.ptr[i]; p<csr.ptr[i+1]; ++p) {
+            const double *other_j = &other(j_off+csr.idx[p], 0);
+            double v = csr.val[p];
+            for (int k=0; k<n; ++k) out_i[k] += v*other_j[k];
+        }
+    }
+}
+
 void BlockLaplacian::dot(block_t &other, block_t &output) {
     assert(n_cols == other.size1() && output.size1() == n_rows 
         && output.size2() == other.size2() && "Inconsistent matrix dimensions");
-    int i_off = 0;
-    int j_off = 0;
-    for (auto it=begin(); it!=end(); ++it) {
-        block_t &block = *(*it);
-        // Manual version, for speed-up see library version below
-        //for (int i=0; i<block.size1(); ++i) {
-        //    for (int k=0; k<other.size2(); ++k) {
-        //        double out_ik = 0.0;
-        //        for (int j=0; j<block.size2(); ++j) {
-        //            out_ik += block(i,j)*other(j_off+j, k);
-        //        }
-        //        output(i_off+i,k) = out_ik;
-        //    }
-        //}
-        soap::linalg::linalg_matrix_block_dot(
-            block,
-            other,
-            output,
-            i_off,
-            j_off);
-        i_off += block.size1();
-        j_off += block.size2();
+    int n_blocks = blocks.size();
+    int n = other.size2();
+    if (n == 0) return;
+    // Blocks write to disjoint row ranges of the output: Parallel over blocks
+    std::vector<int> i_off(n_blocks+1, 0);
+    std::vector<int> j_off(n_blocks+1, 0);
+    for (int s=0; s<n_blocks; ++s) {
+        i_off[s+1] = i_off[s] + this->blockRows(s);
+        j_off[s+1] = j_off[s] + this->blockCols(s);
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for (int s=0; s<n_blocks; ++s) {
+        for (int i=i_off[s]; i<i_off[s+1]; ++i)
+            for (int k=0; k<n; ++k) output(i,k) = 0.0;
+        if (i_off[s+1] == i_off[s] || j_off[s+1] == j_off[s]) continue;
+        if (sparse_blocks[s]) {
+            csr_block_dot(*sparse_blocks[s], other, output, i_off[s], j_off[s]);
+        } else {
+            // Manual version, for speed-up see library version below
+            //for (int i=0; i<block.size1(); ++i) {
+            //    for (int k=0; k<other.size2(); ++k) {
+            //        double out_ik = 0.0;
+            //        for (int j=0; j<block.size2(); ++j) {
+            //            out_ik += block(i,j)*other(j_off+j, k);
+            //        }
+            //        output(i_off+i,k) = out_ik;
+            //    }
+            //}
+            soap::linalg::linalg_matrix_block_dot(
+                *blocks[s],
+                other,
+                output,
+                i_off[s],
+                j_off[s]);
+        }
+    }
+}
+
+void BlockLaplacian::dotBlock(int idx, block_t &other, block_t &output) {
+    // output = block[idx].other, other with blockCols(idx) rows
+    assert(other.size1() == this->blockCols(idx) && "Inconsistent matrix dimensions");
+    output.resize(this->blockRows(idx), other.size2(), false);
+    if (sparse_blocks[idx]) {
+        for (int i=0; i<output.size1(); ++i)
+            for (int k=0; k<output.size2(); ++k) output(i,k) = 0.0;
+        if (output.size2() > 0) csr_block_dot(*sparse_blocks[idx], other, output, 0, 0);
+    } else {
+        soap::linalg::linalg_matrix_dot(*blocks[idx], other, output);
     }
 }
 
@@ -948,6 +1930,11 @@ void BlockLaplacian::registerPython() {
         .def(init<std::string>())
         .add_property("rows", &BlockLaplacian::rows)
         .add_property("cols", &BlockLaplacian::cols)
+        .add_property("n_sparse", &BlockLaplacian::countSparse)
+        .add_property("max_fill", &BlockLaplacian::getMaxFill, &BlockLaplacian::setMaxFill)
+        .def("__len__", &BlockLaplacian::size)
+        .def("isSparse", &BlockLaplacian::isSparse)
+        .def("compress", &BlockLaplacian::compress)
         .def("__getitem__", &BlockLaplacian::getItemNumpy)
         .def("dot", &BlockLaplacian::dotNumpy)
         .def("append", &BlockLaplacian::appendNumpy)
@@ -973,31 +1960,58 @@ Proto::~Proto() {
 }
 
 void Proto::parametrize(DMapMatrix &AX_in, DMapMatrix &BX_in, BlockLaplacian &DAB) {
+    std::vector<double> centres;
+    this->parametrizeBasis(AX_in, BX_in, DAB, centres, 0.0);
+}
+
+void Proto::parametrizeBasisPython(DMapMatrix &AX_in, DMapMatrix &BX_in, 
+        BlockLaplacian &DAB, boost::python::list &py_centres, double sigma) {
+    std::vector<double> centres;
+    for (int n=0; n<boost::python::len(py_centres); ++n)
+        centres.push_back(boost::python::extract<double>(py_centres[n]));
+    this->parametrizeBasis(AX_in, BX_in, DAB, centres, sigma);
+}
+
+void Proto::parametrizeBasis(DMapMatrix &AX_in, DMapMatrix &BX_in, BlockLaplacian &DAB,
+        std::vector<double> &centres, double sigma) {
+    // Basis functions g_n(r) = w(r)/r^2 * exp(-(r-r_n)^2/(2*sigma^2)) with
+    // cutoff w and centres r_n, or, without centres, the flat basis w(r)/r^2.
+    // One block Laplacian Gnab[n] per basis function, same blocks as DAB.
     GLOG() << "Build Proto from AX x BX = " << AX_in.rows() << " x " << BX_in.rows() << std::endl;
     AX = &AX_in;
     BX = &BX_in;
-    // TODO Formulate in terms of basis expansion with dedicated objects
-    // such as in Gnab = basis->evaluate(DAB).
-    // Example here: Flat radial basis with cutoff
+    if (centres.size() > 0 && !(sigma > 0.)) throw soap::base::SanityCheckFailed(
+        "Proto basis width sigma must be positive");
     GLOG() << "Expanding pair distances" << std::endl;
     for (auto it=Gnab.begin(); it!=Gnab.end(); ++it) delete *it;
     Gnab.clear();
-    int n_basis_fcts = 1;
-    auto *new_gab = new BlockLaplacian();
-    int i_block = 0;
-    for (auto it=DAB.begin(); it!= DAB.end(); ++it, ++i_block) {
+    int n_basis_fcts = std::max(1, int(centres.size()));
+    for (int n=0; n<n_basis_fcts; ++n) Gnab.push_back(new BlockLaplacian());
+    BlockLaplacian::block_t dab_block;
+    for (int i_block=0; i_block<DAB.size(); ++i_block) {
         GLOG() << "\r" << " - Block " << i_block << std::flush;
-        auto &dab_block = *(*it);
-        auto &gab_block = *(new_gab->addBlock(dab_block.size1(), dab_block.size2()));
+        DAB.getBlockDense(i_block, dab_block);
+        std::vector<BlockLaplacian::block_t*> gab_blocks;
+        for (int n=0; n<n_basis_fcts; ++n)
+            gab_blocks.push_back(Gnab[n]->addBlock(dab_block.size1(), dab_block.size2()));
         for (int i=0; i<dab_block.size1(); ++i) {
             for (int j=0; j<dab_block.size2(); ++j) {
                 // Apply cutoff and Jacobian (here: 1/r^2)
-                gab_block(i,j) = cutoff->calculateWeight(dab_block(i,j)) / pow(dab_block(i,j),2);
+                double r = dab_block(i,j);
+                double g = cutoff->calculateWeight(r) / pow(r,2);
+                if (centres.size() == 0) {
+                    (*gab_blocks[0])(i,j) = g;
+                } else {
+                    for (int n=0; n<n_basis_fcts; ++n) {
+                        double dr = r - centres[n];
+                        (*gab_blocks[n])(i,j) = g*std::exp(-dr*dr/(2*sigma*sigma));
+                    }
+                }
             }
         }
     }
     GLOG() << std::endl;
-    Gnab.push_back(new_gab);
+    for (auto it=Gnab.begin(); it!=Gnab.end(); ++it) (*it)->compress();
 }
 
 boost::python::object Proto::projectPython(DMapMatrix *ax, DMapMatrix *bx, 
@@ -1008,49 +2022,119 @@ boost::python::object Proto::projectPython(DMapMatrix *ax, DMapMatrix *bx,
     return npc.ublas_to_numpy<double>(output);
 }
 
+boost::python::list Proto::projectAllPython(DMapMatrix *ax, DMapMatrix *bx, 
+        double xi, std::string np_dtype) {
+    // One projection per basis function
+    soap::linalg::numpy_converter npc(np_dtype.c_str());
+    std::vector<matrix_t> outputs(Gnab.size(), matrix_t(ax->rows(), bx->rows()));
+    std::vector<matrix_t*> output_ptrs;
+    for (auto &output : outputs) output_ptrs.push_back(&output);
+    this->project(ax, bx, xi, output_ptrs);
+    boost::python::list res;
+    for (auto &output : outputs) res.append(npc.ublas_to_numpy<double>(output));
+    return res;
+}
+
 void Proto::project(DMapMatrix *ax, DMapMatrix *bx, double xi, matrix_t &output) {
+    // Projection onto the first basis function
+    std::vector<matrix_t*> outputs { &output };
+    this->project(ax, bx, xi, outputs);
+}
+
+static void dmm_inner_product_range(DMapMatrix &AX, int i0, int ni,
+        DMapMatrix &BX, int j0, int nj, double power, bool filter,
+        DMapMatrix::matrix_t &output) {
+    // As dmm_inner_product, for rows i0 <= i < i0+ni of AX and
+    // j0 <= j < j0+nj of BX
+    output.resize(ni, nj, false);
+    bool packed = AX.isPacked() && BX.isPacked();
+    for (int i=0; i<ni; ++i) {
+        DMap *a = AX.getRow(i0+i);
+        for (int j=0; j<nj; ++j) {
+            DMap *b = BX.getRow(j0+j);
+            double k = 0.0;
+            if (!filter || a->filter == b->filter)
+                k = (packed) ? AX.dotPacked(i0+i, &BX, j0+j) : a->dot(b);
+            output(i,j) = std::pow(k, power);
+        }
+    }
+}
+
+void Proto::project(DMapMatrix *ax, DMapMatrix *bx, double xi, 
+        std::vector<matrix_t*> &outputs) {
+    // E_n = K_aA.G_n.K_Bb with block-diagonal G_n: Evaluated block by block
+    // (i.e., structure by structure, in parallel), such that only the
+    // kernel columns K_aA_s and rows K_B_sb of the current block are held.
     // NOTE The key constraint here is to avoid matrices of size NA x NB
     bool filter = true; // <- = true means that kab = 0 if element a != element b
     int NA = AX->rows();
     int NB = BX->rows();
     int na = ax->rows();
     int nb = bx->rows();
-    assert(output.size1() == na && output.size2() == nb
-        && "Inconsistent output matrix dimensions");
-    // Project environments
-    GLOG() << "Allocating " << na << "x" << NA << " and " 
-        << NB << "x" << nb << " kernel matrices" << std::endl;
-    DMapMatrix::matrix_t K_aA(na, NA);
-    DMapMatrix::matrix_t K_Bb(NB, nb);
-    GLOG() << "Environment projection KaA=ax.AX" << std::endl;
-    dmm_inner_product(*ax, *AX, xi, filter, K_aA);
-    GLOG() << "Environment projection KBb=BX.bx" << std::endl;
-    dmm_inner_product(*BX, *bx, xi, filter, K_Bb);
-    // Project basis
-    GLOG() << "Basis projection HAb=GAB.KBb" << std::endl;
-    DMapMatrix::matrix_t H_Ab(NA, nb);
-    assert(Gnab.size() == 1);
-    GLOG() << "Basis projection Eab=KaA.HAb" << std::endl;
-    Gnab[0]->dot(K_Bb, H_Ab); // TODO Account for more than one basis fct
-    GLOG() << "Projecting KaA.HAb" << std::endl;
-    soap::linalg::linalg_matrix_dot(K_aA, H_Ab, output);
-    // Normalization
-    GLOG() << "Normalization of Eab" << std::endl;
-    std::vector<double> za(na);
-    std::vector<double> zb(nb);
-    for (int i=0; i<na; ++i) {
-        for (int j=0; j<NA; ++j) {
-            za[i] += K_aA(i,j);
-        }
+    int n_basis = outputs.size();
+    if (Gnab.size() == 0) throw soap::base::SanityCheckFailed("Proto not parametrized");
+    if (n_basis > int(Gnab.size())) throw soap::base::OutOfRange(
+        "Proto has " + lexical_cast<std::string>(Gnab.size(), "") + " basis functions");
+    assert(Gnab[0]->rows() == NA && Gnab[0]->cols() == NB
+        && "Inconsistent basis and environment dimensions");
+    for (int n=0; n<n_basis; ++n) {
+        assert(outputs[n]->size1() == na && outputs[n]->size2() == nb
+            && "Inconsistent output matrix dimensions");
+        *outputs[n] = ub::zero_matrix<dtype_t>(na, nb);
     }
-    for (int i=0; i<nb; ++i) {
-        for (int j=0; j<NB; ++j) {
-            zb[i] += K_Bb(j,i);
+    // Block offsets
+    int n_blocks = Gnab[0]->size();
+    std::vector<int> A_off(n_blocks+1, 0);
+    std::vector<int> B_off(n_blocks+1, 0);
+    for (int s=0; s<n_blocks; ++s) {
+        A_off[s+1] = A_off[s] + Gnab[0]->blockRows(s);
+        B_off[s+1] = B_off[s] + Gnab[0]->blockCols(s);
+    }
+    GLOG() << "Projecting " << na << "x" << nb << " onto " << n_basis 
+        << " basis function(s), " << n_blocks << " blocks" << std::endl;
+    std::vector<double> za(na, 0.0);
+    std::vector<double> zb(nb, 0.0);
+    #pragma omp parallel
+    {
+        std::vector<matrix_t> E_thread(n_basis, ub::zero_matrix<dtype_t>(na, nb));
+        std::vector<double> za_thread(na, 0.0);
+        std::vector<double> zb_thread(nb, 0.0);
+        matrix_t K_aA;
+        matrix_t K_Bb;
+        matrix_t H_Ab;
+        #pragma omp for schedule(dynamic)
+        for (int s=0; s<n_blocks; ++s) {
+            int nA = A_off[s+1] - A_off[s];
+            int nB = B_off[s+1] - B_off[s];
+            // Environment projection KaA=ax.AX_s and KBb=BX_s.bx
+            dmm_inner_product_range(*ax, 0, na, *AX, A_off[s], nA, xi, filter, K_aA);
+            dmm_inner_product_range(*BX, B_off[s], nB, *bx, 0, nb, xi, filter, K_Bb);
+            for (int i=0; i<na; ++i)
+                for (int A=0; A<nA; ++A) za_thread[i] += K_aA(i,A);
+            for (int B=0; B<nB; ++B)
+                for (int j=0; j<nb; ++j) zb_thread[j] += K_Bb(B,j);
+            if (na == 0 || nb == 0 || nA == 0 || nB == 0) continue;
+            // Basis projection Eab += KaA.(GAB_s.KBb)
+            for (int n=0; n<n_basis; ++n) {
+                Gnab[n]->dotBlock(s, K_Bb, H_Ab);
+                soap::linalg::linalg_matrix_dot(K_aA, H_Ab, E_thread[n], 1.0, 1.0, false, false);
+            }
+        }
+        #pragma omp critical
+        {
+            for (int n=0; n<n_basis; ++n) *outputs[n] += E_thread[n];
+            for (int i=0; i<na; ++i) za[i] += za_thread[i];
+            for (int j=0; j<nb; ++j) zb[j] += zb_thread[j];
         }
     }
-    for (int i=0; i<na; ++i) {
-        for (int j=0; j<nb; ++j) {
-            output(i,j) = - std::log(output(i,j)/(za[i]*zb[j]));
+    // Normalization
+    GLOG() << "Normalization of Eab" << std::endl;
+    for (int n=0; n<n_basis; ++n) {
+        matrix_t &output = *outputs[n];
+        for (int i=0; i<na; ++i) {
+            for (int j=0; j<nb; ++j) {
+                output(i,j) = - std::log(output(i,j)/(za[i]*zb[j]));
+            }
         }
     }
 }
@@ -1058,8 +2142,11 @@ void Proto::project(DMapMatrix *ax, DMapMatrix *bx, double xi, matrix_t &output)
 void Proto::registerPython() {
     using namespace boost::python;
     class_<Proto, Proto*>("Proto", init<>())
+        .add_property("n_basis", &Proto::getNumberOfBasisFunctions)
         .def("project", &Proto::projectPython)
-        .def("parametrize", &Proto::parametrize);
+        .def("projectAll", &Proto::projectAllPython)
+        .def("parametrize", &Proto::parametrize)
+        .def("parametrizeBasis", &Proto::parametrizeBasisPython);
 }
 
 TypeEncoder::TypeEncoder() {
@@ -1081,12 +2168,20 @@ TypeEncoder::~TypeEncoder() {
     ;
 }
 
+void TypeEncoder::assertNotFrozen() {
+    if (frozen) throw soap::base::APIError("Type encoder is frozen");
+}
+
 void TypeEncoder::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->assertNotFrozen();
     encoder.clear();
     order.clear();
 }
 
 void TypeEncoder::add(std::string type) {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->assertNotFrozen();
     auto it = encoder.find(type);
     if (it != end()) {
         throw soap::base::SanityCheckFailed("Type already added: '"+type+"'");
@@ -1095,36 +2190,77 @@ void TypeEncoder::add(std::string type) {
     order.push_back(type);
 }
 
+void TypeEncoder::setOrder(order_t &types) {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->assertNotFrozen();
+    encoder.clear();
+    order.clear();
+    for (auto it=types.begin(); it!=types.end(); ++it) {
+        encoder[*it] = code_t(size());
+        order.push_back(*it);
+    }
+}
+
+TypeEncoder::order_t TypeEncoder::getOrder() {
+    std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+    if (!frozen) lock.lock();
+    return order;
+}
+
 TypeEncoder::code_t TypeEncoder::encode(std::string type) {
+    std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+    if (!frozen) lock.lock();
     auto it = encoder.find(type);
     if (it == end()) throw soap::base::OutOfRange("Encoder type '"+type+"'");
     return it->second;
 }
 
 TypeEncoder::code_t TypeEncoder::encode(std::string type1, std::string type2) {
+    std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+    if (!frozen) lock.lock();
     auto it = encoder.find(type1);
     auto jt = encoder.find(type2);
     if (it == end() || jt == end()) throw soap::base::OutOfRange(type1+":"+type2);
-    return encoder[type1]*size() + encoder[type2];
+    return it->second*size() + jt->second;
 }
 
 TypeEncoder::code_t TypeEncoder::encode(code_t code1, code_t code2) {
+    std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+    if (!frozen) lock.lock();
     return code1*size() + code2;
 }
 
 std::string TypeEncoder::decode(TypeEncoder::code_t code) {
+    std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+    if (!frozen) lock.lock();
     code_t c2 = code % size();
     code_t c1 = (code-c2)/size();
     return order[c1]+":"+order[c2];
 }
 
+void TypeEncoder::freeze() {
+    // Waits for modifications in progress, reads are lock-free afterwards
+    std::lock_guard<std::mutex> lock(mutex);
+    frozen = true;
+}
+
+void TypeEncoder::unfreeze() {
+    // Must not be called concurrently with reads
+    std::lock_guard<std::mutex> lock(mutex);
+    frozen = false;
+}
+
 void TypeEncoder::list() {
+    std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+    if (!frozen) lock.lock();
     for (auto it=order.begin(); it!=order.end(); ++it) {
         GLOG() << *it << " : " << encoder[*it] << std::endl;
     }
 }
 
 boost::python::list TypeEncoder::getTypes() {
+    std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+    if (!frozen) lock.lock();
     boost::python::list type_list;
     for (auto t: order) type_list.append(t);
     return type_list;
@@ -1136,6 +2272,18 @@ void TypeEncoderUI::clear() {
     ENCODER.clear();
 }
 
+void TypeEncoderUI::freeze() {
+    ENCODER.freeze();
+}
+
+void TypeEncoderUI::unfreeze() {
+    ENCODER.unfreeze();
+}
+
+bool TypeEncoderUI::isFrozen() {
+    return ENCODER.isFrozen();
+}
+
 void TypeEncoderUI::list() {
     ENCODER.list();
 }
@@ -1159,9 +2307,12 @@ void TypeEncoder::registerPython() {
         = &TypeEncoder::encode;
 
     using namespace boost::python;
-    class_<TypeEncoder, TypeEncoder*>("TypeEncoder", init<>())
+    class_<TypeEncoder, TypeEncoder*, boost::noncopyable>("TypeEncoder", init<>())
         .def("clear", &TypeEncoder::clear)
         .def("add", &TypeEncoder::add)
+        .def("freeze", &TypeEncoder::freeze)
+        .def("unfreeze", &TypeEncoder::unfreeze)
+        .def("isFrozen", &TypeEncoder::isFrozen)
         .def("encode", encodeSingle)
         .def("encode", encodePair);
 
@@ -1175,6 +2326,12 @@ void TypeEncoder::registerPython() {
         .staticmethod("encode")
         .def("types", &TypeEncoderUI::types)
         .staticmethod("types")
+        .def("freeze", &TypeEncoderUI::freeze)
+        .staticmethod("freeze")
+        .def("unfreeze", &TypeEncoderUI::unfreeze)
+        .staticmethod("unfreeze")
+        .def("isFrozen", &TypeEncoderUI::isFrozen)
+        .staticmethod("isFrozen")
         .def("list", &TypeEncoderUI::list)
         .staticmethod("list");
 }
@@ -2,9 +2,14 @@
 #define _SOAP_DMAP_HPP
 
 #include <assert.h>
+#include <atomic>
+#include <future>
+#include <list>
+#include <mutex>
 #include <boost/serialization/vector.hpp>
 #include <boost/serialization/map.hpp>
 #include <boost/serialization/list.hpp>
+#include <boost/serialization/version.hpp>
 
 #include "soap/types.hpp"
 #include "soap/globals.hpp"
@@ -18,6 +23,10 @@ namespace soap {
 namespace ub = boost::numeric::ublas;
 namespace bpy = boost::python;
 
+// Channel codes for single types and type pairs (code1*size()+code2).
+// Reads and modifications are serialized by a mutex; once frozen, the
+// encoder can no longer be modified and reads proceed without locking,
+// e.g., during parallel featurisation.
 class TypeEncoder
 {
   public:
@@ -32,13 +41,24 @@ class TypeEncoder
     encoder_t::iterator end() { return encoder.end(); }
     void list();
     boost::python::list getTypes();
+    order_t getOrder();
+    void setOrder(order_t &types);
     std::string decode(code_t code);
     code_t encode(std::string type);
     code_t encode(std::string type1, std::string type2);
     code_t encode(code_t code1, code_t code2);
     void add(std::string type);
+    void freeze();
+    void unfreeze();
+    bool isFrozen() { return frozen; }
     static void registerPython();
+    template<class Archive>
+    void serialize(Archive &arch, const unsigned int version) {
+        arch & encoder;
+        arch & order;
+    }
   private:
+    void assertNotFrozen();
     encoder_t encoder {
       { "H" ,   0 },
       { "C" ,   1 },
@@ -52,12 +72,17 @@ class TypeEncoder
       { "I" ,   9 }
    };
    order_t order { "H", "C", "N", "O", "F", "P", "S", "Cl", "Br", "I" };
+   std::atomic<bool> frozen { false };
+   std::mutex mutex;
 };
 
 struct TypeEncoderUI
 {
     static void clear();
     static void add(std::string);
+    static void freeze();
+    static void unfreeze();
+    static bool isFrozen();
     static void list();
     static boost::python::list types();
     static TypeEncoder::code_t encode(std::string type1, std::string type2);
@@ -65,6 +90,28 @@ struct TypeEncoderUI
 
 extern TypeEncoder ENCODER;
 
+// Quantized channel: Values x_k ~ scale*q_k + offset, with q_k stored in
+// the int8 (|q_k| <= 127) or fp16 (|q_k| <= 1) buffer of the DMap at
+// [begin, begin+n). The sum over q_k enters the dot product with offsets.
+struct QChannel
+{
+    TypeEncoder::code_t code;
+    int begin;
+    int n;
+    float scale;
+    float offset;
+    float sum;
+    template<class Archive>
+    void serialize(Archive &arch, const unsigned int version) {
+        arch & code;
+        arch & begin;
+        arch & n;
+        arch & scale;
+        arch & offset;
+        arch & sum;
+    }
+};
+
 struct GradMap;
 struct DMap
 {
@@ -76,6 +123,8 @@ struct DMap
     typedef std::pair<TypeEncoder::code_t, vec_t*> channel_t;
     typedef std::vector<channel_t> dmap_t;
     typedef std::vector<GradMap*> pid_gradmap_t;
+    typedef std::vector<QChannel> qdmap_t;
+    enum { QNONE = 0, QINT8 = 1, QFP16 = 2 };
     DMap();
     DMap(std::string filter_type);
     ~DMap();
@@ -83,13 +132,18 @@ struct DMap
     dmap_t::iterator end() { return dmap.end(); }
     pid_gradmap_t::iterator beginGradients() { return pid_gradmap.begin(); }
     pid_gradmap_t::iterator endGradients() { return pid_gradmap.end(); }
-    int size() { return dmap.size(); }
+    int size() { return (qtype == QNONE) ? dmap.size() : qdmap.size(); }
+    TypeEncoder::code_t code(int s) { return (qtype == QNONE) ? dmap[s].first : qdmap[s].code; }
+    int channelSize(int s) { return (qtype == QNONE) ? dmap[s].second->size() : qdmap[s].n; }
+    const dtype_t *channelValues(int s, std::vector<dtype_t> &buffer);
     int getSize1() { return size1; }
     int getSize2() { return size2; }
     bpy::object val(int chidx, std::string np_dtype);
     dtype_t val() { return (*(dmap[0].second))(0); }
     void sort();
     void sortGradients();
+    int slot(TypeEncoder::code_t code);
+    void buildSlots();
     void multiply(double c);
     boost::python::list listChannels();
     void add(DMap *other);
@@ -100,6 +154,7 @@ struct DMap
     bpy::object dotOuterNumpy(DMap *other, std::string np_dtype);
     void dotOuter(DMap *other, matrix_t &output);
     double dot(DMap *other);
+    double dotQuantized(DMap *other);
     double dotFilter(DMap *other);
     DMap *dotGradLeft(DMap *other, double coeff, double power, DMap *res);
     void normalize();
@@ -112,11 +167,29 @@ struct DMap
         bool comoving_center=true);
     void adaptCoherent(AtomicSpectrum *spectrum);
     std::string getFilter() { return filter; }
+    void quantize(std::string dtype);
+    void dequantize();
+    bool isQuantized() { return qtype != QNONE; }
+    std::string getQuantization();
+    void assertNotQuantized(std::string op);
     dmap_t dmap;
     pid_gradmap_t pid_gradmap;
     std::string filter;
     int size1;
     int size2;
+    // Dense code -> slot (index into dmap, -1 if absent) table, rebuilt by
+    // sort(), which has to follow every modification of dmap. Not archived.
+    std::vector<short> slots;
+    int n_slotted;
+    // Incremented by every modification of the channels (see
+    // DMapMatrix::pack). Not archived.
+    unsigned int revision;
+    // Quantized storage (see quantize): Replaces dmap, gradients remain in
+    // double precision. Only one of the value buffers is in use.
+    int qtype;
+    qdmap_t qdmap;
+    std::vector<signed char> qint8;
+    std::vector<unsigned short> qfp16;
     static void registerPython();
     template<class Archive>
     void serialize(Archive &arch, const unsigned int version) {
@@ -125,6 +198,15 @@ struct DMap
         arch & filter;
         arch & size1;
         arch & size2;
+        if (version > 0) {
+            arch & qtype;
+            arch & qdmap;
+            arch & qint8;
+            arch & qfp16;
+        } else {
+            qtype = QNONE;
+        }
+        if (Archive::is_loading::value) this->buildSlots();
     }
 };
 
@@ -179,11 +261,22 @@ class DMapMatrix
     void dotFilter(DMapMatrix *other, matrix_t &output);
     bpy::object dotNumpy(DMapMatrix *other, std::string np_dtype);
     bpy::object dotFilterNumpy(DMapMatrix *other, std::string np_dtype);
+    void dotGradLeft(DMapMatrix *other, double power, matrix_t &K,
+        matrix_t &dK, std::vector<int> &pids);
+    bpy::tuple dotGradLeftNumpy(DMapMatrix *other, double power,
+        std::string np_dtype);
     void slicePython(bpy::list &py_idcs);
     void slice(std::vector<int> &idcs);
     void append(DMap *dmap);
     void append(Spectrum *spectrum);
     void appendCoherent(Spectrum *spectrum);
+    void pack();
+    void unpack();
+    bool isPacked() { return is_packed; }
+    double dotPacked(int i, DMapMatrix *other, int j);
+    void quantize(std::string dtype);
+    void dequantize();
+    bool isQuantized();
     void save(std::string archfile);
     void load(std::string archfile);
     std::string dumps();
@@ -203,9 +296,23 @@ class DMapMatrix
     }
   private:
     DMapMatrix(bool set_as_view);
+    void packRow(DMap *dmap);
     dmm_t dmm;
     views_t views;
     bool is_view;
+    // Packed layout: The channels of all rows in one contiguous buffer,
+    // channel c of row i (pack_rows[i] <= c < pack_rows[i+1]) has code
+    // pack_codes[c] and values pack_values[pack_offsets[c]:pack_offsets[c+1]].
+    // Not archived, the row DMaps remain the reference representation: Rows
+    // modified after packing (revision != pack_revisions[i]) are stale, for
+    // these dotPacked falls back to the row DMaps until the next pack().
+    void syncPack();
+    bool is_packed;
+    std::vector<dtype_t> pack_values;
+    std::vector<std::size_t> pack_offsets;
+    std::vector<TypeEncoder::code_t> pack_codes;
+    std::vector<int> pack_rows;
+    std::vector<unsigned int> pack_revisions;
 };
 
 void dmm_inner_product(
@@ -215,6 +322,82 @@ void dmm_inner_product(
     bool filter,
     DMapMatrix::matrix_t &output);
 
+// Same as dmm_inner_product, but channel-blocked: For every channel code
+// shared by AX and BX (and, if filter, every pair of row groups with equal
+// filter), the channel vectors are gathered into dense matrices and
+// contracted with one GEMM, accumulating over channels.
+void dmm_inner_product_gemm(
+    DMapMatrix &AX, 
+    DMapMatrix &BX, 
+    double power, 
+    bool filter,
+    DMapMatrix::matrix_t &output);
+
+// Read-only access to the matrices of an indexed archive (written by
+// DMapMatrixSet::saveIndexed): The index is read on construction, matrices
+// are deserialised on first access and kept resident up to a memory budget
+// (estimated by their serialised size, <= 0: unlimited), beyond which the
+// least recently used ones are released. Access to index i directly after
+// i-1 reads ahead the next n_prefetch matrices asynchronously, which may
+// exceed the budget by up to n_prefetch matrices.
+// Pinned matrices (pin/unpin, reference-counted) are never released, so
+// that the budget may be exceeded by the matrices pinned at a time. The
+// pointer returned by get(...) is only valid until the next access to the
+// loader: Callers that hold it across accesses, or that share the loader
+// between threads, should pin instead (see DMapMatrixPin). Python receives
+// copies (see DMapMatrixSet::getItemPython).
+class DMapMatrixLoader
+{
+  public:
+    struct index_t
+    {
+        std::vector<long int> offsets; // File position of matrix archives
+        std::vector<long int> sizes;   // Serialised size in bytes
+        TypeEncoder::order_t encoder_types;
+        template<class Archive>
+        void serialize(Archive &arch, const unsigned int version) {
+            arch & offsets;
+            arch & sizes;
+            arch & encoder_types;
+        }
+    };
+    DMapMatrixLoader(std::string archfile, double budget_mb, int n_prefetch);
+    ~DMapMatrixLoader();
+    int size() { return index.offsets.size(); }
+    DMapMatrix *get(int idx);
+    DMapMatrix *pin(int idx);
+    int pinResident(DMapMatrix *dmm);
+    void unpin(int idx);
+    int countResident();
+    int countPinned();
+    double getResidentMB();
+    int countReads() { return n_reads; }
+    TypeEncoder::order_t &getEncoderTypes() { return index.encoder_types; }
+    static void writeIndex(std::ostream &ofs, index_t &index);
+    static bool readIndex(std::string archfile, index_t &index);
+    static DMapMatrix *readMatrix(std::istream &ifs, long int offset);
+    static const char magic[9];
+  private:
+    DMapMatrix *acquire(int idx, bool pin);
+    void prefetch(int first, int last);
+    void insert(int idx, DMapMatrix *dmm);
+    void touch(int idx);
+    void evict(int keep);
+    std::string archfile;
+    index_t index;
+    std::vector<DMapMatrix*> resident;
+    std::list<int> lru; // Most recently used first
+    std::vector<std::list<int>::iterator> lru_pos;
+    std::vector<int> n_pins;
+    long int budget;
+    long int n_bytes;
+    int n_prefetch;
+    int n_reads;
+    int last_idx;
+    std::future<void> prefetch_job;
+    std::mutex mutex;
+};
+
 class DMapMatrixSet
 {
   public:
@@ -224,51 +407,121 @@ class DMapMatrixSet
     DMapMatrixSet(bool set_as_view);
     DMapMatrixSet(std::string archfile);
     ~DMapMatrixSet();
+    // Iterators are not available in lazy mode, use size() and get(...)
     dset_t::iterator begin() { return dset.begin(); }
     dset_t::iterator end() { return dset.end(); }
-    int size() { return dset.size(); }
+    int size() { return (loader) ? loader->size() : dset.size(); }
     void clear();
     void slicePython(bpy::list &py_idcs);
     void slice(std::vector<int> &idcs);
-    DMapMatrix *get(int idx) { return dset[idx]; }
+    DMapMatrix *get(int idx) { return (loader) ? loader->get(idx) : dset[idx]; }
+    DMapMatrix *pin(int idx) { return (loader) ? loader->pin(idx) : dset[idx]; }
+    int pinMember(DMapMatrix *dmm) { return (loader) ? loader->pinResident(dmm) : -1; }
+    void unpin(int idx) { if (loader) loader->unpin(idx); }
+    bpy::object getItemPython(int idx);
     DMapMatrixSet *getView(boost::python::list idcs);
     void append(DMapMatrix *dmm);
     void extend(DMapMatrixSet *other);
     void save(std::string archfile);
+    void saveIndexed(std::string archfile);
     void load(std::string archfile);
+    void loadLazy(std::string archfile, double budget_mb, int n_prefetch);
+    bool isLazy() { return loader != NULL; }
+    int countResident() { return (loader) ? loader->countResident() : dset.size(); }
+    int countPinned() { return (loader) ? loader->countPinned() : 0; }
     static void registerPython();
     template<class Archive>
     void serialize(Archive &arch, const unsigned int version) {
         arch & dset;
         arch & views;
         arch & is_view;
+        if (version > 0) arch & encoder_types;
     }
   private:
+    void checkEncoder(std::string archfile);
+    void assertNotLazy(std::string op);
     dset_t dset;
     views_t views;
     bool is_view;
+    // Lazy mode (see loadLazy), not archived
+    DMapMatrixLoader *loader;
+    // Types of the encoder that produced the channel codes, as of save(...)
+    TypeEncoder::order_t encoder_types;
 };
 
+// Scoped pin of a matrix of a set: Valid for the lifetime of the pin also
+// if the set is lazy. Pinning by pointer pins the matrix only if it is a
+// resident matrix of a lazy set, and is a no-op otherwise.
+class DMapMatrixPin
+{
+  public:
+    DMapMatrixPin(DMapMatrixSet *dset_arg, int idx_arg) : dset(dset_arg),
+        idx(idx_arg), dmm(dset_arg->pin(idx_arg)) { ; }
+    DMapMatrixPin(DMapMatrixSet *dset_arg, DMapMatrix *dmm_arg) : dset(dset_arg),
+        idx(dset_arg->pinMember(dmm_arg)), dmm(dmm_arg) { ; }
+    ~DMapMatrixPin() { if (idx >= 0) dset->unpin(idx); }
+    DMapMatrixPin(const DMapMatrixPin&) = delete;
+    DMapMatrixPin &operator=(const DMapMatrixPin&) = delete;
+    DMapMatrix *get() { return dmm; }
+  private:
+    DMapMatrixSet *dset;
+    int idx;
+    DMapMatrix *dmm;
+};
+
+// Block-diagonal matrix, e.g., the graph Laplacians of a set of structures.
+// Each block is stored either dense or, if its fill ratio (non-zeros/size)
+// does not exceed max_fill, in compressed sparse row (CSR) format. In the
+// latter case, blocks[idx] is an empty placeholder and sparse_blocks[idx]
+// holds the entries (sparse_blocks[idx] is NULL for dense blocks).
 struct BlockLaplacian
 {
     typedef double dtype_t;
     typedef ub::matrix<dtype_t> block_t;
     typedef std::vector<block_t*> blocks_t;
+    struct csr_block_t
+    {
+        int n_rows;
+        int n_cols;
+        std::vector<int> ptr; // Row i: entries ptr[i] <= p < ptr[i+1]
+        std::vector<int> idx; // Column indices
+        std::vector<dtype_t> val;
+        template<class Archive>
+        void serialize(Archive &arch, const unsigned int version) {
+            arch & n_rows;
+            arch & n_cols;
+            arch & ptr;
+            arch & idx;
+            arch & val;
+        }
+    };
+    typedef std::vector<csr_block_t*> sparse_blocks_t;
     BlockLaplacian();
     BlockLaplacian(std::string archfile);
     ~BlockLaplacian();
     block_t *addBlock(int n_rows_block, int n_cols_block);
     boost::python::object getItemNumpy(int idx) { return getBlockNumpy(idx, "float64"); }
     boost::python::object getBlockNumpy(int idx, std::string np_dtype="float64");
+    void getBlockDense(int idx, block_t &output);
     void appendNumpy(boost::python::object &np_array, std::string np_dtype);
+    void compress();
+    void compressBlock(int idx);
+    bool isSparse(int idx) { return sparse_blocks[idx] != NULL; }
+    int countSparse();
+    double getMaxFill() { return max_fill; }
+    void setMaxFill(double fill) { max_fill = fill; }
+    int blockRows(int idx);
+    int blockCols(int idx);
     void save(std::string archfile);
     void load(std::string archfile);
     int rows() { return n_rows; }
     int cols() { return n_cols; }
+    int size() { return blocks.size(); }
     blocks_t::iterator begin() { return blocks.begin(); }
     blocks_t::iterator end() { return blocks.end(); }
     bpy::object dotNumpy(bpy::object &np_other, std::string np_dtype);
     void dot(block_t &other, block_t &output);
+    void dotBlock(int idx, block_t &other, block_t &output);
     void dotLeft();
     static void registerPython();
     template<class Archive>
@@ -276,10 +529,18 @@ struct BlockLaplacian
         arch & blocks;
         arch & n_rows;
         arch & n_cols;
+        if (version > 0) {
+            arch & sparse_blocks;
+            arch & max_fill;
+        } else {
+            sparse_blocks.assign(blocks.size(), NULL);
+        }
     }
     blocks_t blocks;
+    sparse_blocks_t sparse_blocks;
     int n_rows;
     int n_cols;
+    double max_fill; // Blocks with fill <= max_fill are stored as CSR
 };
 
 class Proto
@@ -291,9 +552,18 @@ class Proto
     Proto();
     ~Proto();
     void parametrize(DMapMatrix &AX, DMapMatrix &BX, BlockLaplacian &DAB);
+    void parametrizeBasis(DMapMatrix &AX, DMapMatrix &BX, BlockLaplacian &DAB,
+        std::vector<double> &centres, double sigma);
+    void parametrizeBasisPython(DMapMatrix &AX, DMapMatrix &BX, BlockLaplacian &DAB,
+        bpy::list &centres, double sigma);
+    int getNumberOfBasisFunctions() { return Gnab.size(); }
     bpy::object projectPython(DMapMatrix *AX, DMapMatrix *BX, 
         double xi, std::string np_dtype);
+    bpy::list projectAllPython(DMapMatrix *AX, DMapMatrix *BX, 
+        double xi, std::string np_dtype);
     void project(DMapMatrix *AX, DMapMatrix *BX, double xi, matrix_t &output);
+    void project(DMapMatrix *AX, DMapMatrix *BX, double xi, 
+        std::vector<matrix_t*> &outputs);
     static void registerPython(); 
   private:
     Gnab_t Gnab;
@@ -305,4 +575,8 @@ class Proto
 
 }
 
+BOOST_CLASS_VERSION(soap::DMap, 1)
+BOOST_CLASS_VERSION(soap::DMapMatrixSet, 1)
+BOOST_CLASS_VERSION(soap::BlockLaplacian, 1)
+
 #endif /* _SOAP_DMAP_HPP_ */
@@ -26,6 +26,34 @@ from .. import tools
 def eval_single(args):
     return args["calc"].evaluate(**args)
 
+def map_pairs(system, pair_offsets, pair_nbs):
+    # Maps the (centre, neighbour) pairs of the compact gradient layout 
+    # to the input order of the atoms, given that the positions were
+    # passed sorted (stably) by atomic number
+    order = np.argsort(system.get_atomic_numbers(), kind='mergesort')
+    pairs = np.zeros((len(pair_nbs), 2), dtype=int)
+    pairs[:,0] = np.repeat(np.arange(len(pair_offsets)-1), np.diff(pair_offsets))
+    pairs[:,1] = order[np.array(pair_nbs, dtype=int)]
+    return pairs
+
+def finalize_gradients(X, dX, pairs, centres_on_atoms, normalize):
+    # dX[p] of shape (3, dim) is the derivative of X[pairs[p,0]] with 
+    # respect to the position of atom pairs[p,1] at fixed centres.
+    if centres_on_atoms:
+        # Centre i moves together with atom i
+        dX_sum = np.zeros((X.shape[0], 3, X.shape[1]))
+        np.add.at(dX_sum, pairs[:,0], dX)
+        self_pairs = np.where(pairs[:,0] == pairs[:,1])[0]
+        dX[self_pairs] -= dX_sum[pairs[self_pairs,0]]
+    if normalize:
+        z = 1./np.sum(X**2, axis=1)**0.5
+        X = (X.T*z).T
+        Xp = X[pairs[:,0]]
+        proj = np.einsum('pdk,pk->pd', dX, Xp)
+        dX = dX - proj[:,:,None]*Xp[:,None,:]
+        dX = dX*z[pairs[:,0]][:,None,None]
+    return X, dX, pairs
+
 class GylmCalculator(object):
     def __init__(
             self,
@@ -44,8 +72,16 @@ class GylmCalculator(object):
             periodic=False,
             normalize=False,
             power=True,
+            n_threads=0,
+            sketch_dim=0,
+            sketch_seed=0,
             encoder=lambda s: tools.ptable.lookup[s].z,
             decoder=lambda z: tools.ptable.lookup[int(z)].name):
+        # n_threads <= 0: Use OpenMP default (OMP_NUM_THREADS)
+        # sketch_dim > 0: Power spectra are replaced by a tensor sketch of 
+        #   sketch_dim features per l (power of two), seeded by sketch_seed
+        if sketch_dim < 0 or (sketch_dim & (sketch_dim-1)) != 0:
+            raise ValueError("sketch_dim must be a power of two", sketch_dim)
         self.types = types
         self.types_z = np.array(sorted([ encoder(s) for s in self.types ]))
         self.types_elem = np.array([ decoder(z) for z in self.types_z ])
@@ -67,16 +103,25 @@ class GylmCalculator(object):
         self.periodic = periodic
         self.normalize = normalize
         self.power = power
+        self.n_threads = n_threads
+        self.sketch_dim = sketch_dim
+        self.sketch_seed = sketch_seed
+    def setNumThreads(self, n_threads):
+        self.n_threads = n_threads
     def getDim(self, with_power=None):
         if with_power is None: with_power = self.power
         return self.getChannelDim(with_power)*self.getNumberOfChannels(with_power)
     def getChannelDim(self, with_power):
-        if with_power:
+        if with_power and self.sketch_dim > 0:
+            return self.sketch_dim*(self._lmax+1)
+        elif with_power:
             return self._nmax*self._nmax*(self._lmax+1)
         else:
             return self._nmax*(self._lmax+1)**2
     def getNumberOfChannels(self, with_power):
-        if with_power:
+        if with_power and self.sketch_dim > 0:
+            return 1
+        elif with_power:
             return self._Nt*(self._Nt+1)/2
         else:
             return self._Nt
@@ -101,12 +146,17 @@ class GylmCalculator(object):
         return X_list
     def evaluate(self, system, positions=None, 
             verbose=False, 
-            calc=None):
+            calc=None,
+            gradients=False):
+        # With gradients=True, returns (X, dX, pairs), where dX[p] of 
+        # shape (3, dim) is the derivative of X[pairs[p,0]] with respect 
+        # to the position of atom pairs[p,1]. Pairs are grouped by centre.
         if self.periodic:
             cell = system.get_cell()
+        centres_on_atoms = positions is None
         if positions is None:
             positions = system.get_positions()
-        X = self.evaluateGylm(
+        res = self.evaluateGylm(
             system,
             positions,
             self._gnl_centres,
@@ -118,16 +168,67 @@ class GylmCalculator(object):
             eta=self._eta,
             atomic_numbers=None,
             power=self.power,
+            gradients=gradients,
             verbose=verbose)
+        if not gradients:
+            X = res
+            if self.normalize:
+                z = 1./np.sum(X**2, axis=1)**0.5
+                X = (X.T*z).T
+            return X
+        X, dX, pairs = res
+        return finalize_gradients(X, dX, pairs, 
+            centres_on_atoms, self.normalize)
+    def evaluateBatch(self, systems, positions=None):
+        # Evaluates the descriptors of a list of structures in one call, 
+        # with structures processed in parallel. Returns (X, offsets), 
+        # where X[offsets[s]:offsets[s+1]] belongs to systems[s]. The 
+        # centres default to the atoms of each structure.
+        n_structs = len(systems)
+        tgt_pos = np.concatenate([ s.get_positions() for s in systems ]) \
+            .astype(np.float64)
+        tgt_types = np.concatenate([ s.get_atomic_numbers() for s in systems ]) \
+            .astype(np.int32)
+        tgt_offsets = np.cumsum([ 0 ] + [ len(s) for s in systems ]) \
+            .astype(np.int32)
+        if len(set(tgt_types).union(self.types_set)) > len(self.types_set):
+            raise ValueError("Some types not recognized:", set(tgt_types))
+        if positions is None:
+            src_pos = tgt_pos
+            src_offsets = tgt_offsets
+        else:
+            src_pos = np.concatenate([ np.array(p).reshape((-1,3)) \
+                for p in positions ]).astype(np.float64)
+            src_offsets = np.cumsum([ 0 ] + [ len(p) for p in positions ]) \
+                .astype(np.int32)
+        n_src = src_offsets[-1]
+        dim = self.getDim()
+        coeffs = np.zeros(n_src*dim, dtype=np.float64)
+        evaluate_gylm_batch(coeffs, 
+            src_pos, src_offsets, 
+            tgt_pos, tgt_types, tgt_offsets,
+            self._gnl_centres, self._gnl_alphas, self.types_z,
+            self._rcut, self._rcut_width,
+            n_structs, self._Nt, 
+            self._nmax, self._lmax,
+            self.part_sigma,
+            self.wconstant,
+            self.wscale,
+            self.wcentre,
+            self.ldamp,
+            self.power,
+            self.sketch_dim, self.sketch_seed,
+            self.n_threads)
+        X = coeffs.reshape((n_src, dim))
         if self.normalize:
             z = 1./np.sum(X**2, axis=1)**0.5
             X = (X.T*z).T
-        return X
+        return X, src_offsets
     def evaluateGylm(self, system, centers, 
             gnl_centres, gnl_alphas, 
             rcut, cutoff_padding, 
             nmax, lmax, eta, atomic_numbers=None, 
-            use_global_types=True, power=True, verbose=False):
+            use_global_types=True, power=True, gradients=False, verbose=False):
         n_tgt = len(system)
         n_src = len(centers)
         positions, Z_sorted, n_types, atomtype_lst = self.flattenPositions(
@@ -140,13 +241,18 @@ class GylmCalculator(object):
         Z_sorted_global = self.types_z if use_global_types \
             else np.array(list(set(Z_sorted)))
         n_types = len(Z_sorted_global)
-        if power:
+        if power and self.sketch_dim > 0:
+            if gradients:
+                raise ValueError("Gradients of sketched power spectra not supported")
+            coeffs = np.zeros(self.sketch_dim*(lmax+1)*n_src, dtype=np.float64)
+            shape = (n_centers, self.sketch_dim*(lmax+1))
+        elif power:
             coeffs = np.zeros(nmax*nmax*(lmax+1)*int((n_types*(n_types + 1))/2)*n_src, dtype=np.float64)
             shape = (n_centers, nmax*nmax*(lmax+1)*int((n_types*(n_types+1))/2))
         else:
             coeffs = np.zeros(nmax*(lmax+1)*(lmax+1)*n_types*n_src, dtype=np.float64)
             shape = (n_centers, nmax*(lmax+1)*(lmax+1)*n_types)
-        evaluate_gylm(coeffs, centers, positions,
+        args = (coeffs, centers, positions,
             gnl_centres, gnl_alphas, Z_sorted, Z_sorted_global,
             rcut, cutoff_padding, 
             n_src, n_tgt, n_types, 
@@ -157,8 +263,16 @@ class GylmCalculator(object):
             self.wcentre, 
             self.ldamp,
             power, verbose)
+        if not gradients:
+            evaluate_gylm(*(args + (
+                self.sketch_dim, self.sketch_seed, self.n_threads)))
+            coeffs = coeffs.reshape(shape)
+            return coeffs
+        dcoeffs, pair_offsets, pair_nbs = evaluate_gylm_grad(*(args + (
+            self.n_threads,)))
         coeffs = coeffs.reshape(shape)
-        return coeffs
+        pairs = map_pairs(system, pair_offsets, pair_nbs)
+        return coeffs, dcoeffs, pairs
     def flattenPositions(self, system, atomic_numbers=None):
         Z = system.get_atomic_numbers()
         pos = system.get_positions()
@@ -196,21 +310,26 @@ class SoapGtoCalculator(object):
             average=False,
             sparse=False,
             normalize=False,
+            n_threads=0,
             encoder=lambda s: tools.ptable.lookup[s].z,
             decoder=lambda z: tools.ptable.lookup[int(z)].name):
+        # n_threads <= 0: Use OpenMP default (OMP_NUM_THREADS)
         self.types = types
         self.types_z = np.array(sorted([ encoder(s) for s in self.types ]))
         self.types_elem = np.array([ decoder(z) for z in self.types_z ])
         self._Nt = len(self.types_z)
         self._eta = 1/(2*sigma**2)
         self._sigma = sigma
-        self._alphas, self._betas = self.setupBasisGTO(rcut, nmax)
+        self._alphas, self._betas = self.setupBasisGTO(rcut, nmax, lmax)
         self._rcut = rcut
         self._nmax = nmax
         self._lmax = lmax
         self.periodic = periodic
         self._average = average
         self._normalize = normalize
+        self.n_threads = n_threads
+    def setNumThreads(self, n_threads):
+        self.n_threads = n_threads
     def getDim(self):
         return self.getChannelDim()*self.getNumberOfChannels()
     def getChannelDim(self):
@@ -219,14 +338,16 @@ class SoapGtoCalculator(object):
         return self._Nt*(self._Nt+1)/2
     def getNumberofTypes(self):
         return len(self.types_z)
-    def evaluate(self, system, positions=None):
+    def evaluate(self, system, positions=None, gradients=False):
+        # With gradients=True, returns (X, dX, pairs) as GylmCalculator.evaluate
         if self.periodic:
             cell = system.get_cell()
+        centres_on_atoms = positions is None
         if positions is None:
             positions = system.get_positions()
         threshold = 0.001
         cutoff_padding = self._sigma*np.sqrt(-2*np.log(threshold))
-        X = self.evaluateGTO(
+        res = self.evaluateGTO(
             system,
             positions,
             self._alphas,
@@ -236,16 +357,22 @@ class SoapGtoCalculator(object):
             nmax=self._nmax,
             lmax=self._lmax,
             eta=self._eta,
-            atomic_numbers=None)
-        if self._normalize:
-            z = 1./np.sum(X**2, axis=1)**0.5
-            X = (X.T*z).T
-        return X
+            atomic_numbers=None,
+            gradients=gradients)
+        if not gradients:
+            X = res
+            if self._normalize:
+                z = 1./np.sum(X**2, axis=1)**0.5
+                X = (X.T*z).T
+            return X
+        X, dX, pairs = res
+        return finalize_gradients(X, dX, pairs, 
+            centres_on_atoms, self._normalize)
     def evaluateGTO(self, system, centers, 
             alphas, betas, 
             rcut, cutoff_padding, 
             nmax, lmax, eta, atomic_numbers=None, 
-            use_global_types=True):
+            use_global_types=True, gradients=False):
         n_atoms = len(system)
         positions, Z_sorted, n_types, atomtype_lst = self.flattenPositions(system, atomic_numbers)
         centers = np.array(centers)
@@ -258,13 +385,20 @@ class SoapGtoCalculator(object):
         n_types = len(Z_sorted_global)
         c = np.zeros(int((nmax*(nmax+1))/2)*(lmax+1)*int((n_types*(n_types + 1))/2)*n_centers, dtype=np.float64)
         shape = (n_centers, int((nmax*(nmax+1))/2)*(lmax+1)*int((n_types*(n_types+1))/2))
-        evaluate_soapgto(c, positions, centers, 
+        args = (c, positions, centers, 
             alphas, betas, Z_sorted, Z_sorted_global,
             rcut, cutoff_padding, 
             n_atoms, n_types, 
-            nmax, lmax, n_centers, eta, True)
+            nmax, lmax, n_centers, eta, True,
+            self.n_threads)
+        if not gradients:
+            evaluate_soapgto(*args)
+            c = c.reshape(shape)
+            return c
+        dc, pair_offsets, pair_nbs = evaluate_soapgto_grad(*args)
         c = c.reshape(shape)
-        return c
+        pairs = map_pairs(system, pair_offsets, pair_nbs)
+        return c, dc, pairs
     def flattenPositions(self, system, atomic_numbers=None):
         Z = system.get_atomic_numbers()
         pos = system.get_positions()
@@ -285,14 +419,14 @@ class SoapGtoCalculator(object):
         positions_sorted = np.concatenate(pos_lst, axis=0)
         atomic_numbers_sorted = np.concatenate(z_lst).ravel()
         return positions_sorted, atomic_numbers_sorted, n_types, atomic_numbers_sorted
-    def setupBasisGTO(self, rcut, nmax):
+    def setupBasisGTO(self, rcut, nmax, lmax):
         # These are the values for where the different basis functions should decay
         # to: evenly space between 1 angstrom and rcut.
         a = np.linspace(1, rcut, nmax)
         threshold = 1e-3  # This is the fixed gaussian decay threshold
-        alphas_full = np.zeros((10, nmax))
-        betas_full = np.zeros((10, nmax, nmax))
-        for l in range(0, 10):
+        alphas_full = np.zeros((lmax+1, nmax))
+        betas_full = np.zeros((lmax+1, nmax, nmax))
+        for l in range(0, lmax+1):
             # The alphas are calculated so that the GTOs will decay to the set
             # threshold value at their respective cutoffs
             alphas = -np.log(threshold/np.power(a, l))/a**2
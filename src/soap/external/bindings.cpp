@@ -24,6 +24,7 @@ limitations under the License.
 #include "kernel.hpp"
 #include "gylm.hpp"
 #include "ylm.hpp"
+#include "vexp.hpp"
 
 namespace py = pybind11;
 using namespace std;
@@ -31,9 +32,18 @@ using namespace std;
 PYBIND11_MODULE(_soapgto, m) {
     m.def("evaluate_power", &_py_evaluate_xtunkl, "Power spectra for tnlm-type tensors");
     m.def("evaluate_gylm", &evaluate_gylm, "Gnl-Ylm frequency-damped convolutions");
+    m.def("evaluate_gylm_batch", &evaluate_gylm_batch, "Gnl-Ylm convolutions for a batch of structures");
+    m.def("evaluate_gylm_grad", &evaluate_gylm_grad, "Gnl-Ylm convolutions with position derivatives");
     m.def("evaluate_soapgto", &soapGTO, "SOAP with gaussian type orbital radial basis set");
-    m.def("smooth_match", &smooth_match, "Smooth best-match assignment");
+    m.def("evaluate_soapgto_grad", &soapGTOGrad, "SOAP-GTO with position derivatives");
+    m.def("smooth_match", &smooth_match, "Smooth best-match assignment",
+        py::arg("P"), py::arg("K"), py::arg("nx"), py::arg("ny"), py::arg("gamma"),
+        py::arg("epsilon"), py::arg("verbose"), py::arg("gamma_start")=0.);
+    m.def("smooth_match_batch", &smooth_match_batch, "Smooth best-match assignment for a batch of kernel matrices",
+        py::arg("P"), py::arg("K"), py::arg("gamma"), py::arg("epsilon"),
+        py::arg("n_threads"), py::arg("gamma_start")=0.);
     m.def("ylm", &_py_ylm, "Spherical harmonic series");
+    m.def("exp_batch", &_py_exp_batch, "Vectorised exponential");
     py::class_<CellList>(m, "CellList")
         .def(py::init<py::array_t<double>, double>())
         .def("get_neighbours_for_index", &CellList::getNeighboursForIndex)
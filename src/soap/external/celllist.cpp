@@ -22,7 +22,23 @@ limitations under the License.
 using namespace std;
 
 CellList::CellList(py::array_t<double> positions, double cutoff)
-    : positions(positions.unchecked<2>())
+    : n_positions(positions.shape(0))
+    , cutoff(cutoff)
+    , cutoffSquared(cutoff*cutoff)
+{
+    auto pos = positions.unchecked<2>();
+    this->positions.resize(3*this->n_positions);
+    for (int i = 0; i < this->n_positions; i++) {
+        for (int d = 0; d < 3; d++) {
+            this->positions[3*i+d] = pos(i, d);
+        }
+    }
+    this->init();
+}
+
+CellList::CellList(const double *positions, int n_positions, double cutoff)
+    : positions(positions, positions+3*n_positions)
+    , n_positions(n_positions)
     , cutoff(cutoff)
     , cutoffSquared(cutoff*cutoff)
 {
@@ -31,13 +47,13 @@ CellList::CellList(py::array_t<double> positions, double cutoff)
 
 void CellList::init() {
     // Find cell limits
-    this->xmin = this->xmax = this->positions(0, 0);
-    this->ymin = this->ymax = this->positions(0, 1);
-    this->zmin = this->zmax = this->positions(0, 2);
-    for (ssize_t i = 0; i < this->positions.shape(0); i++) {
-        double x = this->positions(i, 0);
-        double y = this->positions(i, 1);
-        double z = this->positions(i, 2);
+    this->xmin = this->xmax = this->position(0, 0);
+    this->ymin = this->ymax = this->position(0, 1);
+    this->zmin = this->zmax = this->position(0, 2);
+    for (ssize_t i = 0; i < this->n_positions; i++) {
+        double x = this->position(i, 0);
+        double y = this->position(i, 1);
+        double z = this->position(i, 2);
         if (x < this->xmin) {
             this->xmin = x;
         };
@@ -80,10 +96,10 @@ void CellList::init() {
     this->bins = vector<vector<vector<vector<int>>>>(this->nx, vector<vector<vector<int>>>(this->ny, vector<vector<int>>(this->nz, vector<int>())));
 
     // Fill the bins with atom indices
-    for (ssize_t idx = 0; idx < this->positions.shape(0); idx++) {
-        double x = this->positions(idx, 0);
-        double y = this->positions(idx, 1);
-        double z = this->positions(idx, 2);
+    for (ssize_t idx = 0; idx < this->n_positions; idx++) {
+        double x = this->position(idx, 0);
+        double y = this->position(idx, 1);
+        double z = this->position(idx, 2);
 
         // Get bin index
         int i = (x - this->xmin)/this->dx;
@@ -121,11 +137,11 @@ CellListResult CellList::getNeighboursForPosition(const double x, const double y
             for (int k = kstart; k <= kend; k++){
 
                 // For each atom in the current bin, calculate the actual distance
-                vector<int> binIndices = this->bins[i][j][k];
+                const vector<int> &binIndices = this->bins[i][j][k];
                 for (auto &idx : binIndices) {
-                    double ix = this->positions(idx, 0);
-                    double iy = this->positions(idx, 1);
-                    double iz = this->positions(idx, 2);
+                    double ix = this->position(idx, 0);
+                    double iy = this->position(idx, 1);
+                    double iz = this->position(idx, 2);
                     double deltax = x - ix;
                     double deltay = y - iy;
                     double deltaz = z - iz;
@@ -144,9 +160,9 @@ CellListResult CellList::getNeighboursForPosition(const double x, const double y
 
 CellListResult CellList::getNeighboursForIndex(const int idx) const
 {
-    double x = this->positions(idx, 0);
-    double y = this->positions(idx, 1);
-    double z = this->positions(idx, 2);
+    double x = this->position(idx, 0);
+    double y = this->position(idx, 1);
+    double z = this->position(idx, 2);
     CellListResult result = this->getNeighboursForPosition(x, y, z);
 
     // Remove self from neighbours
@@ -40,6 +40,14 @@ class CellList {
          * @param atomicNumbers Atomic numbers.
          */
         CellList(py::array_t<double> positions, double cutoff);
+        /**
+         * Constructor
+         *
+         * @param positions Atomic positions in cartesian coordinates,
+         * row-major of shape [n_positions x 3].
+         * @param n_positions Number of positions.
+         */
+        CellList(const double *positions, int n_positions, double cutoff);
         /**
          * Get the indices of atoms within the radial cutoff distance from the
          * given position.
@@ -65,7 +73,13 @@ class CellList {
          */
         void init();
 
-        const py::detail::unchecked_reference<double, 2> positions;
+        /**
+         * Position i, component d.
+         */
+        double position(int i, int d) const { return this->positions[3*i+d]; }
+
+        vector<double> positions;
+        int n_positions;
         const double cutoff;
         const double cutoffSquared;
         double xmin;
@@ -3,29 +3,33 @@
 #include <math.h>
 #include <stdlib.h>
 #include <time.h>
+#include <cstddef>
 #include <string>
 #include <map>
 #include <set>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
 #include "gylm.hpp"
 #include "ylm.hpp"
+#include "vexp.hpp"
+#include "sketch.hpp"
 #include "celllist.hpp"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef SOAPXX_WITH_CBLAS
+#include <cblas.h>
+#endif
 
 // Unfortunately icc forbids use of math functions in constexpr
 constexpr double radial_epsilon  = +1.00000000000e-10; // constexpr double radial_epsilon = 1e-10;
-constexpr double lnorm_0         = +1.00000000000e+00; // constexpr double lnorm_0  = 1.;
-constexpr double lnorm_1         = +5.77350269190e-01; // constexpr double lnorm_1  = 1./sqrt(3.);
-constexpr double lnorm_2         = +4.47213595500e-01; // constexpr double lnorm_2  = 1./sqrt(5.);
-constexpr double lnorm_3         = +3.77964473009e-01; // constexpr double lnorm_3  = 1./sqrt(7.);
-constexpr double lnorm_4         = +3.33333333333e-01; // constexpr double lnorm_4  = 1./sqrt(9.);
-constexpr double lnorm_5         = +3.01511344578e-01; // constexpr double lnorm_5  = 1./sqrt(11.);
-constexpr double lnorm_6         = +2.77350098113e-01; // constexpr double lnorm_6  = 1./sqrt(13.);
-constexpr double lnorm_7         = +2.58198889747e-01; // constexpr double lnorm_7  = 1./sqrt(15.);
-constexpr double lnorm_8         = +2.42535625036e-01; // constexpr double lnorm_8  = 1./sqrt(17);
-constexpr double lnorm_9         = +2.29415733871e-01; // constexpr double lnorm_9  = 1./sqrt(19.);
-constexpr double lnorm_10        = +2.18217890236e-01; // constexpr double lnorm_10 = 1./sqrt(21.);
-constexpr double lnorm_11        = +2.08514414057e-01; // constexpr double lnorm_11 = 1./sqrt(23.);
+
+void evaluate_lnorm(int lmax, vector<double> &lnorm) {
+    // Normalisation of the l-channels of the power spectrum, 1/sqrt(2l+1)
+    lnorm.resize(lmax+1);
+    for (int l=0; l<lmax+1; ++l) lnorm[l] = 1./sqrt(2.*l+1.);
+}
 
 void evaluate_deltas(
         double xi, double yi, double zi, 
@@ -64,34 +68,49 @@ void evaluate_gnl(
         double *dr, double *dr2, int n_parts, 
         double *centres, double *alphas, 
         int nmax, int lmax, 
-        double *gn, double *hl, double *gnl,
+        double *gnl,
         double part_sigma,
         double wconstant,
         double wscale,
         double wcentre,
         double ldamp) {
+    // All exponentials for this batch of particles are evaluated in one 
+    // vectorised call, with arguments (per particle j)
+    // >>> ex[j*dim_e] = weight, ex[j*dim_e+1+n] = g_n, ex[j*dim_e+1+nmax+l] = h_l
     double invs_wscale2 = 1./(wscale*wscale);
+    double s_4pi = sqrt(4.*M_PI);
+    int dim_e = 1+nmax+lmax+1;
+    static thread_local vector<double> buffer;
+    if (buffer.size() < size_t(2*n_parts*dim_e)) buffer.resize(2*n_parts*dim_e);
+    double *args = &buffer[0];
+    double *ex = args + n_parts*dim_e;
+    for (int j=0; j<n_parts; ++j) {
+        double *aj = args + j*dim_e;
+        aj[0] = -dr2[j]*invs_wscale2;
+        for (int n=0; n<nmax; ++n) {
+            aj[1+n] = -alphas[n]*(centres[n]-dr[j])*(centres[n]-dr[j]);
+        }
+        double rr = s_4pi*dr[j] + radial_epsilon;
+        for (int l=0; l<lmax+1; ++l) {
+            aj[1+nmax+l] = -sqrt(2*l)*ldamp*part_sigma/rr;
+        }
+    }
+    evaluate_exp_batch(args, ex, n_parts*dim_e);
     int c_gnl = -1;
     for (int j=0; j<n_parts; ++j) {
+        double *ej = ex + j*dim_e;
         double w = 1.;
         if (wconstant || dr[j] < radial_epsilon) w = wcentre;
         else {
             double r2eff = dr2[j]*invs_wscale2;
-            double t = exp(-r2eff);
+            double t = ej[0];
             w = (1.-t)/r2eff + t*(wcentre-1.);
         }
-        for (int n=0; n<nmax; ++n) {
-            gn[n] = w*exp(-alphas[n]*(centres[n]-dr[j])*(centres[n]-dr[j]));
-        }
-        for (int l=0; l<lmax+1; ++l) {
-            hl[l] = exp(-
-                sqrt(2*l)*ldamp*part_sigma /
-                (sqrt(4.*M_PI)*dr[j] + radial_epsilon)
-            );
-        }
+        double *gn = ej + 1;
+        double *hl = ej + 1 + nmax;
         for (int n=0; n<nmax; ++n) {
             for (int l=0; l<lmax+1; ++l) {
-                gnl[++c_gnl] = gn[n]*hl[l];
+                gnl[++c_gnl] = w*gn[n]*hl[l];
             }
         }
     }
@@ -101,11 +120,9 @@ void evaluate_qitnlm(double *jw, double *jgnl, double *jylm, int n_nbs,
         int nmax, int lmax, int offset_idx, int dim_nlm, int dim_nl, int dim_lm,
         double *qitnlm) {
     // >>> # NOTE Array layout:
-    // >>> i = 0
-    // >>> for nb in nbs:
-    // >>>     for l in range(lmax+1):
-    // >>>         for m in range(-l,l+1):
-    // >>>             ylmi = ylm[i++]
+    // >>> for lm in range(dim_lm):
+    // >>>     for nb in nbs:
+    // >>>         ylmi = ylm[lm*n_nbs + nb]
     // >>> i = 0
     // >>> for nb in nbs:
     // >>>     for n in range(nmax):
@@ -114,75 +131,254 @@ void evaluate_qitnlm(double *jw, double *jgnl, double *jylm, int n_nbs,
     // >>> # The offset index takes into account source 
     // >>> # (= centre) and nb type index
     // >>> offset = src_idx*dim_tnlm + type_idx*dim_nlm
-    int c_itnlm = offset_idx;
-    for (int nlm=0; nlm<dim_nlm; ++nlm) qitnlm[c_itnlm++] = 0.;
-    int c_gnl = 0;
-    for (int j=0; j<n_nbs; ++j) {
-        c_itnlm = offset_idx;
-        // Note that here c_gnl == j*dim_nl
+    // The sums over neighbours run innermost, such that they vectorise.
+    static thread_local vector<double> buffer;
+    if (buffer.size() < size_t(n_nbs)) buffer.resize(n_nbs);
+    double *wg = &buffer[0];
+    for (int n=0; n<nmax; ++n) {
+        for (int l=0; l<lmax+1; ++l) {
+            int c_gnl = n*(lmax+1)+l;
+            for (int j=0; j<n_nbs; ++j) wg[j] = jw[j]*jgnl[j*dim_nl+c_gnl];
+            for (int lm=l*l; lm<(l+1)*(l+1); ++lm) {
+                const double *ylm = jylm + lm*n_nbs;
+                double q = 0.;
+                #pragma omp simd reduction(+:q)
+                for (int j=0; j<n_nbs; ++j) q += wg[j]*ylm[j];
+                qitnlm[offset_idx + n*dim_lm + lm] = q;
+            }
+        }
+    }
+}
+
+void evaluate_weights_grad(
+        double *dr, int n_parts, 
+        double r_cut, double r_cut_width, 
+        double *w, double *dw) {
+    // As evaluate_weights, with dw = dw/dr
+    for (int j=0; j<n_parts; ++j) {
+        if (dr[j] <= r_cut-r_cut_width) {
+            w[j] = 1.;
+            dw[j] = 0.;
+        }
+        else if (dr[j] >= r_cut) {
+            w[j] = 0.;
+            dw[j] = 0.;
+        }
+        else {
+            double phi = M_PI*(dr[j]-r_cut+r_cut_width)/r_cut_width;
+            w[j] = 0.5*(1+cos(phi));
+            dw[j] = -0.5*M_PI/r_cut_width*sin(phi);
+        }
+    }
+}
+
+void evaluate_gnl_grad(
+        double *dr, double *dr2, int n_parts, 
+        double *centres, double *alphas, 
+        int nmax, int lmax, 
+        double *gn, double *dgn, double *hl, double *dhl,
+        double *gnl, double *dgnl,
+        double part_sigma,
+        double wconstant,
+        double wscale,
+        double wcentre,
+        double ldamp) {
+    // As evaluate_gnl, with dgnl = dgnl/dr
+    double invs_wscale2 = 1./(wscale*wscale);
+    double s_4pi = sqrt(4.*M_PI);
+    int c_gnl = -1;
+    for (int j=0; j<n_parts; ++j) {
+        double w = 1.;
+        double dw = 0.;
+        if (wconstant || dr[j] < radial_epsilon) w = wcentre;
+        else {
+            double r2eff = dr2[j]*invs_wscale2;
+            double t = exp(-r2eff);
+            w = (1.-t)/r2eff + t*(wcentre-1.);
+            dw = ((t*r2eff - (1.-t))/(r2eff*r2eff) - t*(wcentre-1.))
+                *2.*dr[j]*invs_wscale2;
+        }
+        for (int n=0; n<nmax; ++n) {
+            double dc = centres[n]-dr[j];
+            double e = exp(-alphas[n]*dc*dc);
+            gn[n] = w*e;
+            dgn[n] = dw*e + 2.*alphas[n]*dc*w*e;
+        }
+        double rr = s_4pi*dr[j] + radial_epsilon;
+        for (int l=0; l<lmax+1; ++l) {
+            double kl = sqrt(2*l)*ldamp*part_sigma;
+            hl[l] = exp(-kl/rr);
+            dhl[l] = hl[l]*kl*s_4pi/(rr*rr);
+        }
         for (int n=0; n<nmax; ++n) {
-            int c_ylm = j*dim_lm;
             for (int l=0; l<lmax+1; ++l) {
-                for (int m=-l; m<l+1; ++m) {
-                    qitnlm[c_itnlm++] += jw[j]*jgnl[c_gnl]*jylm[c_ylm];
-                    ++c_ylm;
-                }
                 ++c_gnl;
+                gnl[c_gnl] = gn[n]*hl[l];
+                dgnl[c_gnl] = dgn[n]*hl[l] + gn[n]*dhl[l];
             }
         }
     }
 }
 
-void evaluate_xtunkl(double *xitunkl, double *qitnlm, vector<double> &lnorm,
-        int n_src, int n_types, int nmax, int lmax, 
-        int dim_tnlm, int dim_nlm, int dim_lm) {
-    int itunkl = 0;
-    for (int i=0; i<n_src; ++i) {
-        for (int t=0; t<n_types; ++t) {
-            int tnlm_off = i*dim_tnlm + t*dim_nlm;
-            for (int u=t; u<n_types; ++u) {
-                int uklm_off = i*dim_tnlm + u*dim_nlm;
-                for (int n=0; n<nmax; ++n) {
-                    for (int k=0; k<nmax; ++k) {
-                        int tnlm = tnlm_off + n*dim_lm;
-                        int uklm = uklm_off + k*dim_lm;
-                        for (int l=0; l<lmax+1; ++l) {
-                            double x = 0.;
-                            for (int m=-l; m<l+1; ++m) {
-                                x += qitnlm[tnlm++]*qitnlm[uklm++];
-                            }
-                            xitunkl[itunkl++] = lnorm[l]*x;
-                        }
+void evaluate_dqitnlm(double *jw, double *jdw, double *jgnl, double *jdgnl,
+        double *jylm, double *jdylm, 
+        double *dx, double *dy, double *dz, double *dr, int n_nbs, 
+        int nmax, int lmax, int dim_nlm, int dim_nl, int dim_lm,
+        double *dqjnlm) {
+    // Derivatives of the expansion coefficients of one type channel 
+    // with respect to the position of each neighbour j:
+    // >>> dq[j][xyz][nlm] = d(w_j g_nl(r_j) Y_lm(r_j))/dr_j
+    for (int j=0; j<n_nbs; ++j) {
+        double ir = (dr[j] < radial_epsilon) ? 0. : 1./dr[j];
+        double u[3] = { dx[j]*ir, dy[j]*ir, dz[j]*ir };
+        for (int d=0; d<3; ++d) {
+            double *dq = dqjnlm + (3*j+d)*dim_nlm;
+            double *dylm = jdylm + (3*j+d)*dim_lm;
+            int c_gnl = j*dim_nl;
+            int c_nlm = 0;
+            for (int n=0; n<nmax; ++n) {
+                int c_lm = 0;
+                for (int l=0; l<lmax+1; ++l) {
+                    double g = jw[j]*jgnl[c_gnl];
+                    double dg = (jdw[j]*jgnl[c_gnl] + jw[j]*jdgnl[c_gnl])*u[d];
+                    for (int m=-l; m<l+1; ++m) {
+                        dq[c_nlm++] = dg*jylm[c_lm*n_nbs+j] + g*dylm[c_lm];
+                        ++c_lm;
                     }
+                    ++c_gnl;
                 }
             }
         }
     }
 }
 
-void evaluate_xtunkl(double *xitunkl, double *qitnlm, vector<double> &lnorm, 
+void evaluate_syrk_upper(const double *a, int n, int k, int lda, double *c) {
+    // Upper triangle of c = a a^T, with a of shape [n x k] (row stride lda)
+    // and c of shape [n x n] (row-major). The lower triangle is not set.
+#ifdef SOAPXX_WITH_CBLAS
+    cblas_dsyrk(CblasRowMajor, CblasUpper, CblasNoTrans, 
+        n, k, 1., a, lda, 0., c, n);
+#else
+    for (int i=0; i<n; ++i) {
+        const double *ai = a + i*lda;
+        for (int j=i; j<n; ++j) {
+            const double *aj = a + j*lda;
+            double x = 0.;
+            for (int m=0; m<k; ++m) x += ai[m]*aj[m];
+            c[i*n+j] = x;
+        }
+    }
+#endif
+}
+
+void evaluate_xtunkl(double *xitunkl, double *qtnlm, vector<double> &lnorm, 
     int src_idx, set<int> &nb_type_indices, int n_types, int nmax, int lmax,
-    int dim_tunkl, int dim_nkl, int dim_tnlm, int dim_nlm, int dim_lm) {
-    int itunkl_off = src_idx*dim_tunkl;
-    int itunkl = 0;
-    for (auto t_it=nb_type_indices.begin(); t_it!=nb_type_indices.end(); ++t_it) {
-        int t = *t_it;
-        int tnlm_off = src_idx*dim_tnlm + t*dim_nlm;
-        for (auto u_it=t_it; u_it!=nb_type_indices.end(); ++u_it) {
-            int u = *u_it;
-            int uklm_off = src_idx*dim_tnlm + u*dim_nlm;
-            itunkl = itunkl_off + (
+    int dim_tunkl, int dim_nkl, int dim_nlm, int dim_lm) {
+    // NOTE qtnlm points to the coefficients of this source only
+    // For each l, the rows (t,n) of the [tn x m] block Q_l of the 
+    // coefficients of the types present are contracted as G = Q_l Q_l^T, 
+    // of which only the upper triangle is evaluated (DSYRK). Channels 
+    // with t == u are completed by symmetry.
+    int n_present = nb_type_indices.size();
+    if (n_present == 0) return;
+    int dim_g = n_present*nmax;
+    int dim_gg = dim_g*dim_g;
+    // Per-thread scratch, reused across sources
+    static thread_local vector<double> qbuffer;
+    static thread_local vector<double> gbuffer;
+    if (gbuffer.size() < size_t((lmax+1)*dim_gg)) gbuffer.resize((lmax+1)*dim_gg);
+    double *g = &gbuffer[0];
+    // Gather the rows of the present types (only if some are absent)
+    vector<int> types(nb_type_indices.begin(), nb_type_indices.end());
+    double *q = qtnlm;
+    if (n_present < n_types) {
+        if (qbuffer.size() < size_t(n_present*dim_nlm)) qbuffer.resize(n_present*dim_nlm);
+        q = &qbuffer[0];
+        for (int tt=0; tt<n_present; ++tt) {
+            double *qt = qtnlm + types[tt]*dim_nlm;
+            for (int nlm=0; nlm<dim_nlm; ++nlm) q[tt*dim_nlm+nlm] = qt[nlm];
+        }
+    }
+    for (int l=0; l<lmax+1; ++l) {
+        evaluate_syrk_upper(q + l*l, dim_g, 2*l+1, dim_lm, g + l*dim_gg);
+    }
+    // Scatter into the (t,u,n,k,l) layout of the output
+    std::ptrdiff_t itunkl_off = std::ptrdiff_t(src_idx)*dim_tunkl;
+    for (int tt=0; tt<n_present; ++tt) {
+        int t = types[tt];
+        for (int uu=tt; uu<n_present; ++uu) {
+            int u = types[uu];
+            std::ptrdiff_t itunkl = itunkl_off + (
                 t*n_types - t*(t+1)/2 + u)*dim_nkl;
             for (int n=0; n<nmax; ++n) {
+                int row = tt*nmax + n;
                 for (int k=0; k<nmax; ++k) {
-                    int tnlm = tnlm_off + n*dim_lm;
-                    int uklm = uklm_off + k*dim_lm;
+                    int col = uu*nmax + k;
+                    int g_idx = (row <= col) ? row*dim_g+col : col*dim_g+row;
+                    for (int l=0; l<lmax+1; ++l) {
+                        xitunkl[itunkl++] = lnorm[l]*g[l*dim_gg+g_idx];
+                    }
+                }
+            }
+        }
+    }
+}
+
+void evaluate_xtunkl(double *xitunkl, double *qitnlm, vector<double> &lnorm,
+        int n_src, int n_types, int nmax, int lmax, 
+        int dim_tnlm, int dim_nlm, int dim_lm) {
+    // Dense variant: All types are contracted for all sources
+    int dim_nkl = nmax*nmax*(lmax+1);
+    int dim_tunkl = n_types*(n_types+1)/2*dim_nkl;
+    set<int> type_indices;
+    for (int t=0; t<n_types; ++t) type_indices.insert(t);
+    for (int i=0; i<n_src; ++i) {
+        evaluate_xtunkl(xitunkl, qitnlm + std::ptrdiff_t(i)*dim_tnlm, lnorm,
+            i, type_indices, n_types, nmax, lmax, 
+            dim_tunkl, dim_nkl, dim_nlm, dim_lm);
+    }
+}
+
+void evaluate_dxtunkl(double *dxtunkl, double *qtnlm, double *dqnlm, 
+    vector<double> &lnorm, int s, set<int> &nb_type_indices, 
+    int n_types, int nmax, int lmax,
+    int dim_tunkl, int dim_nkl, int dim_nlm, int dim_lm) {
+    // Derivative of the power spectrum of one source with respect to 
+    // the position of a neighbour of type s. Only channels (t,u) with 
+    // t == s or u == s are affected.
+    // >>> dxtunkl[xyz][tunkl], dqnlm[xyz][nlm]
+    for (int d=0; d<3; ++d) {
+        double *dx = dxtunkl + d*dim_tunkl;
+        double *dq = dqnlm + d*dim_nlm;
+        double *qs = qtnlm + s*dim_nlm;
+        for (const int &u : nb_type_indices) {
+            double *qu = qtnlm + u*dim_nlm;
+            int t = (s < u) ? s : u;
+            int v = (s < u) ? u : s;
+            int itunkl = (t*n_types - t*(t+1)/2 + v)*dim_nkl;
+            for (int n=0; n<nmax; ++n) {
+                for (int k=0; k<nmax; ++k) {
+                    int nlm = n*dim_lm;
+                    int klm = k*dim_lm;
                     for (int l=0; l<lmax+1; ++l) {
                         double x = 0.;
-                        for (int m=-l; m<l+1; ++m) {
-                            x += qitnlm[tnlm++]*qitnlm[uklm++];
+                        if (u == s) {
+                            for (int m=-l; m<l+1; ++m) {
+                                x += dq[nlm]*qs[klm] + qs[nlm]*dq[klm];
+                                ++nlm; ++klm;
+                            }
                         }
-                        xitunkl[itunkl++] = lnorm[l]*x;
+                        else if (s < u) {
+                            for (int m=-l; m<l+1; ++m) {
+                                x += dq[nlm++]*qu[klm++];
+                            }
+                        }
+                        else {
+                            for (int m=-l; m<l+1; ++m) {
+                                x += qu[nlm++]*dq[klm++];
+                            }
+                        }
+                        dx[itunkl++] = lnorm[l]*x;
                     }
                 }
             }
@@ -202,15 +398,222 @@ void _py_evaluate_xtunkl(
     int dim_lm = (lmax+1)*(lmax+1);
     int dim_nlm = nmax*dim_lm;
     int dim_tnlm = n_types*dim_nlm;
-    vector<double> lnorm = { 
-        lnorm_0, lnorm_1, lnorm_2,  lnorm_3,
-        lnorm_4, lnorm_5, lnorm_6,  lnorm_7,
-        lnorm_8, lnorm_9, lnorm_10, lnorm_11 };
+    vector<double> lnorm;
+    evaluate_lnorm(lmax, lnorm);
     evaluate_xtunkl(xitunkl, qitnlm, lnorm,
         n_src, n_types, nmax, lmax,
         dim_tnlm, dim_nlm, dim_lm);
 }
 
+void evaluate_type_index_map(py::array_t<int> all_types, int n_types,
+        map<int, int> &type_index_map, bool verbose) {
+    auto all_types_list = all_types.unchecked<1>();
+    set<int> type_set;
+    for (int i=0; i<n_types; ++i) {
+        if (verbose) std::cout << "Register type " 
+            << all_types_list(i) << std::endl;
+        type_set.insert(all_types_list(i));
+    }
+    int type_index = 0;
+    for (auto it=type_set.begin(); it!=type_set.end(); ++it) {
+        if (verbose) std::cout << "Place type " 
+            << *it << " at index " << type_index << std::endl;
+        type_index_map[*it] = type_index++;
+    }
+}
+
+// Settings and ancillary arrays shared by all centres of a call
+struct GylmSetup {
+    double *gnl_centres;
+    double *gnl_alphas;
+    double r_cut;
+    double r_cut_width;
+    int n_types;
+    int nmax;
+    int lmax;
+    double part_sigma;
+    bool wconstant;
+    double wscale;
+    double wcentre;
+    double ldamp;
+    bool power;
+    bool sketch;
+    int sketch_dim;
+    int dim_nl;
+    int dim_lm;
+    int dim_nlm;
+    int dim_tnlm;
+    int dim_nkl;
+    int dim_tunkl;
+    int dim_sk;
+    int dim_x;
+    map<int, int> type_index_map;
+    vector<double> lnorm;
+    vector<double> ylm_norm;
+    vector<int> sketch_h;
+    vector<double> sketch_s;
+};
+
+void evaluate_gylm_setup(GylmSetup &setup,
+        py::array_t<double> gnl_centres_py,
+        py::array_t<double> gnl_alphas_py,
+        py::array_t<int> all_types,
+        double r_cut, double r_cut_width,
+        int n_types, int nmax, int lmax,
+        double part_sigma, bool wconstant, double wscale, double wcentre,
+        double ldamp, bool power, int sketch_dim, int sketch_seed,
+        bool verbose) {
+    setup.gnl_centres = (double*) gnl_centres_py.request().ptr;
+    setup.gnl_alphas = (double*) gnl_alphas_py.request().ptr;
+    setup.r_cut = r_cut;
+    setup.r_cut_width = r_cut_width;
+    setup.n_types = n_types;
+    setup.nmax = nmax;
+    setup.lmax = lmax;
+    setup.part_sigma = part_sigma;
+    setup.wconstant = wconstant;
+    setup.wscale = wscale;
+    setup.wcentre = wcentre;
+    setup.ldamp = ldamp;
+    setup.power = power;
+    // Type mapping
+    evaluate_type_index_map(all_types, n_types, setup.type_index_map, verbose);
+    // Ancillary arrays
+    setup.dim_nl = nmax*(lmax+1);
+    setup.dim_lm = (lmax+1)*(lmax+1);
+    setup.dim_nlm = nmax*setup.dim_lm;
+    setup.dim_tnlm = n_types*setup.dim_nlm;
+    setup.dim_nkl = nmax*nmax*(lmax+1);
+    setup.dim_tunkl = n_types*(n_types+1)/2*nmax*nmax*(lmax+1);
+    evaluate_lnorm(lmax, setup.lnorm);
+    evaluate_ylm_norm(lmax, setup.ylm_norm);
+    // Sketched power spectra (sketch_dim > 0)
+    setup.sketch = power && (sketch_dim > 0);
+    setup.sketch_dim = sketch_dim;
+    setup.dim_sk = (lmax+1)*sketch_dim;
+    if (setup.sketch) evaluate_sketch_hashes(n_types*nmax, sketch_dim, 
+        sketch_seed, setup.sketch_h, setup.sketch_s);
+    // Output dimension per centre
+    if (setup.sketch) setup.dim_x = setup.dim_sk;
+    else if (power) setup.dim_x = setup.dim_tunkl;
+    else setup.dim_x = setup.dim_tnlm;
+}
+
+// Per-thread scratch of evaluate_gylm_centre, reused across calls
+struct GylmScratch {
+    vector<double> dx, dy, dz, dr, dr2;
+    vector<double> jw, jgnl, jylm;
+    vector<double> qtnlm;
+};
+
+GylmScratch &getGylmScratch(int n_tgt, const GylmSetup &setup) {
+    static thread_local GylmScratch scratch;
+    if (scratch.dr.size() < size_t(n_tgt)) {
+        scratch.dx.resize(n_tgt);
+        scratch.dy.resize(n_tgt);
+        scratch.dz.resize(n_tgt);
+        scratch.dr.resize(n_tgt);
+        scratch.dr2.resize(n_tgt);
+        scratch.jw.resize(n_tgt);
+    }
+    if (scratch.jgnl.size() < size_t(n_tgt*setup.dim_nl)) 
+        scratch.jgnl.resize(n_tgt*setup.dim_nl);
+    if (scratch.jylm.size() < size_t(n_tgt*setup.dim_lm)) 
+        scratch.jylm.resize(n_tgt*setup.dim_lm);
+    if (scratch.qtnlm.size() < size_t(setup.dim_tnlm)) 
+        scratch.qtnlm.resize(setup.dim_tnlm);
+    return scratch;
+}
+
+void evaluate_gylm_centre(
+        double *x_out, 
+        int src_idx,
+        double xi, double yi, double zi, 
+        const CellList &cell_list, 
+        double *tpos, 
+        const int *ttypes, 
+        int n_tgt, 
+        GylmSetup &setup, 
+        bool verbose) {
+    // Expands the density around (xi,yi,zi) and stores the Qtnlm's, their
+    // power spectrum or its sketch (power, sketch) in x_out
+    GylmScratch &scratch = getGylmScratch(n_tgt, setup);
+    double *dx = &scratch.dx[0];
+    double *dy = &scratch.dy[0];
+    double *dz = &scratch.dz[0];
+    double *dr = &scratch.dr[0];
+    double *dr2 = &scratch.dr2[0];
+    double *jw = &scratch.jw[0];
+    double *jgnl = &scratch.jgnl[0];
+    double *jylm = &scratch.jylm[0];
+    int nmax = setup.nmax;
+    int lmax = setup.lmax;
+    int dim_nlm = setup.dim_nlm;
+    int dim_lm = setup.dim_lm;
+    // Qtnlm's of this centre (power mode): These are contracted straight
+    // away, such that the memory does not grow with the number of 
+    // centres. Otherwise the Qtnlm's are written to the output directly.
+    double *qtnlm = x_out;
+    if (setup.power) {
+        qtnlm = &scratch.qtnlm[0];
+        for (int i=0; i<setup.dim_tnlm; ++i) qtnlm[i] = 0.;
+    }
+    if (verbose) {
+        std::cout << std::endl;
+        std::cout << "Src @ " << xi << " " << yi << " " << zi << std::endl;
+    }
+    CellListResult nbs = cell_list.getNeighboursForPosition(xi, yi, zi);
+    map<int, vector<int>> nb_type_map;
+    for (const int &j : nbs.indices) {
+        int t = ttypes[j];
+        nb_type_map[t].push_back(j);
+    }
+    set<int> nb_type_indices;
+    for (const auto &nbs_of_type : nb_type_map) {
+        int type_index = setup.type_index_map.at(nbs_of_type.first);
+        int n_nbs_of_type = nbs_of_type.second.size();
+        nb_type_indices.insert(type_index);
+        if (verbose) {
+            std::cout << "Src " << src_idx << " : " << n_nbs_of_type 
+                << " nbs of type " << type_index << std::endl;
+        }
+        evaluate_deltas(xi, yi, zi, tpos, 
+            dx, dy, dz, dr, dr2, 
+            nbs_of_type.second);
+        if (verbose) {
+            for (int j=0; j<n_nbs_of_type; ++j) {
+                std::cout << "  " << dx[j] << " " << dy[j] << " " << dz[j] 
+                    << " r=" << dr[j] << std::endl;
+            }
+        }
+        // Weight coefficients, Gnl's, Ylm's
+        evaluate_weights(dr, n_nbs_of_type, 
+            setup.r_cut, setup.r_cut_width, jw);
+        evaluate_gnl(dr, dr2, n_nbs_of_type, 
+            setup.gnl_centres, setup.gnl_alphas, nmax, lmax, jgnl,
+            setup.part_sigma, setup.wconstant, setup.wscale, 
+            setup.wcentre, setup.ldamp);
+        evaluate_ylm(&setup.ylm_norm[0], dx, dy, dz, dr,
+            n_nbs_of_type, lmax, jylm);
+        // Expansion coefficients Qnlm's
+        int offset_idx = type_index*dim_nlm;
+        if (verbose) {
+            std::cout << "  Store @ " << offset_idx 
+                << ", length = " << dim_nlm << std::endl;
+        }
+        evaluate_qitnlm(jw, jgnl, jylm, n_nbs_of_type, 
+            nmax, lmax, offset_idx, dim_nlm, setup.dim_nl, dim_lm,
+            qtnlm);
+    }
+    // Contractions for this centre
+    if (setup.sketch) evaluate_xsketch(x_out, qtnlm, setup.lnorm,
+        nb_type_indices, setup.n_types, nmax, lmax, setup.sketch_dim,
+        &setup.sketch_h[0], &setup.sketch_s[0], dim_nlm, dim_lm);
+    else if (setup.power) evaluate_xtunkl(x_out, qtnlm, setup.lnorm, 
+        0, nb_type_indices, setup.n_types, nmax, lmax, 
+        setup.dim_tunkl, setup.dim_nkl, dim_nlm, dim_lm);
+}
+
 void evaluate_gylm(
         py::array_t<double> coeffs, 
         py::array_t<double> src_pos, 
@@ -232,16 +635,23 @@ void evaluate_gylm(
         double wcentre,
         double ldamp,
         bool power,
-        bool verbose) {
+        bool verbose,
+        int sketch_dim,
+        int sketch_seed,
+        int n_threads) {
 
     // Get array pointers
     double *xitunkl = (double*) coeffs.request().ptr;
-    double *gnl_centres = (double*) gnl_centres_py.request().ptr;
-    double *gnl_alphas = (double*) gnl_alphas_py.request().ptr;
     double *spos = (double*) src_pos.request().ptr;
     double *tpos = (double*) tgt_pos.request().ptr;
     int *ttypes = (int*) tgt_types.request().ptr;
 
+    // Settings, type mapping, ancillary arrays
+    GylmSetup setup;
+    evaluate_gylm_setup(setup, gnl_centres_py, gnl_alphas_py, all_types,
+        r_cut, r_cut_width, n_types, nmax, lmax, part_sigma, wconstant, 
+        wscale, wcentre, ldamp, power, sketch_dim, sketch_seed, verbose);
+
     // System info
     if (verbose) {
         std::cout << "# targets, sources =" << n_tgt 
@@ -255,29 +665,153 @@ void evaluate_gylm(
                 << " " << tpos[3*i+1] << " " << tpos[3*i+2] << std::endl;
         }
         for (int i=0; i<nmax; ++i) {
-            std::cout << "G of width " << gnl_alphas[i] 
-                << " @ " << gnl_centres[i] << std::endl;
+            std::cout << "G of width " << setup.gnl_alphas[i] 
+                << " @ " << setup.gnl_centres[i] << std::endl;
         }
     }
 
     // Cell list
     CellList cell_list(tgt_pos, r_cut);
 
-    // Type mapping
+    // Threading: Sources are independent and write to disjoint
+    // slices of xitunkl, hence the output does not depend on the 
+    // number of threads or the schedule. Verbose output is only 
+    // meaningful in serial mode.
+#ifdef _OPENMP
+    if (n_threads <= 0) n_threads = omp_get_max_threads();
+#endif
+    if (verbose || n_src < 2) n_threads = 1;
+
+    // Expansion loop
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+    for (int src_idx=0; src_idx<n_src; ++src_idx) {
+        evaluate_gylm_centre(xitunkl + std::ptrdiff_t(src_idx)*setup.dim_x, src_idx,
+            spos[3*src_idx], spos[3*src_idx+1], spos[3*src_idx+2],
+            cell_list, tpos, ttypes, n_tgt, setup, verbose);
+    }
+
+    // Contractions
+    if (verbose && setup.sketch) {
+        std::cout << "Sketch per centre: " << setup.dim_tnlm << " o " 
+            << setup.dim_tnlm << " -> " << setup.dim_sk << std::endl;
+    }
+    else if (verbose) {
+        std::cout << "Contractions per centre: " << setup.dim_tnlm  << " o " 
+            << setup.dim_tnlm << " -> " << setup.dim_tunkl << std::endl;
+        std::cout << "Contractions for system: " << std::ptrdiff_t(n_src)*setup.dim_tnlm 
+            << " o " << std::ptrdiff_t(n_src)*setup.dim_tnlm << " -> " 
+            << std::ptrdiff_t(n_src)*setup.dim_tunkl << std::endl;
+    }
+    return;
+}
+
+void evaluate_gylm_batch(
+        py::array_t<double> coeffs, 
+        py::array_t<double> src_pos, 
+        py::array_t<int> src_offsets, 
+        py::array_t<double> tgt_pos, 
+        py::array_t<int> tgt_types, 
+        py::array_t<int> tgt_offsets, 
+        py::array_t<double> gnl_centres_py, 
+        py::array_t<double> gnl_alphas_py, 
+        py::array_t<int> all_types, 
+        double r_cut, 
+        double r_cut_width, 
+        int n_structs, 
+        int n_types, 
+        int nmax, 
+        int lmax,
+        double part_sigma,
+        bool wconstant,
+        double wscale,
+        double wcentre,
+        double ldamp,
+        bool power,
+        int sketch_dim,
+        int sketch_seed,
+        int n_threads) {
+    // Structure s has the sources src_offsets[s] ... src_offsets[s+1]-1
+    // and targets tgt_offsets[s] ... tgt_offsets[s+1]-1 of the 
+    // concatenated arrays. The output rows follow the sources.
+    double *xitunkl = (double*) coeffs.request().ptr;
+    double *spos = (double*) src_pos.request().ptr;
+    double *tpos = (double*) tgt_pos.request().ptr;
+    int *ttypes = (int*) tgt_types.request().ptr;
+    int *soffs = (int*) src_offsets.request().ptr;
+    int *toffs = (int*) tgt_offsets.request().ptr;
+
+    GylmSetup setup;
+    evaluate_gylm_setup(setup, gnl_centres_py, gnl_alphas_py, all_types,
+        r_cut, r_cut_width, n_types, nmax, lmax, part_sigma, wconstant, 
+        wscale, wcentre, ldamp, power, sketch_dim, sketch_seed, false);
+
+    // Threading: Structures are independent and processed serially 
+    // each, which results in the same output as evaluate_gylm
+#ifdef _OPENMP
+    if (n_threads <= 0) n_threads = omp_get_max_threads();
+#endif
+    if (n_structs < 2) n_threads = 1;
+
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+    for (int s=0; s<n_structs; ++s) {
+        int n_tgt = toffs[s+1] - toffs[s];
+        if (n_tgt < 1) continue;
+        double *tpos_s = tpos + 3*toffs[s];
+        CellList cell_list(tpos_s, n_tgt, r_cut);
+        for (int src_idx=soffs[s]; src_idx<soffs[s+1]; ++src_idx) {
+            evaluate_gylm_centre(xitunkl + std::ptrdiff_t(src_idx)*setup.dim_x, src_idx,
+                spos[3*src_idx], spos[3*src_idx+1], spos[3*src_idx+2],
+                cell_list, tpos_s, ttypes + toffs[s], n_tgt, setup, false);
+        }
+    }
+}
+
+py::tuple evaluate_gylm_grad(
+        py::array_t<double> coeffs, 
+        py::array_t<double> src_pos, 
+        py::array_t<double> tgt_pos, 
+        py::array_t<double> gnl_centres_py, 
+        py::array_t<double> gnl_alphas_py, 
+        py::array_t<int> tgt_types, 
+        py::array_t<int> all_types, 
+        double r_cut, 
+        double r_cut_width, 
+        int n_src, 
+        int n_tgt, 
+        int n_types, 
+        int nmax, 
+        int lmax,
+        double part_sigma,
+        bool wconstant,
+        double wscale,
+        double wcentre,
+        double ldamp,
+        bool power,
+        bool verbose,
+        int n_threads) {
+    // Evaluates the descriptor (written to coeffs, as in evaluate_gylm)
+    // together with its derivatives with respect to the target positions.
+    // The derivatives are returned in a compact per-centre neighbour 
+    // layout: For source i, pairs p = pair_offsets[i] ... pair_offsets[i+1]-1
+    // hold the derivatives dX_i/dr_j, j = pair_nbs[p], where 
+    // dX has shape (n_pairs, 3, dim) with dim the descriptor dimension
+    // per source. Derivatives are taken at fixed source positions.
+
+    // Get array pointers
+    double *xitunkl = (double*) coeffs.request().ptr;
+    double *gnl_centres = (double*) gnl_centres_py.request().ptr;
+    double *gnl_alphas = (double*) gnl_alphas_py.request().ptr;
+    double *spos = (double*) src_pos.request().ptr;
+    double *tpos = (double*) tgt_pos.request().ptr;
+
+    // Cell list, type mapping
+    CellList cell_list(tgt_pos, r_cut);
     auto tgt_types_list = tgt_types.unchecked<1>();
-    auto all_types_list = all_types.unchecked<1>();
     map<int, int> type_index_map;
-    set<int> type_set;
-    for (int i=0; i<n_types; ++i) {
-        if (verbose) std::cout << "Register type " 
-            << all_types_list(i) << std::endl;
-        type_set.insert(all_types_list(i));
-    }
-    int type_index = 0;
-    for (auto it=type_set.begin(); it!=type_set.end(); ++it) {
-        if (verbose) std::cout << "Place type " 
-            << *it << " at index " << type_index << std::endl;
-        type_index_map[*it] = type_index++;
+    evaluate_type_index_map(all_types, n_types, type_index_map, verbose);
+    vector<int> tgt_type_index(n_tgt);
+    for (int j=0; j<n_tgt; ++j) {
+        tgt_type_index[j] = type_index_map.at(tgt_types_list(j));
     }
 
     // Ancillary arrays
@@ -285,105 +819,142 @@ void evaluate_gylm(
     int dim_lm = (lmax+1)*(lmax+1);
     int dim_nlm = nmax*dim_lm;
     int dim_tnlm = n_types*dim_nlm;
-    int dim_itnlm = n_src*dim_tnlm;
     int dim_nkl = nmax*nmax*(lmax+1);
     int dim_tunkl = n_types*(n_types+1)/2*nmax*nmax*(lmax+1);
-    int dim_itunkl = n_src*n_types*(n_types+1)/2*nmax*nmax*(lmax+1);
-    vector<double> lnorm = { 
-        lnorm_0, lnorm_1, lnorm_2,  lnorm_3,
-        lnorm_4, lnorm_5, lnorm_6,  lnorm_7,
-        lnorm_8, lnorm_9, lnorm_10, lnorm_11 };
-    // Deltas
-    double *dx   = (double*) malloc(sizeof(double)*n_tgt);
-    double *dy   = (double*) malloc(sizeof(double)*n_tgt);
-    double *dz   = (double*) malloc(sizeof(double)*n_tgt);
-    double *dr   = (double*) malloc(sizeof(double)*n_tgt);
-    double *dr2  = (double*) malloc(sizeof(double)*n_tgt);
-    // Weights, Gnl's, Ylm's
-    double *jw   = (double*) malloc(sizeof(double)*n_tgt);
-    double *jgnl = (double*) malloc(sizeof(double)*n_tgt*dim_nl);
-    double *jgn  = (double*) malloc(sizeof(double)*nmax);
-    double *jhl  = (double*) malloc(sizeof(double)*(lmax+1));
-    double *jylm = (double*) malloc(sizeof(double)*n_tgt*dim_lm);
-    // Qtnlm's
-    double *qitnlm = NULL;
-    if (power) {
-        qitnlm = (double*) malloc(sizeof(double)*dim_itnlm);
-        for (int i=0; i<dim_itnlm; ++i) qitnlm[i] = 0.;
-    }
-    else {
-        qitnlm = xitunkl;
+    int dim_out = (power) ? dim_tunkl : dim_tnlm;
+    vector<double> lnorm;
+    evaluate_lnorm(lmax, lnorm);
+    vector<double> ylm_norm;
+    evaluate_ylm_norm(lmax, ylm_norm);
+
+#ifdef _OPENMP
+    if (n_threads <= 0) n_threads = omp_get_max_threads();
+#endif
+    if (verbose || n_src < 2) n_threads = 1;
+
+    // Neighbour lists, grouped by type
+    vector<vector<int>> src_nbs(n_src);
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+    for (int src_idx=0; src_idx<n_src; ++src_idx) {
+        CellListResult nbs = cell_list.getNeighboursForPosition(
+            spos[3*src_idx], spos[3*src_idx+1], spos[3*src_idx+2]);
+        src_nbs[src_idx] = nbs.indices;
+        stable_sort(src_nbs[src_idx].begin(), src_nbs[src_idx].end(),
+            [&tgt_type_index](int a, int b) { 
+                return tgt_type_index[a] < tgt_type_index[b]; });
+    }
+    py::array_t<int> pair_offsets_py(n_src+1);
+    int *pair_offsets = (int*) pair_offsets_py.request().ptr;
+    int max_nbs = 0;
+    pair_offsets[0] = 0;
+    for (int src_idx=0; src_idx<n_src; ++src_idx) {
+        int n_nbs = src_nbs[src_idx].size();
+        if (n_nbs > max_nbs) max_nbs = n_nbs;
+        pair_offsets[src_idx+1] = pair_offsets[src_idx] + n_nbs;
+    }
+    int n_pairs = pair_offsets[n_src];
+    py::array_t<int> pair_nbs_py(n_pairs);
+    int *pair_nbs = (int*) pair_nbs_py.request().ptr;
+    for (int src_idx=0; src_idx<n_src; ++src_idx) {
+        int p = pair_offsets[src_idx];
+        for (const int &j : src_nbs[src_idx]) pair_nbs[p++] = j;
+    }
+    py::array_t<double> dcoeffs_py(vector<ssize_t>{ n_pairs, 3, dim_out });
+    double *dxitunkl = (double*) dcoeffs_py.request().ptr;
+    for (long i=0; i<(long)n_pairs*3*dim_out; ++i) dxitunkl[i] = 0.;
+    if (verbose) {
+        std::cout << "Gradients: " << n_pairs << " pairs x 3 x " 
+            << dim_out << std::endl;
     }
 
-    // Expansion loop
-    int src_pos_idx = -1;
+    #pragma omp parallel num_threads(n_threads)
+    {
+    // Per-thread scratch
+    double *dx    = (double*) malloc(sizeof(double)*max_nbs);
+    double *dy    = (double*) malloc(sizeof(double)*max_nbs);
+    double *dz    = (double*) malloc(sizeof(double)*max_nbs);
+    double *dr    = (double*) malloc(sizeof(double)*max_nbs);
+    double *dr2   = (double*) malloc(sizeof(double)*max_nbs);
+    double *jw    = (double*) malloc(sizeof(double)*max_nbs);
+    double *jdw   = (double*) malloc(sizeof(double)*max_nbs);
+    double *jgnl  = (double*) malloc(sizeof(double)*max_nbs*dim_nl);
+    double *jdgnl = (double*) malloc(sizeof(double)*max_nbs*dim_nl);
+    double *jgn   = (double*) malloc(sizeof(double)*nmax);
+    double *jdgn  = (double*) malloc(sizeof(double)*nmax);
+    double *jhl   = (double*) malloc(sizeof(double)*(lmax+1));
+    double *jdhl  = (double*) malloc(sizeof(double)*(lmax+1));
+    double *jylm  = (double*) malloc(sizeof(double)*max_nbs*dim_lm);
+    double *jdylm = (double*) malloc(sizeof(double)*max_nbs*3*dim_lm);
+    double *qtnlm = (double*) malloc(sizeof(double)*dim_tnlm);
+    double *dqjnlm = (double*) malloc(sizeof(double)*max_nbs*3*dim_nlm);
+
+    #pragma omp for schedule(dynamic)
     for (int src_idx=0; src_idx<n_src; ++src_idx) {
-        double xi = spos[++src_pos_idx];
-        double yi = spos[++src_pos_idx];
-        double zi = spos[++src_pos_idx];
-        if (verbose) {
-            std::cout << std::endl;
-            std::cout << "Src @ " << xi << " " << yi << " " << zi << std::endl;
-        }
-        CellListResult nbs = cell_list.getNeighboursForPosition(xi, yi, zi);
-        map<int, vector<int>> nb_type_map;
-        for (const int &j : nbs.indices) {
-            int t = tgt_types_list(j);
-            nb_type_map[t].push_back(j);
-        }
+        double xi = spos[3*src_idx];
+        double yi = spos[3*src_idx+1];
+        double zi = spos[3*src_idx+2];
+        const vector<int> &nbs = src_nbs[src_idx];
+        int n_nbs = nbs.size();
+        for (int i=0; i<dim_tnlm; ++i) qtnlm[i] = 0.;
         set<int> nb_type_indices;
-        for (const auto &nbs_of_type : nb_type_map) {
-            int type_index = type_index_map[nbs_of_type.first];
-            int n_nbs_of_type = nbs_of_type.second.size();
+        // Expansion coefficients and their derivatives, type by type
+        int jj0 = 0;
+        while (jj0 < n_nbs) {
+            int type_index = tgt_type_index[nbs[jj0]];
+            int jj1 = jj0;
+            while (jj1 < n_nbs && tgt_type_index[nbs[jj1]] == type_index) ++jj1;
+            int n_nbs_of_type = jj1 - jj0;
+            vector<int> nbs_of_type(nbs.begin()+jj0, nbs.begin()+jj1);
             nb_type_indices.insert(type_index);
-            if (verbose) {
-                std::cout << "Src " << src_idx << " : " << n_nbs_of_type 
-                    << " nbs of type " << type_index << std::endl;
-            }
             evaluate_deltas(xi, yi, zi, tpos, 
-                dx, dy, dz, dr, dr2, 
-                nbs_of_type.second);
-            if (verbose) {
-                for (int j=0; j<n_nbs_of_type; ++j) {
-                    std::cout << "  " << dx[j] << " " << dy[j] << " " << dz[j] 
-                        << " r=" << dr[j] << std::endl;
-                }
-            }
-            // Weight coefficients, Gnl's, Ylm's
-            evaluate_weights(dr, n_nbs_of_type, 
-                r_cut, r_cut_width, jw);
-            evaluate_gnl(dr, dr2, n_nbs_of_type, 
-                gnl_centres, gnl_alphas, nmax, lmax, jgn, jhl, jgnl,
+                dx, dy, dz, dr, dr2, nbs_of_type);
+            evaluate_weights_grad(dr, n_nbs_of_type, 
+                r_cut, r_cut_width, jw, jdw);
+            evaluate_gnl_grad(dr, dr2, n_nbs_of_type, 
+                gnl_centres, gnl_alphas, nmax, lmax, 
+                jgn, jdgn, jhl, jdhl, jgnl, jdgnl,
                 part_sigma, wconstant, wscale, wcentre, ldamp);
-            evaluate_ylm(dx, dy, dz, dr,
-                n_nbs_of_type, lmax, jylm);
-            // Expansion coefficients Qnlm's
-            int offset_idx = src_idx*dim_tnlm + type_index*dim_nlm;
-            if (verbose) {
-                std::cout << "  Store @ " << offset_idx 
-                    << ", length = " << dim_nlm << std::endl;
-            }
+            evaluate_ylm_grad(&ylm_norm[0], dx, dy, dz, dr,
+                n_nbs_of_type, lmax, jylm, jdylm);
             evaluate_qitnlm(jw, jgnl, jylm, n_nbs_of_type, 
-                nmax, lmax, offset_idx, dim_nlm, dim_nl, dim_lm,
-                qitnlm);
+                nmax, lmax, type_index*dim_nlm, dim_nlm, dim_nl, dim_lm,
+                qtnlm);
+            evaluate_dqitnlm(jw, jdw, jgnl, jdgnl, jylm, jdylm,
+                dx, dy, dz, dr, n_nbs_of_type,
+                nmax, lmax, dim_nlm, dim_nl, dim_lm,
+                dqjnlm + 3*jj0*dim_nlm);
+            jj0 = jj1;
+        }
+        // Descriptor and its derivatives for this source
+        if (power) {
+            evaluate_xtunkl(xitunkl, qtnlm, lnorm, 
+                src_idx, nb_type_indices, n_types, nmax, lmax, 
+                dim_tunkl, dim_nkl, dim_nlm, dim_lm);
+        }
+        else {
+            for (int i=0; i<dim_tnlm; ++i) {
+                xitunkl[std::ptrdiff_t(src_idx)*dim_tnlm+i] = qtnlm[i];
+            }
+        }
+        for (int jj=0; jj<n_nbs; ++jj) {
+            int s = tgt_type_index[nbs[jj]];
+            long p = pair_offsets[src_idx] + jj;
+            double *dxtunkl = dxitunkl + p*3*dim_out;
+            double *dqnlm = dqjnlm + 3*jj*dim_nlm;
+            if (power) {
+                evaluate_dxtunkl(dxtunkl, qtnlm, dqnlm, lnorm, 
+                    s, nb_type_indices, n_types, nmax, lmax, 
+                    dim_tunkl, dim_nkl, dim_nlm, dim_lm);
+            }
+            else {
+                for (int d=0; d<3; ++d) {
+                    for (int nlm=0; nlm<dim_nlm; ++nlm) {
+                        dxtunkl[d*dim_tnlm+s*dim_nlm+nlm] = dqnlm[d*dim_nlm+nlm];
+                    }
+                }
+            }
         }
-        // Contractions for this source
-        if (power) evaluate_xtunkl(xitunkl, qitnlm, lnorm, src_idx, nb_type_indices,
-            n_types, nmax, lmax, dim_tunkl, dim_nkl, dim_tnlm, dim_nlm, dim_lm);
-    }
-
-    // Contractions
-    if (verbose) {
-        std::cout << "Contractions per centre: " << dim_tnlm  << " o " << dim_tnlm  
-            << " -> " << dim_tunkl << std::endl;
-        std::cout << "Contractions for system: " << dim_itnlm << " o " << dim_itnlm 
-            << " -> " << dim_itunkl << std::endl;
     }
-    // >>> if (power) {
-    // >>>     evaluate_xtunkl(xitunkl, qitnlm, lnorm,
-    // >>>         n_src, n_types, 
-    // >>>         nmax, lmax, dim_tnlm, dim_nlm, dim_lm);
-    // >>> }
 
     free(dx);
     free(dy);
@@ -391,14 +962,18 @@ void evaluate_gylm(
     free(dr);
     free(dr2);
     free(jw);
+    free(jdw);
     free(jgnl);
+    free(jdgnl);
     free(jgn);
+    free(jdgn);
     free(jhl);
+    free(jdhl);
     free(jylm);
-    if (power) {
-        free(qitnlm);
-    }
-    return;
-}
-
+    free(jdylm);
+    free(qtnlm);
+    free(dqjnlm);
+    } // end omp parallel
 
+    return py::make_tuple(dcoeffs_py, pair_offsets_py, pair_nbs_py);
+}
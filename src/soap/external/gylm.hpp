@@ -2,6 +2,7 @@
 #define GYLM_EXT_HPP 
 
 #include <vector>
+#include <pybind11/pybind11.h>
 #include <pybind11/numpy.h>
 
 namespace py = pybind11;
@@ -15,6 +16,9 @@ void _py_evaluate_xtunkl(
     int nmax,
     int lmax);
 
+// Upper triangle of c = a a^T, a of shape [n x k] with row stride lda
+void evaluate_syrk_upper(const double *a, int n, int k, int lda, double *c);
+
 void evaluate_gylm(
     py::array_t<double> coeffs, 
     py::array_t<double> tgt_pos, 
@@ -36,6 +40,59 @@ void evaluate_gylm(
     double wcentre,
     double ldamp,
     bool power,
-    bool verbose);
+    bool verbose,
+    int sketch_dim,
+    int sketch_seed,
+    int n_threads);
+
+void evaluate_gylm_batch(
+    py::array_t<double> coeffs, 
+    py::array_t<double> src_pos, 
+    py::array_t<int> src_offsets, 
+    py::array_t<double> tgt_pos, 
+    py::array_t<int> tgt_types, 
+    py::array_t<int> tgt_offsets, 
+    py::array_t<double> gnl_centres, 
+    py::array_t<double> gnl_alphas, 
+    py::array_t<int> all_types, 
+    double r_cut, 
+    double r_cut_width, 
+    int n_structs, 
+    int n_types, 
+    int nmax, 
+    int lmax,
+    double part_sigma,
+    bool wconstant,
+    double wscale,
+    double wcentre,
+    double ldamp,
+    bool power,
+    int sketch_dim,
+    int sketch_seed,
+    int n_threads);
+
+py::tuple evaluate_gylm_grad(
+    py::array_t<double> coeffs, 
+    py::array_t<double> src_pos, 
+    py::array_t<double> tgt_pos, 
+    py::array_t<double> gnl_centres, 
+    py::array_t<double> gnl_alphas, 
+    py::array_t<int> tgt_types, 
+    py::array_t<int> all_types, 
+    double r_cut, 
+    double r_cut_width, 
+    int n_src, 
+    int n_tgt, 
+    int n_types, 
+    int nmax, 
+    int lmax,
+    double part_sigma,
+    bool wconstant,
+    double wscale,
+    double wcentre,
+    double ldamp,
+    bool power,
+    bool verbose,
+    int n_threads);
 
 #endif
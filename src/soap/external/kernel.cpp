@@ -8,79 +8,71 @@
 #include <set>
 #include <iostream>
 #include "kernel.hpp"
+#include "soap/linalg/sinkhorn.hpp"
 
-void smooth_match(
+py::tuple smooth_match(
         py::array_t<double> arg_P,
         py::array_t<double> arg_K,
         int nx,
         int ny,
         double gamma,
         double epsilon,
-        bool verbose) {
-
-    double ax = 1./nx;
-    double ay = 1./ny;
-    double lambda = 1./gamma;
+        bool verbose,
+        double gamma_start) {
 
     double *K = (double*) arg_K.request().ptr;
     double *P = (double*) arg_P.request().ptr;
 
-    double* u = (double*) malloc(sizeof(double)*nx);
-    double* u_in = (double*) malloc(sizeof(double)*nx);
-    double* v = (double*) malloc(sizeof(double)*ny);
-    double* v_in = (double*) malloc(sizeof(double)*ny);
-    double* Kg = (double*) malloc(sizeof(double)*nx*ny);
-    for (int i=0; i<nx; ++i) { u[i] = 1.; u_in[i] = 1.; }
-    for (int j=0; j<ny; ++j) { v[j] = 1.; v_in[j] = 1.; }
-    for (int i=0; i<nx; ++i) {
-        for (int j=0; j<ny; ++j) {
-            int ij = i*ny+j;
-            Kg[ij] = exp(-(1.-K[ij])*lambda);
-        }
-    }
-
-    int i_iter = 0;
-    double err = 0.;
-    while (true) {
-        // Update u
-        for (int i=0; i<nx; ++i) {
-            u[i] = 0.;
-            for (int j=0; j<ny; ++j) {
-                u[i] += Kg[i*ny+j]*v[j];
-            }
-        }
-        err = 0.;
-        for (int i=0; i<nx; ++i) err += pow(ax-u[i]*u_in[i], 2);
-        for (int i=0; i<nx; ++i) u[i] = ax/u[i];
-        // Update v
-        for (int j=0; j<ny; ++j) {
-            v[j] = 0.;
-            for (int i=0; i<nx; ++i) {
-                v[j] += Kg[i*ny+j]*u[i];
-            }
-        }
-        for (int j=0; j<ny; ++j) v[j] = ay/v[j];
-        // Converged?
-        if (err < epsilon) break;
-        for (int i=0; i<nx; ++i) u_in[i] = u[i];
-        for (int j=0; j<ny; ++j) v_in[j] = v[j];
-        i_iter += 1;
-    }
+    soap::linalg::SinkhornOptions options;
+    options.gamma = gamma;
+    options.tol = epsilon;
+    options.gamma_start = gamma_start;
+    soap::linalg::SinkhornSolver solver(options);
+    soap::linalg::SinkhornInfo info = solver.solve(K, nx, ny, P);
     if (verbose)
-        std::cout << "Converged " << nx << "x" << ny << " in " 
-            << i_iter << " iterations" << std::endl;
+        std::cout << (info.converged ? "Converged " : "Not converged ")
+            << nx << "x" << ny << " in " << info.n_iter << " iterations"
+            << " (err=" << info.err << ")" << std::endl;
+
+    return py::make_tuple(info.converged, info.n_iter, info.err);
+}
 
-    for (int i=0; i<nx; ++i) {
-        for (int j=0; j<ny; ++j) {
-            int ij = i*ny+j;
-            P[ij] = u[i]*Kg[ij]*v[j];
-        }
+py::tuple smooth_match_batch(
+        std::vector<py::array_t<double> > arg_P,
+        std::vector<py::array_t<double> > arg_K,
+        double gamma,
+        double epsilon,
+        int n_threads,
+        double gamma_start) {
+
+    int n_problems = arg_K.size();
+    std::vector<const double*> K(n_problems);
+    std::vector<double*> P(n_problems);
+    std::vector<int> nx(n_problems);
+    std::vector<int> ny(n_problems);
+    for (int b=0; b<n_problems; ++b) {
+        py::buffer_info K_info = arg_K[b].request();
+        K[b] = (const double*) K_info.ptr;
+        P[b] = (double*) arg_P[b].request().ptr;
+        nx[b] = K_info.shape[0];
+        ny[b] = K_info.shape[1];
     }
 
-    free(u);
-    free(u_in);
-    free(v);
-    free(v_in);
-    free(Kg);
-}
+    soap::linalg::SinkhornOptions options;
+    options.gamma = gamma;
+    options.tol = epsilon;
+    options.gamma_start = gamma_start;
+    std::vector<soap::linalg::SinkhornInfo> info(n_problems);
+    if (n_problems > 0) soap::linalg::sinkhorn_batch(n_problems, &K[0],
+        &nx[0], &ny[0], &P[0], options, &info[0], n_threads);
 
+    std::vector<bool> converged(n_problems);
+    std::vector<int> n_iter(n_problems);
+    std::vector<double> err(n_problems);
+    for (int b=0; b<n_problems; ++b) {
+        converged[b] = info[b].converged;
+        n_iter[b] = info[b].n_iter;
+        err[b] = info[b].err;
+    }
+    return py::make_tuple(converged, n_iter, err);
+}
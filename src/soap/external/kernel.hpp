@@ -7,13 +7,22 @@
 namespace py = pybind11;
 using namespace std;
 
-void smooth_match(
+py::tuple smooth_match(
     py::array_t<double> P,
     py::array_t<double> K,
     int nx,
     int ny,
     double gamma,
     double epsilon,
-    bool verbose);
+    bool verbose,
+    double gamma_start);
+
+py::tuple smooth_match_batch(
+    std::vector<py::array_t<double> > P,
+    std::vector<py::array_t<double> > K,
+    double gamma,
+    double epsilon,
+    int n_threads,
+    double gamma_start);
 
 #endif
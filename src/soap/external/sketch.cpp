@@ -0,0 +1,151 @@
+#include <math.h>
+#include <random>
+#include <complex>
+#include "sketch.hpp"
+#include "gylm.hpp"
+
+// Relative cost of the FFT route per d log2(d) in units of Gram matrix 
+// entries (measured, gcc -O2, no BLAS): The Gram route is used up to 
+// dim_g^2 = sketch_fft_cost*d*log2(d).
+constexpr double sketch_fft_cost = 4.;
+
+typedef complex<double> cdouble;
+
+// Complex product without the inf/nan recovery of operator*
+static inline cdouble cmul(const cdouble &a, const cdouble &b) {
+    return cdouble(
+        a.real()*b.real() - a.imag()*b.imag(),
+        a.real()*b.imag() + a.imag()*b.real());
+}
+
+void evaluate_sketch_hashes(int dim_a, int sketch_dim, int seed,
+        vector<int> &h, vector<double> &s) {
+    // NOTE The engine (rather than a distribution) is used directly,
+    // as its output sequence is fixed by the standard
+    std::mt19937 engine(seed);
+    h.resize(2*dim_a);
+    s.resize(2*dim_a);
+    for (int a=0; a<2*dim_a; ++a) h[a] = engine() % sketch_dim;
+    for (int a=0; a<2*dim_a; ++a) s[a] = (engine() >> 31) ? +1. : -1.;
+}
+
+// In-place radix-2 FFT, x[k] <- sum_j x[j] exp(-2 pi i jk/n), with
+// twiddles tw[k] = exp(-2 pi i k/n), k < n/2
+static void evaluate_fft(cdouble *x, int n, const cdouble *tw) {
+    for (int i=1, j=0; i<n; ++i) {
+        int bit = n >> 1;
+        for ( ; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) std::swap(x[i], x[j]);
+    }
+    for (int len=2; len<=n; len <<= 1) {
+        int half = len >> 1;
+        int step = n/len;
+        for (int i=0; i<n; i+=len) {
+            for (int j=0; j<half; ++j) {
+                cdouble u = x[i+j];
+                cdouble v = cmul(x[i+j+half], tw[j*step]);
+                x[i+j] = u + v;
+                x[i+j+half] = u - v;
+            }
+        }
+    }
+}
+
+void evaluate_xsketch(double *xsk, double *qtnlm, vector<double> &lnorm,
+        set<int> &nb_type_indices, int n_types, int nmax, int lmax, int sketch_dim,
+        const int *h, const double *s, int dim_nlm, int dim_lm) {
+    int n_present = nb_type_indices.size();
+    if (n_present == 0) return;
+    int d = sketch_dim;
+    int dim_a = n_types*nmax;
+    int dim_g = n_present*nmax;
+    vector<int> types(nb_type_indices.begin(), nb_type_indices.end());
+    // Two equivalent routes, per l:
+    // (a) Gram matrix G = Q_l Q_l^T of the present types (DSYRK), of
+    //     which every entry G_ab is added to bin h1_a + h2_b (mod d),
+    //     O(dim_g^2 (2l+1)/2) + O(dim_g^2);
+    // (b) FFT convolution of the count sketches, summed over m in the 
+    //     frequency domain, O((2l+1) d log d). The two (real) count 
+    //     sketches of q_lm are packed into one complex vector 
+    //     z = c1 + i*c2, such that a single FFT per m suffices:
+    //     With Z = FFT(z) and Z*(k) = conj(Z(-k)), 
+    //     FFT(c1).FFT(c2) = (Z^2 - Z*^2)/4i.
+    int log2d = 0;
+    while ((1 << log2d) < d) ++log2d;
+    bool use_fft = dim_g*dim_g > sketch_fft_cost*d*log2d;
+    // Per-thread scratch, reused across sources
+    static thread_local vector<cdouble> tw;
+    static thread_local vector<cdouble> zbuffer;
+    static thread_local vector<cdouble> fbuffer;
+    static thread_local vector<double> qbuffer;
+    static thread_local vector<double> gbuffer;
+    if (!use_fft) {
+        // Gather the rows of the present types
+        if (qbuffer.size() < size_t(n_present*dim_nlm)) qbuffer.resize(n_present*dim_nlm);
+        if (gbuffer.size() < size_t(dim_g*dim_g)) gbuffer.resize(dim_g*dim_g);
+        double *q = &qbuffer[0];
+        double *g = &gbuffer[0];
+        for (int tt=0; tt<n_present; ++tt) {
+            double *qt = qtnlm + types[tt]*dim_nlm;
+            for (int nlm=0; nlm<dim_nlm; ++nlm) q[tt*dim_nlm+nlm] = qt[nlm];
+        }
+        vector<int> a_of_row(dim_g);
+        for (int tt=0; tt<n_present; ++tt)
+            for (int n=0; n<nmax; ++n) a_of_row[tt*nmax+n] = types[tt]*nmax+n;
+        for (int l=0; l<lmax+1; ++l) {
+            double *xl = xsk + l*d;
+            evaluate_syrk_upper(q + l*l, dim_g, 2*l+1, dim_lm, g);
+            for (int k=0; k<d; ++k) xl[k] = 0.;
+            for (int r=0; r<dim_g; ++r) {
+                int a = a_of_row[r];
+                int h1a = h[a], h2a = h[a+dim_a];
+                double s1a = s[a], s2a = s[a+dim_a];
+                xl[(h1a + h2a) & (d-1)] += s1a*s2a*g[r*dim_g+r];
+                for (int c=r+1; c<dim_g; ++c) {
+                    int b = a_of_row[c];
+                    double gab = g[r*dim_g+c];
+                    xl[(h1a + h[b+dim_a]) & (d-1)] += s1a*s[b+dim_a]*gab;
+                    xl[(h[b] + h2a) & (d-1)] += s[b]*s2a*gab;
+                }
+            }
+            for (int k=0; k<d; ++k) xl[k] *= lnorm[l];
+        }
+        return;
+    }
+    if (int(tw.size()) != d/2) {
+        tw.resize(d/2);
+        for (int k=0; k<d/2; ++k) tw[k] = std::polar(1., -2.*M_PI*k/d);
+    }
+    if (int(zbuffer.size()) < d) zbuffer.resize(d);
+    if (int(fbuffer.size()) < d) fbuffer.resize(d);
+    cdouble *z = &zbuffer[0];
+    cdouble *f = &fbuffer[0];
+    for (int l=0; l<lmax+1; ++l) {
+        double *xl = xsk + l*d;
+        for (int k=0; k<d; ++k) f[k] = 0.;
+        for (int lm=l*l; lm<(l+1)*(l+1); ++lm) {
+            for (int k=0; k<d; ++k) z[k] = 0.;
+            for (const int &t : types) {
+                for (int n=0; n<nmax; ++n) {
+                    int a = t*nmax + n;
+                    double q = qtnlm[t*dim_nlm + n*dim_lm + lm];
+                    z[h[a]] += cdouble(s[a]*q, 0.);
+                    z[h[a+dim_a]] += cdouble(0., s[a+dim_a]*q);
+                }
+            }
+            evaluate_fft(z, d, &tw[0]);
+            for (int k=0; k<d; ++k) {
+                cdouble zk = z[k];
+                cdouble zmk = std::conj(z[(d-k) & (d-1)]);
+                cdouble p = cmul(zk, zk) - cmul(zmk, zmk);
+                // += p/4i
+                f[k] += cdouble(0.25*p.imag(), -0.25*p.real());
+            }
+        }
+        // Inverse transform: IFFT(f) = conj(FFT(conj(f)))/d, real here
+        for (int k=0; k<d; ++k) f[k] = std::conj(f[k]);
+        evaluate_fft(f, d, &tw[0]);
+        for (int k=0; k<d; ++k) xl[k] = lnorm[l]*f[k].real()/d;
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef SKETCH_EXT_HPP
+#define SKETCH_EXT_HPP
+
+#include <vector>
+#include <set>
+
+using namespace std;
+
+// Tensor sketch (Pham & Pagh, 2013) of the GYLM power spectrum: For each l,
+// the sum over m of the outer products q_lm x q_lm of the coefficient
+// vectors q_lm (indexed by a = t*nmax+n) is mapped onto sketch_dim features
+// via two count sketches (h1,s1), (h2,s2), combined either by scattering
+// the entries of the Gram matrices or by FFT, whichever is cheaper.
+// Dot products of sketches are unbiased estimates of the dot products of
+// the full (t,u,n,k,l) power spectra (with both orderings of t != u), with
+// a variance that decreases as 1/sketch_dim. sketch_dim must be a power of 2.
+
+// Count-sketch hashes, drawn reproducibly from seed: h[0:dim_a] and
+// s[0:dim_a] belong to the first, h[dim_a:2*dim_a], s[dim_a:2*dim_a]
+// to the second count sketch
+void evaluate_sketch_hashes(int dim_a, int sketch_dim, int seed,
+    vector<int> &h, vector<double> &s);
+
+// Sketch of one source: xsk[l*sketch_dim+k], only the types in
+// nb_type_indices are visited (the others are zero)
+void evaluate_xsketch(double *xsk, double *qtnlm, vector<double> &lnorm,
+    set<int> &nb_type_indices, int n_types, int nmax, int lmax, int sketch_dim,
+    const int *h, const double *s, int dim_nlm, int dim_lm);
+
+#endif
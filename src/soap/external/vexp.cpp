@@ -0,0 +1,179 @@
+#include <math.h>
+#include <string.h>
+#include "vexp.hpp"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SOAPXX_VEXP_X86
+#include <immintrin.h>
+#endif
+
+// Unfortunately icc forbids use of math functions in constexpr
+constexpr double exp_log2e   = +1.44269504088896338700e+00; // constexpr double exp_log2e = 1./log(2.);
+constexpr double exp_ln2_hi  = +6.93147180369123816490e-01; // upper bits of log(2.), n*exp_ln2_hi exact for |n| < 2^11
+constexpr double exp_ln2_lo  = +1.90821492927058770002e-10; // constexpr double exp_ln2_lo = log(2.) - exp_ln2_hi;
+constexpr double exp_arg_max = +7.09782712893383973096e+02; // constexpr double exp_arg_max = log(DBL_MAX);
+constexpr double exp_arg_min = -7.45133219101941108420e+02; // constexpr double exp_arg_min = log(DBL_TRUE_MIN/2);
+constexpr double exp_c2      = +5.00000000000000000000e-01; // 1/2!
+constexpr double exp_c3      = +1.66666666666666666667e-01; // 1/3!
+constexpr double exp_c4      = +4.16666666666666666667e-02; // 1/4!
+constexpr double exp_c5      = +8.33333333333333333333e-03; // 1/5!
+constexpr double exp_c6      = +1.38888888888888888889e-03; // 1/6!
+constexpr double exp_c7      = +1.98412698412698412698e-04; // 1/7!
+constexpr double exp_c8      = +2.48015873015873015873e-05; // 1/8!
+constexpr double exp_c9      = +2.75573192239858906526e-06; // 1/9!
+constexpr double exp_c10     = +2.75573192239858906526e-07; // 1/10!
+constexpr double exp_c11     = +2.50521083854417187751e-08; // 1/11!
+constexpr double exp_c12     = +2.08767569878680989792e-09; // 1/12!
+constexpr double exp_c13     = +1.60590438368216145994e-10; // 1/13!
+
+int _py_exp_batch(
+        py::array_t<double> x_py, 
+        py::array_t<double> y_py, 
+        int n, 
+        int isa) {
+    double *x = (double*) x_py.request().ptr;
+    double *y = (double*) y_py.request().ptr;
+    return evaluate_exp_batch(x, y, n, isa);
+}
+
+int exp_batch_isa() {
+    static const int isa = []() {
+#ifdef SOAPXX_VEXP_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return (int)EXP_BATCH_AVX512;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) 
+            return (int)EXP_BATCH_AVX2;
+#endif
+        return (int)EXP_BATCH_SCALAR;
+    }();
+    return isa;
+}
+
+static void exp_batch_scalar(const double *x, double *y, int n) {
+    for (int i=0; i<n; ++i) y[i] = exp(x[i]);
+}
+
+#ifdef SOAPXX_VEXP_X86
+__attribute__((target("avx2,fma")))
+static inline __m256d exp_avx2_kernel(__m256d x) {
+    // exp(x) = 2^k exp(r), k = round(x/log(2)), |r| <= log(2)/2. The 
+    // scaling by 2^k is split into 2^k1 2^k2 such that both factors are
+    // normal numbers over the full range, including gradual underflow.
+    const __m256d xc = _mm256_min_pd(_mm256_max_pd(x, 
+        _mm256_set1_pd(exp_arg_min)), _mm256_set1_pd(exp_arg_max));
+    const __m256d k = _mm256_round_pd(_mm256_mul_pd(xc, _mm256_set1_pd(exp_log2e)), 
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d r = _mm256_fnmadd_pd(k, _mm256_set1_pd(exp_ln2_hi), xc);
+    r = _mm256_fnmadd_pd(k, _mm256_set1_pd(exp_ln2_lo), r);
+    __m256d p = _mm256_set1_pd(exp_c13);
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_c12));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_c11));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_c10));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_c9));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_c8));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_c7));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_c6));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_c5));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_c4));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_c3));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_c2));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.));
+    // 2^k via the exponent bits: For |v| < 2^51, the low bits of 
+    // v + 1.5*2^52 hold v, such that ((v + 1023) << 52) is 2^v.
+    const __m256d magic = _mm256_set1_pd(6755399441055744.0 + 1023.);
+    const __m256d k1 = _mm256_floor_pd(_mm256_mul_pd(k, _mm256_set1_pd(0.5)));
+    const __m256d k2 = _mm256_sub_pd(k, k1);
+    const __m256d s1 = _mm256_castsi256_pd(_mm256_slli_epi64(
+        _mm256_castpd_si256(_mm256_add_pd(k1, magic)), 52));
+    const __m256d s2 = _mm256_castsi256_pd(_mm256_slli_epi64(
+        _mm256_castpd_si256(_mm256_add_pd(k2, magic)), 52));
+    __m256d y = _mm256_mul_pd(_mm256_mul_pd(p, s1), s2);
+    // Overflow, underflow and NaN
+    y = _mm256_blendv_pd(y, _mm256_set1_pd(HUGE_VAL), 
+        _mm256_cmp_pd(x, _mm256_set1_pd(exp_arg_max), _CMP_GT_OQ));
+    y = _mm256_blendv_pd(y, _mm256_setzero_pd(), 
+        _mm256_cmp_pd(x, _mm256_set1_pd(exp_arg_min), _CMP_LT_OQ));
+    y = _mm256_blendv_pd(y, x, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+    return y;
+}
+
+__attribute__((target("avx2,fma")))
+static void exp_batch_avx2(const double *x, double *y, int n) {
+    int i = 0;
+    for ( ; i+4<=n; i+=4) {
+        _mm256_storeu_pd(y+i, exp_avx2_kernel(_mm256_loadu_pd(x+i)));
+    }
+    if (i < n) {
+        double xt[4] = { 0., 0., 0., 0. };
+        double yt[4];
+        memcpy(xt, x+i, sizeof(double)*(n-i));
+        _mm256_storeu_pd(yt, exp_avx2_kernel(_mm256_loadu_pd(xt)));
+        memcpy(y+i, yt, sizeof(double)*(n-i));
+    }
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d exp_avx512_kernel(__m512d x) {
+    // As exp_avx2_kernel, with the scaling by 2^k via vscalefpd, which 
+    // also takes care of overflow and gradual underflow
+    const __m512d xc = _mm512_min_pd(_mm512_max_pd(x, 
+        _mm512_set1_pd(exp_arg_min)), _mm512_set1_pd(exp_arg_max));
+    const __m512d k = _mm512_roundscale_pd(_mm512_mul_pd(xc, _mm512_set1_pd(exp_log2e)), 
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512d r = _mm512_fnmadd_pd(k, _mm512_set1_pd(exp_ln2_hi), xc);
+    r = _mm512_fnmadd_pd(k, _mm512_set1_pd(exp_ln2_lo), r);
+    __m512d p = _mm512_set1_pd(exp_c13);
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_c12));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_c11));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_c10));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_c9));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_c8));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_c7));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_c6));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_c5));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_c4));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_c3));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_c2));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.));
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.));
+    __m512d y = _mm512_scalef_pd(p, k);
+    // Overflow, underflow and NaN
+    y = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, 
+        _mm512_set1_pd(exp_arg_max), _CMP_GT_OQ), y, _mm512_set1_pd(HUGE_VAL));
+    y = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, 
+        _mm512_set1_pd(exp_arg_min), _CMP_LT_OQ), y, _mm512_setzero_pd());
+    y = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, x, _CMP_UNORD_Q), y, x);
+    return y;
+}
+
+__attribute__((target("avx512f")))
+static void exp_batch_avx512(const double *x, double *y, int n) {
+    int i = 0;
+    for ( ; i+8<=n; i+=8) {
+        _mm512_storeu_pd(y+i, exp_avx512_kernel(_mm512_loadu_pd(x+i)));
+    }
+    if (i < n) {
+        __mmask8 mask = (__mmask8)((1u << (n-i)) - 1u);
+        __m512d xt = _mm512_maskz_loadu_pd(mask, x+i);
+        _mm512_mask_storeu_pd(y+i, mask, exp_avx512_kernel(xt));
+    }
+}
+#endif
+
+int evaluate_exp_batch(const double *x, double *y, int n, int isa) {
+    int host = exp_batch_isa();
+    if (isa < 0 || isa > host) isa = host;
+#ifdef SOAPXX_VEXP_X86
+    if (isa == EXP_BATCH_AVX512) {
+        exp_batch_avx512(x, y, n);
+        return isa;
+    }
+    if (isa == EXP_BATCH_AVX2) {
+        exp_batch_avx2(x, y, n);
+        return isa;
+    }
+#endif
+    exp_batch_scalar(x, y, n);
+    return EXP_BATCH_SCALAR;
+}
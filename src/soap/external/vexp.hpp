@@ -0,0 +1,32 @@
+#ifndef VEXP_EXT_HPP 
+#define VEXP_EXT_HPP 
+
+#include <pybind11/numpy.h>
+
+namespace py = pybind11;
+using namespace std;
+
+// Instruction sets of the batch exponential
+enum {
+    EXP_BATCH_SCALAR = 0,
+    EXP_BATCH_AVX2   = 1,
+    EXP_BATCH_AVX512 = 2
+};
+
+int _py_exp_batch(
+        py::array_t<double> x, 
+        py::array_t<double> y, 
+        int n, 
+        int isa);
+
+// Most capable instruction set supported by the host (runtime dispatch)
+int exp_batch_isa();
+
+// y[i] = exp(x[i]), i = 0 ... n-1. The vectorised paths use Cody-Waite
+// range reduction with a degree-13 polynomial, the relative error is
+// below 1e-14 (tested against std::exp) for results in the normal range.
+// isa < 0 selects the most capable instruction set of the host, otherwise
+// the least capable of (isa, host). Returns the instruction set used.
+int evaluate_exp_batch(const double *x, double *y, int n, int isa=-1);
+
+#endif
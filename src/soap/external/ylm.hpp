@@ -15,7 +15,179 @@ void _py_ylm(
         int lmax, 
         py::array_t<double> py_ylm_out);
 
-void evaluate_ylm(double *x, double *y, double *z, double *r,
+void evaluate_ylm(const double *norm, 
+    double *x, double *y, double *z, double *r,
     int n_pts, int lmax, double *ylm_out);
 
+void evaluate_ylm_norm(int lmax, vector<double> &norm);
+
+void evaluate_ylm_grad(const double *norm, 
+    double *x, double *y, double *z, double *r,
+    int n_pts, int lmax, double *ylm_out, double *dylm_out);
+
+void evaluate_rlm(const double *norm, 
+    const double *x, const double *y, const double *z, const double *r2,
+    int n_pts, int lmax, double *rlm, int stride);
+
+void evaluate_rlm_grad(const double *norm, 
+    const double *x, const double *y, const double *z, const double *r2,
+    int n_pts, int lmax, double *rlm, double *drlm, int stride);
+
+/**
+ * Real solid harmonics R_lm(r) = |r|^l Y_lm(r/|r|) for a batch of points,
+ * evaluated via the recursion of the associated Legendre polynomials
+ *   Q_m^m     = (2m-1)!!
+ *   Q_(m+1)^m = (2m+1) z Q_m^m
+ *   Q_l^m     = ((2l-1) z Q_(l-1)^m - (l+m-1) r^2 Q_(l-2)^m)/(l-m)
+ * and the azimuthal factors C_m + i S_m = (x + iy)^m:
+ *   R_l0 = K_l0 Q_l^0, R_l(+m) = K_lm Q_l^m C_m, R_l(-m) = K_lm Q_l^m S_m
+ * with K_lm from evaluate_ylm_norm. Output layout: rlm[(l*l+l+m)*stride + pt].
+ * LMAX < 0 selects the runtime lmax (see evaluate_rlm for the dispatch).
+ */
+template<int LMAX>
+inline void evaluate_qlm_t(
+        const double *x, const double *y, const double *z, const double *r2,
+        int n_pts, double *qlm, int stride, double *cm, double *sm, 
+        int lmax_rt=LMAX) {
+    // The recursion runs over (l,m) with the points in the innermost
+    // loop, such that the latter vectorises. Q_l^m is stored in the 
+    // rows l*l+l+m (m >= 0) of qlm, C_m and S_m in the rows m of cm, sm.
+    const int lmax = (LMAX < 0) ? lmax_rt : LMAX;
+    #pragma omp simd
+    for (int pt=0; pt<n_pts; ++pt) {
+        cm[pt] = 1.;
+        sm[pt] = 0.;
+    }
+    for (int m=1; m<lmax+1; ++m) {
+        const double *c0 = cm + (m-1)*n_pts;
+        const double *s0 = sm + (m-1)*n_pts;
+        double *c1 = cm + m*n_pts;
+        double *s1 = sm + m*n_pts;
+        #pragma omp simd
+        for (int pt=0; pt<n_pts; ++pt) {
+            c1[pt] = x[pt]*c0[pt] - y[pt]*s0[pt];
+            s1[pt] = x[pt]*s0[pt] + y[pt]*c0[pt];
+        }
+    }
+    double qmm = 1.;
+    for (int m=0; m<lmax+1; ++m) {
+        // Q_m^m, Q_(m+1)^m
+        if (m > 0) qmm *= (2*m-1);
+        double *qm = qlm + (m*m+2*m)*stride;
+        #pragma omp simd
+        for (int pt=0; pt<n_pts; ++pt) qm[pt] = qmm;
+        if (m < lmax) {
+            double *qm1 = qlm + ((m+1)*(m+1)+m+1+m)*stride;
+            double a = 2*m+1;
+            #pragma omp simd
+            for (int pt=0; pt<n_pts; ++pt) qm1[pt] = a*z[pt]*qmm;
+        }
+        // Q_l^m, l > m+1
+        for (int l=m+2; l<lmax+1; ++l) {
+            const double *q1 = qlm + ((l-1)*(l-1)+l-1+m)*stride;
+            const double *q2 = qlm + ((l-2)*(l-2)+l-2+m)*stride;
+            double *q0 = qlm + (l*l+l+m)*stride;
+            double a = (2*l-1)/double(l-m);
+            double b = (l+m-1)/double(l-m);
+            #pragma omp simd
+            for (int pt=0; pt<n_pts; ++pt) {
+                q0[pt] = a*z[pt]*q1[pt] - b*r2[pt]*q2[pt];
+            }
+        }
+    }
+}
+
+template<int LMAX>
+inline void evaluate_rlm_t(const double *norm, 
+        const double *x, const double *y, const double *z, const double *r2,
+        int n_pts, double *rlm, int stride, int lmax_rt=LMAX) {
+    // Q_l^m is accumulated in the output rows of +m
+    const int lmax = (LMAX < 0) ? lmax_rt : LMAX;
+    // Scratch is kept per thread and reused across calls
+    static thread_local vector<double> buffer;
+    if (buffer.size() < size_t(2*(lmax+1)*n_pts)) buffer.resize(2*(lmax+1)*n_pts);
+    double *cm = &buffer[0];
+    double *sm = cm + (lmax+1)*n_pts;
+    evaluate_qlm_t<LMAX>(x, y, z, r2, n_pts, rlm, stride, cm, sm, lmax);
+    // Normalisation and azimuthal factors
+    for (int l=0; l<lmax+1; ++l) {
+        int l0 = l*l+l;
+        double *q0 = rlm + l0*stride;
+        double k0 = norm[l0];
+        #pragma omp simd
+        for (int pt=0; pt<n_pts; ++pt) q0[pt] *= k0;
+        for (int m=1; m<l+1; ++m) {
+            double *qp = rlm + (l0+m)*stride;
+            double *qn = rlm + (l0-m)*stride;
+            const double *c = cm + m*n_pts;
+            const double *s = sm + m*n_pts;
+            double k = norm[l0+m];
+            #pragma omp simd
+            for (int pt=0; pt<n_pts; ++pt) {
+                double q = k*qp[pt];
+                qp[pt] = q*c[pt];
+                qn[pt] = q*s[pt];
+            }
+        }
+    }
+}
+
+/**
+ * Solid harmonics as in evaluate_rlm_t together with their gradients,
+ *   dQ_l^m/dx = -x Q_(l-1)^(m+1),
+ *   dQ_l^m/dy = -y Q_(l-1)^(m+1),
+ *   dQ_l^m/dz = (l+m) Q_(l-1)^m,
+ *   dC_m/dx = m C_(m-1), dC_m/dy = -m S_(m-1),
+ *   dS_m/dx = m S_(m-1), dS_m/dy = +m C_(m-1).
+ * Output layout: drlm[((xyz)*(lmax+1)^2 + l*l+l+m)*stride + pt].
+ */
+template<int LMAX>
+inline void evaluate_rlm_grad_t(const double *norm, 
+        const double *x, const double *y, const double *z, const double *r2,
+        int n_pts, double *rlm, double *drlm, int stride, int lmax_rt=LMAX) {
+    const int lmax = (LMAX < 0) ? lmax_rt : LMAX;
+    const int dim = (lmax+1)*(lmax+1);
+    static thread_local vector<double> buffer;
+    if (buffer.size() < size_t((2*(lmax+1)+dim)*n_pts)) buffer.resize((2*(lmax+1)+dim)*n_pts);
+    double *cm = &buffer[0];
+    double *sm = cm + (lmax+1)*n_pts;
+    double *qlm = sm + (lmax+1)*n_pts;
+    evaluate_qlm_t<LMAX>(x, y, z, r2, n_pts, qlm, n_pts, cm, sm, lmax);
+    double *drx = drlm;
+    double *dry = drlm + dim*stride;
+    double *drz = drlm + 2*dim*stride;
+    for (int l=0; l<lmax+1; ++l) {
+        int l0 = l*l+l;
+        int l1 = l*l-l; // (l-1)^2+(l-1)
+        for (int m=0; m<l+1; ++m) {
+            const double *q = qlm + (l0+m)*n_pts;
+            const double *qx = (m+1 < l) ? qlm + (l1+m+1)*n_pts : NULL;
+            const double *qz = (m < l) ? qlm + (l1+m)*n_pts : NULL;
+            const double *c = cm + m*n_pts;
+            const double *s = sm + m*n_pts;
+            const double *c1 = cm + ((m > 0) ? m-1 : 0)*n_pts;
+            const double *s1 = sm + ((m > 0) ? m-1 : 0)*n_pts;
+            double k = norm[l0+m];
+            double lm = l+m;
+            int ip = (l0+m)*stride;
+            int in = (l0-m)*stride;
+            #pragma omp simd
+            for (int pt=0; pt<n_pts; ++pt) {
+                double kq = k*q[pt];
+                double kqx = (qx) ? -k*qx[pt] : 0.;
+                double kqz = (qz) ? lm*k*qz[pt] : 0.;
+                rlm[ip+pt] = kq*c[pt];
+                drx[ip+pt] = kqx*x[pt]*c[pt] + kq*m*c1[pt];
+                dry[ip+pt] = kqx*y[pt]*c[pt] - kq*m*s1[pt];
+                drz[ip+pt] = kqz*c[pt];
+                if (m == 0) continue;
+                rlm[in+pt] = kq*s[pt];
+                drx[in+pt] = kqx*x[pt]*s[pt] + kq*m*s1[pt];
+                dry[in+pt] = kqx*y[pt]*s[pt] + kq*m*c1[pt];
+                drz[in+pt] = kqz*s[pt];
+            }
+        }
+    }
+}
+
 #endif
@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <queue>
+#include <random>
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/archive/binary_iarchive.hpp>
+#include <fstream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "soap/hnsw.hpp"
+#include "soap/linalg/numpy.hpp"
+
+namespace soap {
+
+HnswIndex::HnswIndex() : metric("cosine"), M(16), M0(32), ef_construction(200),
+        ef_search(50), seed(0), n_items(0), entry_point(-1), max_level(-1) {
+    item_rows.push_back(0);
+    offsets.push_back(0);
+}
+
+HnswIndex::HnswIndex(std::string metric_arg, int M_arg, int ef_construction_arg,
+        int seed_arg) : metric(metric_arg), M(std::max(2, M_arg)), M0(2*M),
+        ef_construction(std::max(1, ef_construction_arg)), ef_search(50),
+        seed(seed_arg), n_items(0), entry_point(-1), max_level(-1) {
+    if (metric != "cosine" && metric != "dot")
+        throw soap::base::APIError("Unknown metric '" + metric + "'");
+    item_rows.push_back(0);
+    offsets.push_back(0);
+}
+
+HnswIndex::HnswIndex(std::string archfile) : HnswIndex() {
+    this->load(archfile);
+}
+
+void HnswIndex::flatten(DMap *dmap, query_t &q) {
+    q.codes.clear();
+    q.offsets.assign(1, 0);
+    q.values.clear();
+    std::vector<DMap::dtype_t> buffer;
+    for (int s=0; s<dmap->size(); ++s) {
+        const DMap::dtype_t *v = dmap->channelValues(s, buffer);
+        q.codes.push_back(dmap->code(s));
+        q.values.insert(q.values.end(), v, v+dmap->channelSize(s));
+        q.offsets.push_back(q.values.size());
+    }
+    if (metric == "cosine") {
+        double norm = 0.0;
+        for (double v : q.values) norm += v*v;
+        norm = std::sqrt(norm);
+        if (norm > 0.0) for (double &v : q.values) v /= norm;
+    }
+}
+
+double HnswIndex::distance(const query_t &q, int j) {
+    // Merge over the (sorted) channel codes as in DMap::dot
+    int a = 0;
+    int a_end = q.codes.size();
+    int b = item_rows[j];
+    int b_end = item_rows[j+1];
+    dtype_t res = 0.0;
+    while (a < a_end && b < b_end) {
+        if (q.codes[a] < codes[b]) ++a;
+        else if (codes[b] < q.codes[a]) ++b;
+        else {
+            const dtype_t *x = &q.values[q.offsets[a]];
+            const dtype_t *y = &values[offsets[b]];
+            int n = q.offsets[a+1] - q.offsets[a];
+            for (int k=0; k<n; ++k) res += x[k]*y[k];
+            ++a;
+            ++b;
+        }
+    }
+    return (metric == "cosine") ? 1.0 - res : -res;
+}
+
+double HnswIndex::distance(int i, int j) {
+    int a = item_rows[i];
+    int a_end = item_rows[i+1];
+    int b = item_rows[j];
+    int b_end = item_rows[j+1];
+    dtype_t res = 0.0;
+    while (a < a_end && b < b_end) {
+        if (codes[a] < codes[b]) ++a;
+        else if (codes[b] < codes[a]) ++b;
+        else {
+            const dtype_t *x = &values[offsets[a]];
+            const dtype_t *y = &values[offsets[b]];
+            int n = offsets[a+1] - offsets[a];
+            for (int k=0; k<n; ++k) res += x[k]*y[k];
+            ++a;
+            ++b;
+        }
+    }
+    return (metric == "cosine") ? 1.0 - res : -res;
+}
+
+double HnswIndex::similarity(int i, int j) {
+    double d = this->distance(i, j);
+    return (metric == "cosine") ? 1.0 - d : -d;
+}
+
+int HnswIndex::randomLevel() {
+    // Level ~ floor(-ln(u)/ln(M)), reproducible from seed and item id
+    std::mt19937 engine(seed + n_items);
+    double u = (double(engine()) + 0.5)/4294967296.0;
+    return int(-std::log(u)/std::log(double(M)));
+}
+
+void HnswIndex::searchLayer(const query_t &q, dist_id_t entry, int ef, int layer,
+        std::vector<dist_id_t> &output) {
+    // Visited marks with per-thread generation tags, such that the marks
+    // need not be reset between searches
+    static thread_local std::vector<unsigned int> visited;
+    static thread_local unsigned int tag = 0;
+    if (visited.size() < size_t(n_items)) visited.resize(n_items, 0);
+    tag += 1;
+    if (tag == 0) {
+        std::fill(visited.begin(), visited.end(), 0);
+        tag = 1;
+    }
+    std::priority_queue<dist_id_t, std::vector<dist_id_t>, std::greater<dist_id_t> > candidates;
+    std::priority_queue<dist_id_t> results;
+    candidates.push(entry);
+    results.push(entry);
+    visited[entry.second] = tag;
+    while (!candidates.empty()) {
+        dist_id_t c = candidates.top();
+        if (c.first > results.top().first && int(results.size()) >= ef) break;
+        candidates.pop();
+        const std::vector<int> &nbs = links[c.second][layer];
+        for (int e : nbs) {
+            if (visited[e] == tag) continue;
+            visited[e] = tag;
+            double d = this->distance(q, e);
+            if (int(results.size()) < ef || d < results.top().first) {
+                candidates.push(dist_id_t(d, e));
+                results.push(dist_id_t(d, e));
+                if (int(results.size()) > ef) results.pop();
+            }
+        }
+    }
+    output.resize(results.size());
+    for (int r=output.size()-1; r>=0; --r) {
+        output[r] = results.top();
+        results.pop();
+    }
+}
+
+void HnswIndex::selectNeighbours(int id, std::vector<dist_id_t> &candidates,
+        int m, std::vector<int> &output) {
+    // Heuristic selection: A candidate (sorted by distance to id) is kept
+    // only if it is closer to id than to any of the neighbours kept so far,
+    // the remaining slots are filled with the closest pruned candidates
+    output.clear();
+    std::vector<int> pruned;
+    for (auto &c : candidates) {
+        if (c.second == id) continue;
+        if (int(output.size()) >= m) break;
+        bool keep = true;
+        for (int r : output) {
+            if (this->distance(c.second, r) < c.first) {
+                keep = false;
+                break;
+            }
+        }
+        if (keep) output.push_back(c.second);
+        else pruned.push_back(c.second);
+    }
+    for (int i=0; i<int(pruned.size()) && int(output.size())<m; ++i) {
+        output.push_back(pruned[i]);
+    }
+}
+
+int HnswIndex::add(DMap *dmap) {
+    query_t q;
+    this->flatten(dmap, q);
+    int id = n_items;
+    // Store
+    for (int c=0; c<int(q.codes.size()); ++c) {
+        codes.push_back(q.codes[c]);
+        values.insert(values.end(), q.values.begin()+q.offsets[c],
+            q.values.begin()+q.offsets[c+1]);
+        offsets.push_back(values.size());
+    }
+    item_rows.push_back(codes.size());
+    int level = this->randomLevel();
+    levels.push_back(level);
+    links.push_back(std::vector<std::vector<int> >(level+1));
+    n_items += 1;
+    if (entry_point < 0) {
+        entry_point = id;
+        max_level = level;
+        return id;
+    }
+    // Greedy descent through the layers above the new level
+    dist_id_t ep(this->distance(q, entry_point), entry_point);
+    std::vector<dist_id_t> found;
+    for (int layer=max_level; layer>level; --layer) {
+        this->searchLayer(q, ep, 1, layer, found);
+        ep = found[0];
+    }
+    // Connect on all layers <= level
+    std::vector<int> selected;
+    std::vector<dist_id_t> nb_candidates;
+    for (int layer=std::min(level, max_level); layer>=0; --layer) {
+        this->searchLayer(q, ep, ef_construction, layer, found);
+        int m_max = (layer == 0) ? M0 : M;
+        this->selectNeighbours(id, found, M, selected);
+        links[id][layer] = selected;
+        for (int nb : selected) {
+            std::vector<int> &nb_links = links[nb][layer];
+            nb_links.push_back(id);
+            if (int(nb_links.size()) > m_max) {
+                nb_candidates.clear();
+                for (int e : nb_links)
+                    nb_candidates.push_back(dist_id_t(this->distance(nb, e), e));
+                std::sort(nb_candidates.begin(), nb_candidates.end());
+                this->selectNeighbours(nb, nb_candidates, m_max, nb_links);
+            }
+        }
+        ep = found[0];
+    }
+    if (level > max_level) {
+        max_level = level;
+        entry_point = id;
+    }
+    return id;
+}
+
+void HnswIndex::addMatrix(DMapMatrix *dmm) {
+    for (auto it=dmm->begin(); it!=dmm->end(); ++it) this->add(*it);
+}
+
+void HnswIndex::searchExact(const query_t &q, int k, std::vector<dist_id_t> &output) {
+    output.resize(n_items);
+    for (int j=0; j<n_items; ++j) output[j] = dist_id_t(this->distance(q, j), j);
+    k = std::min(k, n_items);
+    std::partial_sort(output.begin(), output.begin()+k, output.end());
+    output.resize(k);
+}
+
+void HnswIndex::search(DMap *dmap, int k, bool exact, std::vector<dist_id_t> &output) {
+    // k nearest items, sorted by increasing distance
+    output.clear();
+    if (n_items == 0 || k <= 0) return;
+    query_t q;
+    this->flatten(dmap, q);
+    if (exact) {
+        this->searchExact(q, k, output);
+        return;
+    }
+    dist_id_t ep(this->distance(q, entry_point), entry_point);
+    for (int layer=max_level; layer>0; --layer) {
+        this->searchLayer(q, ep, 1, layer, output);
+        ep = output[0];
+    }
+    this->searchLayer(q, ep, std::max(ef_search, k), 0, output);
+    if (int(output.size()) > k) output.resize(k);
+}
+
+boost::python::list HnswIndex::searchPython(DMap *dmap, int k, bool exact) {
+    // [(item id, similarity), ...]
+    std::vector<dist_id_t> found;
+    this->search(dmap, k, exact, found);
+    boost::python::list res;
+    for (auto &f : found) {
+        double sim = (metric == "cosine") ? 1.0 - f.first : -f.first;
+        res.append(boost::python::make_tuple(f.second, sim));
+    }
+    return res;
+}
+
+boost::python::tuple HnswIndex::searchMatrixPython(DMapMatrix *dmm, int k,
+        bool exact, std::string np_dtype) {
+    // Row-wise queries, returns (ids, similarities), each rows x k, padded
+    // with -1 (ids) and 0 (similarities) if the index holds fewer than k items
+    int n_rows = dmm->rows();
+    ub::matrix<double> ids(n_rows, std::max(k, 0), -1.0);
+    ub::matrix<double> sims(n_rows, std::max(k, 0), 0.0);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i=0; i<n_rows; ++i) {
+        std::vector<dist_id_t> found;
+        this->search(dmm->getRow(i), k, exact, found);
+        for (int r=0; r<int(found.size()); ++r) {
+            ids(i,r) = found[r].second;
+            sims(i,r) = (metric == "cosine") ? 1.0 - found[r].first : -found[r].first;
+        }
+    }
+    soap::linalg::numpy_converter npc(np_dtype.c_str());
+    soap::linalg::numpy_converter npc_ids("int32");
+    return boost::python::make_tuple(
+        npc_ids.ublas_to_numpy<double>(ids),
+        npc.ublas_to_numpy<double>(sims));
+}
+
+void HnswIndex::save(std::string archfile) {
+    std::ofstream ofs(archfile.c_str());
+    boost::archive::binary_oarchive arch(ofs);
+    arch << (*this);
+    return;
+}
+
+void HnswIndex::load(std::string archfile) {
+    std::ifstream ifs(archfile.c_str());
+    boost::archive::binary_iarchive arch(ifs);
+    arch >> (*this);
+    return;
+}
+
+void HnswIndex::registerPython() {
+    using namespace boost::python;
+    class_<HnswIndex, HnswIndex*>("HnswIndex", init<>())
+        .def(init<std::string, int, int, int>())
+        .def(init<std::string>())
+        .def("__len__", &HnswIndex::size)
+        .add_property("size", &HnswIndex::size)
+        .add_property("M", &HnswIndex::getM)
+        .add_property("metric", &HnswIndex::getMetric)
+        .add_property("ef_search", &HnswIndex::getEfSearch, &HnswIndex::setEfSearch)
+        .def("add", &HnswIndex::add)
+        .def("addMatrix", &HnswIndex::addMatrix)
+        .def("search", &HnswIndex::searchPython)
+        .def("searchMatrix", &HnswIndex::searchMatrixPython)
+        .def("similarity", &HnswIndex::similarity)
+        .def("save", &HnswIndex::save)
+        .def("load", &HnswIndex::load);
+}
+
+}
@@ -0,0 +1,100 @@
+#ifndef _SOAP_HNSW_HPP
+#define _SOAP_HNSW_HPP
+
+#include <boost/serialization/vector.hpp>
+
+#include "soap/dmap.hpp"
+
+namespace soap {
+
+// Approximate nearest-neighbour index over DMaps: Hierarchical navigable
+// small-world graph (Malkov & Yashunin, 2018). Items are stored flattened
+// (channel codes, offsets and values in contiguous buffers) and compared via
+// the same channel-matched dot product as DMap::dot. With metric "cosine",
+// items and queries are normalised, the similarity is the cosine, the
+// distance 1 - cosine; with metric "dot", the distance is -dot.
+// Insertion is incremental (and serial), queries are read-only and can be
+// issued from several threads. Exact search (linear scan) is available as
+// a fallback.
+class HnswIndex
+{
+  public:
+    typedef double dtype_t;
+    typedef TypeEncoder::code_t code_t;
+    typedef std::pair<double, int> dist_id_t; // (distance, item id)
+    HnswIndex();
+    HnswIndex(std::string metric, int M, int ef_construction, int seed);
+    HnswIndex(std::string archfile);
+    ~HnswIndex() {;}
+    int size() { return n_items; }
+    int getM() { return M; }
+    int getEfSearch() { return ef_search; }
+    void setEfSearch(int ef) { ef_search = ef; }
+    std::string getMetric() { return metric; }
+    int add(DMap *dmap);
+    void addMatrix(DMapMatrix *dmm);
+    void search(DMap *dmap, int k, bool exact, std::vector<dist_id_t> &output);
+    boost::python::list searchPython(DMap *dmap, int k, bool exact);
+    boost::python::tuple searchMatrixPython(DMapMatrix *dmm, int k, bool exact,
+        std::string np_dtype);
+    double similarity(int i, int j);
+    void save(std::string archfile);
+    void load(std::string archfile);
+    static void registerPython();
+    template<class Archive>
+    void serialize(Archive &arch, const unsigned int version) {
+        arch & metric;
+        arch & M;
+        arch & M0;
+        arch & ef_construction;
+        arch & ef_search;
+        arch & seed;
+        arch & n_items;
+        arch & item_rows;
+        arch & codes;
+        arch & offsets;
+        arch & values;
+        arch & levels;
+        arch & links;
+        arch & entry_point;
+        arch & max_level;
+    }
+  private:
+    // Flattened query, same layout as a single stored item
+    struct query_t
+    {
+        std::vector<code_t> codes;
+        std::vector<int> offsets;
+        std::vector<dtype_t> values;
+    };
+    void flatten(DMap *dmap, query_t &q);
+    double distance(const query_t &q, int j);
+    double distance(int i, int j);
+    void searchLayer(const query_t &q, dist_id_t entry, int ef, int layer,
+        std::vector<dist_id_t> &output);
+    void selectNeighbours(int id, std::vector<dist_id_t> &candidates, int m,
+        std::vector<int> &output);
+    void searchExact(const query_t &q, int k, std::vector<dist_id_t> &output);
+    int randomLevel();
+    std::string metric;
+    int M;               // Max. number of links per node on layers > 0
+    int M0;              // Max. number of links per node on layer 0
+    int ef_construction; // Candidate list size during insertion
+    int ef_search;       // Candidate list size during search
+    int seed;
+    int n_items;
+    // Item i: channels item_rows[i] <= c < item_rows[i+1] with code codes[c],
+    // values values[offsets[c]:offsets[c+1]]
+    std::vector<int> item_rows;
+    std::vector<code_t> codes;
+    std::vector<std::size_t> offsets;
+    std::vector<dtype_t> values;
+    std::vector<int> levels;
+    std::vector<std::vector<std::vector<int> > > links; // links[i][layer]
+    int entry_point;
+    int max_level;
+};
+
+}
+
+#endif /* _SOAP_HNSW_HPP */
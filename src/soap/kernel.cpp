@@ -1,12 +1,31 @@
 #include "soap/kernel.hpp"
 #include "soap/linalg/numpy.hpp"
 #include "soap/linalg/operations.hpp"
+#include "soap/linalg/sinkhorn.hpp"
 #include "soap/base/tokenizer.hpp"
+#include <list>
+#include <random>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace soap {
 
 namespace ub = boost::numeric::ublas;
 
+static void report_tiles(int64_t &n_reported, int64_t n_done, int64_t n_tiles) {
+    // Progress of a parallel tile loop, written by the master thread only
+    // and at most every 1% of the tiles. Other threads may log warnings
+    // (see TopKernelRematch::match), hence the critical section.
+    #ifdef _OPENMP
+    if (omp_get_thread_num() != 0) return;
+    #endif
+    if (n_done != n_tiles && (n_done - n_reported)*100 < n_tiles) return;
+    n_reported = n_done;
+    #pragma omp critical(glog)
+    GLOG() << "\r" << "Tile " << n_done << "/" << n_tiles << std::flush;
+}
+
 double TopKernel::evaluateNumpy(boost::python::object &np_K, std::string np_dtype) {
     DMapMatrix::matrix_t K;
     soap::linalg::numpy_converter npc(np_dtype.c_str());
@@ -14,55 +33,54 @@ double TopKernel::evaluateNumpy(boost::python::object &np_K, std::string np_dtyp
     return this->evaluate(K);
 }
 
-TopKernelRematch::TopKernelRematch() : gamma(0.05), eps(1e-6), omega(1.0) {;}
+TopKernelRematch::TopKernelRematch() : gamma(0.05), eps(1e-6), omega(1.0),
+    max_iter(100000), gamma_start(0.0) {;}
 
 void TopKernelRematch::configure(Options &options) {
     gamma = options.get<double>("rematch_gamma");
     eps = options.get<double>("rematch_eps");
     omega = options.get<double>("rematch_omega");
+    if (options.hasKey("rematch_max_iter"))
+        max_iter = options.get<int>("rematch_max_iter");
+    if (options.hasKey("rematch_gamma_start"))
+        gamma_start = options.get<double>("rematch_gamma_start");
     GLOG() << "Configuring top kernel (rematch)";
-    GLOG() << " gamma=" << gamma << " eps=" << eps << " omega=" << omega << std::endl;
+    GLOG() << " gamma=" << gamma << " eps=" << eps << " omega=" << omega
+        << " max_iter=" << max_iter << " gamma_start=" << gamma_start << std::endl;
+}
+
+linalg::SinkhornInfo TopKernelRematch::match(
+        DMapMatrix::matrix_t &K, DMapMatrix::matrix_t &P) {
+    linalg::SinkhornOptions options;
+    options.gamma = gamma;
+    options.tol = eps;
+    options.omega = omega;
+    options.max_iter = max_iter;
+    options.gamma_start = gamma_start;
+    int nx = K.size1();
+    int ny = K.size2();
+    P.resize(nx, ny, false);
+    linalg::SinkhornSolver solver(options);
+    linalg::SinkhornInfo info = solver.solve(
+        &K.data()[0], nx, ny, &P.data()[0]);
+    if (!info.converged) {
+        #pragma omp critical(glog)
+        GLOG() << "Warning: rematch " << nx << "x" << ny
+            << " not converged after " << info.n_iter
+            << " iterations, err=" << info.err << std::endl;
+    }
+    return info;
 }
 
 double TopKernelRematch::evaluate(DMapMatrix::matrix_t &K) {
+    DMapMatrix::matrix_t P;
+    this->match(K, P);
     int nx = K.size1();
     int ny = K.size2();
-    DMapMatrix::vec_t u(nx, 1.0);
-    DMapMatrix::vec_t u_in(nx, 1.0);
-    DMapMatrix::vec_t du(nx);
-    DMapMatrix::vec_t v(ny, 1.0);
-    DMapMatrix::vec_t v_in(ny, 1.0);
-    double ax = 1./nx;
-    double ay = 1./ny;
-    double lambda = 1./gamma;
-    DMapMatrix::matrix_t Kg(nx,ny);
-    for (int i=0; i<nx; ++i)
-        for (int j=0; j<ny; ++j)
-            Kg(i,j) = std::exp(-(1-K(i,j))*lambda);
-    int i_iter = 0;
-    double err = 0.0;
-    // TODO Add convergence flag and send to user
-    while (true) {
-        // Update u
-        soap::linalg::linalg_matrix_vector_dot(Kg, v, u, false, 1.0, 0.0);
-        err = 0.0;
-        for (int i=0; i<nx; ++i) err += std::pow(ax-u(i)*u_in(i),2);
-        for (int i=0; i<nx; ++i) u(i) = omega*ax/u(i) + (1-omega)*u_in(i);
-        // Update v
-        soap::linalg::linalg_matrix_vector_dot(Kg, u, v, true, 1.0, 0.0);
-        for (int i=0; i<ny; ++i) v(i) = omega*ay/v(i) + (1-omega)*v_in(i);
-        if (err < eps) break;
-        // Step
-        u_in = u;
-        v_in = v;
-        i_iter += 1;
-    }
     double k = 0.0;
-    ub::matrix<double> Pij(nx, ny, 0.0);
     for (int i=0; i<nx; ++i) {
         for (int j=0; j<ny; ++j) {
-            Pij(i,j) = u(i)*Kg(i,j)*v(j);
-            k += Pij(i,j)*K(i,j);
+            k += P(i,j)*K(i,j);
         }
     }
     return k;
@@ -70,86 +88,26 @@ double TopKernelRematch::evaluate(DMapMatrix::matrix_t &K) {
 
 void TopKernelRematch::attributeGetReductionMatrix(
     DMapMatrix::matrix_t &K, DMapMatrix::matrix_t &P) {
+    DMapMatrix::matrix_t Pij;
+    this->match(K, Pij);
     int nx = K.size1();
     int ny = K.size2();
-    DMapMatrix::vec_t u(nx, 1.0);
-    DMapMatrix::vec_t u_in(nx, 1.0);
-    DMapMatrix::vec_t du(nx);
-    DMapMatrix::vec_t v(ny, 1.0);
-    DMapMatrix::vec_t v_in(ny, 1.0);
-    double ax = 1./nx;
-    double ay = 1./ny;
-    double lambda = 1./gamma;
-    DMapMatrix::matrix_t Kg(nx,ny);
-    for (int i=0; i<nx; ++i)
-        for (int j=0; j<ny; ++j)
-            Kg(i,j) = std::exp(-(1-K(i,j))*lambda);
-    int i_iter = 0;
-    double err = 0.0;
-    // TODO Add convergence flag and send to user
-    while (true) {
-        // Update u
-        soap::linalg::linalg_matrix_vector_dot(Kg, v, u, false, 1.0, 0.0);
-        err = 0.0;
-        for (int i=0; i<nx; ++i) err += std::pow(ax-u(i)*u_in(i),2);
-        for (int i=0; i<nx; ++i) u(i) = omega*ax/u(i) + (1-omega)*u_in(i);
-        // Update v
-        soap::linalg::linalg_matrix_vector_dot(Kg, u, v, true, 1.0, 0.0);
-        for (int i=0; i<ny; ++i) v(i) = omega*ay/v(i) + (1-omega)*v_in(i);
-        if (err < eps) break;
-        // Step
-        u_in = u;
-        v_in = v;
-        i_iter += 1;
-    }
     for (int i=0; i<nx; ++i) {
-        double ki = 0.0;
         for (int j=0; j<ny; ++j) {
-            P(i,j) = u(i)*Kg(i,j)*v(j);
+            P(i,j) = Pij(i,j);
         }
     }
 }
 
 void TopKernelRematch::attributeLeft(DMapMatrix::matrix_t &K, 
         DMapMatrix::matrix_t &K_out, int i_off, int j_off) {
+    DMapMatrix::matrix_t Pij;
+    this->match(K, Pij);
     int nx = K.size1();
     int ny = K.size2();
-    DMapMatrix::vec_t u(nx, 1.0);
-    DMapMatrix::vec_t u_in(nx, 1.0);
-    DMapMatrix::vec_t du(nx);
-    DMapMatrix::vec_t v(ny, 1.0);
-    DMapMatrix::vec_t v_in(ny, 1.0);
-    double ax = 1./nx;
-    double ay = 1./ny;
-    double lambda = 1./gamma;
-    DMapMatrix::matrix_t Kg(nx,ny);
-    for (int i=0; i<nx; ++i)
-        for (int j=0; j<ny; ++j)
-            Kg(i,j) = std::exp(-(1-K(i,j))*lambda);
-    int i_iter = 0;
-    double err = 0.0;
-    // TODO Add convergence flag and send to user
-    while (true) {
-        // Update u
-        soap::linalg::linalg_matrix_vector_dot(Kg, v, u, false, 1.0, 0.0);
-        err = 0.0;
-        for (int i=0; i<nx; ++i) err += std::pow(ax-u(i)*u_in(i),2);
-        for (int i=0; i<nx; ++i) u(i) = omega*ax/u(i) + (1-omega)*u_in(i);
-        // Update v
-        soap::linalg::linalg_matrix_vector_dot(Kg, u, v, true, 1.0, 0.0);
-        for (int i=0; i<ny; ++i) v(i) = omega*ay/v(i) + (1-omega)*v_in(i);
-        if (err < eps) break;
-        // Step
-        u_in = u;
-        v_in = v;
-        i_iter += 1;
-    }
-    double k = 0.0;
-    ub::matrix<double> Pij(nx, ny, 0.0);
     for (int i=0; i<nx; ++i) {
         double ki = 0.0;
         for (int j=0; j<ny; ++j) {
-            Pij(i,j) = u(i)*Kg(i,j)*v(j);
             ki += Pij(i,j)*K(i,j);
         }
         K_out(i_off+i, j_off) = ki;
@@ -234,19 +192,24 @@ void TopKernelAverage::attributeLeft(DMapMatrix::matrix_t &K,
     }
 }
 
-BaseKernelDot::BaseKernelDot() : exponent(2.), filter(false) {
+BaseKernelDot::BaseKernelDot() : exponent(2.), filter(false), gemm(true) {
     ;
 }
 
 void BaseKernelDot::configure(Options &options) {
     exponent = options.get<double>("base_exponent");
     filter = options.get<bool>("base_filter");
+    if (options.hasKey("base_gemm"))
+        gemm = options.get<bool>("base_gemm");
     GLOG() << "Configuring base kernel (dot):";
-    GLOG() << " exponent=" << exponent << " filter=" << filter << std::endl;
+    GLOG() << " exponent=" << exponent << " filter=" << filter 
+        << " gemm=" << gemm << std::endl;
 }
 
 double BaseKernelDot::evaluate(DMapMatrix *m1, DMapMatrix *m2, DMapMatrix::matrix_t &K_out) {
-    dmm_inner_product(*m1, *m2, exponent, filter, K_out);
+    if (gemm) dmm_inner_product_gemm(*m1, *m2, exponent, filter, K_out);
+    else dmm_inner_product(*m1, *m2, exponent, filter, K_out);
+    return 0.0;
 }
 
 Kernel::~Kernel() {
@@ -257,9 +220,20 @@ Kernel::~Kernel() {
     this->clearOutput();
 }
 
-Kernel::Kernel(Options &options) {
+Kernel::Kernel(Options &options) : n_threads(0), tile_size(8), file_tile_size(64),
+        nystrom_eps(1e-10) {
     basekernel = BaseKernelCreator().create(options.get<std::string>("basekernel_type"));
     basekernel->configure(options);
+    if (options.hasKey("kernel_n_threads"))
+        n_threads = options.get<int>("kernel_n_threads");
+    if (options.hasKey("kernel_tile_size")) {
+        tile_size = std::max(1, options.get<int>("kernel_tile_size"));
+        file_tile_size = tile_size;
+    }
+    if (options.hasKey("kernel_file_tile_size"))
+        file_tile_size = std::max(1, options.get<int>("kernel_file_tile_size"));
+    if (options.hasKey("nystrom_eps"))
+        nystrom_eps = options.get<double>("nystrom_eps");
     if (options.get<std::string>("topkernel_type") != "") {
         this->addTopkernel(options);
     }
@@ -292,18 +266,67 @@ void Kernel::evaluate(DMapMatrixSet *dset1, DMapMatrixSet *dset2,
     int n_cols = dset2->size();
     assert(output.size1() == n_rows && output.size2() == n_cols 
         && "Inconsistent output matrix dimensions");
-    int i_row = 0;
-    for (auto it=dset1->begin(); it!=dset1->end(); ++it, ++i_row) {
-        GLOG() << "\r" << "Row " << i_row+1 << "/" << n_rows << std::flush;
-        int j_col = (symmetric) ? i_row : 0;
-        for (auto jt=(symmetric) ? it : dset2->begin(); jt!=dset2->end(); ++jt, ++j_col) {
-            DMapMatrix::matrix_t Kij((*it)->rows(), (*jt)->rows());
-            //dmm_inner_product(*(*it), *(*jt), power, filter, Kij);
-            basekernel->evaluate(*it, *jt, Kij);
-            output(i_row, j_col) = topkernels[0]->evaluate(Kij);
+    std::vector<output_t*> outputs { &output };
+    this->evaluateTiled(dset1, dset2, symmetric, outputs);
+}
+
+void Kernel::evaluateTiled(DMapMatrixSet *dset1, DMapMatrixSet *dset2,
+        bool symmetric, std::vector<output_t*> &outputs) {
+    // Output slot k receives top kernel k. The output matrix is split into
+    // tiles of tile_size x tile_size structure pairs, which are distributed
+    // dynamically over the threads (structure sizes and hence the cost per
+    // tile vary). If symmetric, only tiles that intersect the upper triangle
+    // are evaluated, and within those only the entries j >= i.
+    int n_rows = dset1->size();
+    int n_cols = dset2->size();
+    int n_top = outputs.size();
+    int n_tiles_i = (n_rows + tile_size - 1)/tile_size;
+    int n_tiles_j = (n_cols + tile_size - 1)/tile_size;
+    std::vector<std::pair<int,int> > tiles;
+    for (int ti=0; ti<n_tiles_i; ++ti) {
+        for (int tj=0; tj<n_tiles_j; ++tj) {
+            if (symmetric && (tj+1)*tile_size <= ti*tile_size) continue;
+            tiles.push_back(std::pair<int,int>(ti, tj));
         }
     }
-    GLOG() << std::endl;
+    int n_tiles = tiles.size();
+    int n_done = 0;
+    int64_t n_reported = 0;
+    #ifdef _OPENMP
+    int n_threads_eff = (n_threads <= 0) ? omp_get_max_threads() : n_threads;
+    if (n_threads_eff > n_tiles) n_threads_eff = n_tiles;
+    if (n_threads_eff < 1) n_threads_eff = 1;
+    #endif
+    #pragma omp parallel num_threads(n_threads_eff)
+    {
+        // Per-thread scratch for the base kernel matrix
+        DMapMatrix::matrix_t Kij;
+        #pragma omp for schedule(dynamic)
+        for (int t=0; t<n_tiles; ++t) {
+            int i0 = tiles[t].first*tile_size;
+            int j0 = tiles[t].second*tile_size;
+            int i1 = std::min(i0+tile_size, n_rows);
+            int j1 = std::min(j0+tile_size, n_cols);
+            for (int i=i0; i<i1; ++i) {
+                DMapMatrixPin pin_i(dset1, i);
+                DMapMatrix *dmm_i = pin_i.get();
+                for (int j=(symmetric) ? std::max(i, j0) : j0; j<j1; ++j) {
+                    DMapMatrixPin pin_j(dset2, j);
+                    DMapMatrix *dmm_j = pin_j.get();
+                    Kij.resize(dmm_i->rows(), dmm_j->rows(), false);
+                    basekernel->evaluate(dmm_i, dmm_j, Kij);
+                    for (int k=0; k<n_top; ++k) {
+                        (*outputs[k])(i, j) = topkernels[k]->evaluate(Kij);
+                    }
+                }
+            }
+            int done;
+            #pragma omp atomic capture
+            done = ++n_done;
+            report_tiles(n_reported, done, n_tiles);
+        }
+    }
+    GLOG() << "\r" << "Tile " << n_done << "/" << n_tiles << std::endl;
 }
 
 double Kernel::evaluate(DMapMatrix *dmap1, DMapMatrix *dmap2) {
@@ -340,20 +363,285 @@ void Kernel::evaluateAll(DMapMatrixSet *dset1, DMapMatrixSet *dset2,
     int n_rows = dset1->size();
     int n_cols = dset2->size();
     this->clearThenAllocateOutput(n_rows, n_cols);
-    int i_row = 0;
-    for (auto it=dset1->begin(); it!=dset1->end(); ++it, ++i_row) {
-        GLOG() << "\r" << "Row " << i_row+1 << "/" << n_rows << std::flush;
-        int j_col = (symmetric) ? i_row : 0;
-        for (auto jt=(symmetric) ? it : dset2->begin(); jt!=dset2->end(); ++jt, ++j_col) {
-            DMapMatrix::matrix_t Kij((*it)->rows(), (*jt)->rows());
-            //dmm_inner_product(*(*it), *(*jt), power, filter, Kij);
-            basekernel->evaluate(*it, *jt, Kij);
-            for (int k=0; k<topkernels.size(); ++k) {
-                (*kernelmats_out[k])(i_row, j_col) = topkernels[k]->evaluate(Kij);
+    this->evaluateTiled(dset1, dset2, symmetric, kernelmats_out);
+}
+
+void Kernel::evaluateFile(DMapMatrixSet *dset, std::string filename) {
+    // Symmetric kernel (top kernel 0) of dset, written tile by tile to a
+    // memory-mapped packed upper-triangular file. Tiles completed by an
+    // earlier (interrupted) call on the same file are skipped. Tiles are
+    // enumerated on the fly, row of tiles by row of tiles (rows further up
+    // hold more tiles and are scheduled first), such that no list of the
+    // O(n_tiles^2) pending tiles is held in memory.
+    if (basekernel == NULL || topkernels.size() == 0)
+        throw soap::base::SanityCheckFailed("Kernel object not initialized");
+    KernelFile kfile;
+    kfile.open(filename, dset->size(), file_tile_size);
+    int n = kfile.size();
+    int ts = kfile.getTileSize();
+    int n_tiles_1d = kfile.getNumberOfTiles();
+    int64_t n_tiles = int64_t(n_tiles_1d)*(n_tiles_1d+1)/2 - kfile.countTilesDone();
+    int64_t n_done = 0;
+    int64_t n_reported = 0;
+    GLOG() << "Kernel file " << filename << ": " << n_tiles << " of " 
+        << int64_t(n_tiles_1d)*(n_tiles_1d+1)/2 << " tiles pending" << std::endl;
+    #ifdef _OPENMP
+    int n_threads_eff = (n_threads <= 0) ? omp_get_max_threads() : n_threads;
+    if (n_threads_eff > n_tiles_1d) n_threads_eff = n_tiles_1d;
+    if (n_threads_eff < 1) n_threads_eff = 1;
+    #endif
+    #pragma omp parallel num_threads(n_threads_eff)
+    {
+        DMapMatrix::matrix_t Kij;
+        #pragma omp for schedule(dynamic)
+        for (int ti=0; ti<n_tiles_1d; ++ti) {
+            for (int tj=ti; tj<n_tiles_1d; ++tj) {
+                if (kfile.isTileDone(ti, tj)) continue;
+                int i0 = ti*ts;
+                int j0 = tj*ts;
+                int i1 = std::min(i0+ts, n);
+                int j1 = std::min(j0+ts, n);
+                for (int i=i0; i<i1; ++i) {
+                    DMapMatrixPin pin_i(dset, i);
+                    DMapMatrix *dmm_i = pin_i.get();
+                    for (int j=std::max(i, j0); j<j1; ++j) {
+                        DMapMatrixPin pin_j(dset, j);
+                        DMapMatrix *dmm_j = pin_j.get();
+                        Kij.resize(dmm_i->rows(), dmm_j->rows(), false);
+                        basekernel->evaluate(dmm_i, dmm_j, Kij);
+                        kfile.at(i, j) = topkernels[0]->evaluate(Kij);
+                    }
+                }
+                // Flag only once all entries of the tile are on disk
+                kfile.setTileDone(ti, tj);
+                int64_t done;
+                #pragma omp atomic capture
+                done = ++n_done;
+                report_tiles(n_reported, done, n_tiles);
             }
         }
     }
-    GLOG() << std::endl;
+    GLOG() << "\r" << "Tile " << n_done << "/" << n_tiles << std::endl;
+    kfile.close();
+}
+
+static void nystrom_factor(DMapMatrix::matrix_t &C, DMapMatrix::matrix_t &W,
+        double eps, DMapMatrix::matrix_t &L) {
+    // L = C.U with U = V.diag(lambda^-1/2) over the eigenpairs (lambda, V)
+    // of W with lambda > eps*lambda_max, such that L.L^T = C.W^+.C^T
+    int n = C.size1();
+    int m = W.size1();
+    DMapMatrix::matrix_t V = W;
+    ub::vector<double> E;
+    if (!soap::linalg::linalg_eigenvalues(E, V))
+        throw soap::base::SanityCheckFailed("Eigendecomposition of landmark kernel failed");
+    std::vector<int> keep;
+    double lambda_max = (m > 0) ? E(m-1) : 0.0;
+    for (int k=0; k<m; ++k) {
+        if (E(k) > eps*lambda_max && E(k) > 0.0) keep.push_back(k);
+    }
+    int r = keep.size();
+    DMapMatrix::matrix_t U(m, r);
+    for (int q=0; q<r; ++q) {
+        double s = 1./std::sqrt(E(keep[q]));
+        for (int a=0; a<m; ++a) U(a,q) = V(a,keep[q])*s;
+    }
+    L.resize(n, r, false);
+    if (n > 0 && r > 0) soap::linalg::linalg_matrix_dot(C, U, L);
+}
+
+void Kernel::evaluateNystrom(DMapMatrixSet *dset, DMapMatrixSet *landmarks, 
+        DMapMatrix::matrix_t &L, DMapMatrix::matrix_t &C, DMapMatrix::matrix_t &W) {
+    // Cross kernel C (N x M) and landmark kernel W (M x M), both with top
+    // kernel 0, and the low-rank factor L (N x r, r <= M), K ~ L.L^T
+    if (basekernel == NULL || topkernels.size() == 0)
+        throw soap::base::SanityCheckFailed("Kernel object not initialized");
+    int n = dset->size();
+    int m = landmarks->size();
+    C.resize(n, m, false);
+    W.resize(m, m, false);
+    std::vector<output_t*> outputs_C { &C };
+    std::vector<output_t*> outputs_W { &W };
+    GLOG() << "Nystrom: Cross kernel " << n << "x" << m << std::endl;
+    this->evaluateTiled(dset, landmarks, false, outputs_C);
+    GLOG() << "Nystrom: Landmark kernel " << m << "x" << m << std::endl;
+    this->evaluateTiled(landmarks, landmarks, true, outputs_W);
+    for (int a=0; a<m; ++a)
+        for (int b=0; b<a; ++b) W(a,b) = W(b,a);
+    nystrom_factor(C, W, nystrom_eps, L);
+}
+
+boost::python::tuple Kernel::evaluateNystromPython(DMapMatrixSet *dset, 
+        DMapMatrixSet *landmarks, std::string np_dtype) {
+    soap::linalg::numpy_converter npc(np_dtype.c_str());
+    DMapMatrix::matrix_t L;
+    DMapMatrix::matrix_t C;
+    DMapMatrix::matrix_t W;
+    this->evaluateNystrom(dset, landmarks, L, C, W);
+    return boost::python::make_tuple(
+        npc.ublas_to_numpy<DMapMatrix::dtype_t>(L),
+        npc.ublas_to_numpy<DMapMatrix::dtype_t>(C),
+        npc.ublas_to_numpy<DMapMatrix::dtype_t>(W));
+}
+
+void Kernel::evaluateColumn(DMapMatrixSet *dset, DMapMatrix *dmm,
+        std::vector<double> &output) {
+    // output[i] = k(dset[i], dmm), top kernel 0
+    int n = dset->size();
+    output.resize(n);
+    #ifdef _OPENMP
+    int n_threads_eff = (n_threads <= 0) ? omp_get_max_threads() : n_threads;
+    if (n_threads_eff < 1) n_threads_eff = 1;
+    #endif
+    #pragma omp parallel num_threads(n_threads_eff)
+    {
+        DMapMatrix::matrix_t Kij;
+        #pragma omp for schedule(dynamic)
+        for (int i=0; i<n; ++i) {
+            DMapMatrixPin pin_i(dset, i);
+            Kij.resize(pin_i.get()->rows(), dmm->rows(), false);
+            basekernel->evaluate(pin_i.get(), dmm, Kij);
+            output[i] = topkernels[0]->evaluate(Kij);
+        }
+    }
+}
+
+std::vector<int> Kernel::selectLandmarks(DMapMatrixSet *dset, int n_landmarks,
+        std::string method, int seed) {
+    // Landmark structures for the Nystrom approximation:
+    // "uniform":  Uniform sampling without replacement
+    // "fps":      Farthest-point sampling in the kernel-induced distance
+    //             d_ij^2 = k_ii + k_jj - 2 k_ij, starting from a random point
+    // "leverage": Sampling without replacement with probabilities given by 
+    //             the ridge leverage scores of a uniform Nystrom approximation
+    //             of rank 2*n_landmarks
+    // All of these cost O(N*n_landmarks) kernel evaluations
+    if (basekernel == NULL || topkernels.size() == 0)
+        throw soap::base::SanityCheckFailed("Kernel object not initialized");
+    int n = dset->size();
+    n_landmarks = std::max(0, std::min(n_landmarks, n));
+    std::mt19937 engine(seed);
+    std::vector<int> selected;
+    if (method == "uniform") {
+        std::vector<int> idcs(n);
+        for (int i=0; i<n; ++i) idcs[i] = i;
+        for (int k=0; k<n_landmarks; ++k) {
+            int r = k + engine() % (n-k);
+            std::swap(idcs[k], idcs[r]);
+            selected.push_back(idcs[k]);
+        }
+    } else if (method == "fps") {
+        if (n_landmarks == 0) return selected;
+        std::vector<double> k_self(n);
+        std::vector<double> k_col;
+        #ifdef _OPENMP
+        int n_threads_eff = (n_threads <= 0) ? omp_get_max_threads() : n_threads;
+        if (n_threads_eff < 1) n_threads_eff = 1;
+        #endif
+        #pragma omp parallel num_threads(n_threads_eff)
+        {
+            DMapMatrix::matrix_t Kii;
+            #pragma omp for schedule(dynamic)
+            for (int i=0; i<n; ++i) {
+                DMapMatrixPin pin_i(dset, i);
+                Kii.resize(pin_i.get()->rows(), pin_i.get()->rows(), false);
+                basekernel->evaluate(pin_i.get(), pin_i.get(), Kii);
+                k_self[i] = topkernels[0]->evaluate(Kii);
+            }
+        }
+        std::vector<double> d2(n, std::numeric_limits<double>::infinity());
+        int next = engine() % n;
+        for (int k=0; k<n_landmarks; ++k) {
+            selected.push_back(next);
+            GLOG() << "\r" << "FPS " << k+1 << "/" << n_landmarks << std::flush;
+            if (k+1 == n_landmarks) break;
+            {
+                DMapMatrixPin pin_next(dset, next);
+                this->evaluateColumn(dset, pin_next.get(), k_col);
+            }
+            double d2_max = -1.0;
+            for (int i=0; i<n; ++i) {
+                double d2_i = k_self[i] + k_self[next] - 2*k_col[i];
+                if (d2_i < d2[i]) d2[i] = d2_i;
+                if (d2[i] > d2_max) {
+                    d2_max = d2[i];
+                    next = i;
+                }
+            }
+        }
+        GLOG() << std::endl;
+    } else if (method == "leverage") {
+        std::vector<int> presample = this->selectLandmarks(
+            dset, 2*n_landmarks, "uniform", seed);
+        // The view holds pointers into dset: Pinned while in use
+        std::list<DMapMatrixPin> pins;
+        DMapMatrixSet pre(true);
+        for (int i : presample) {
+            pins.emplace_back(dset, i);
+            pre.append(pins.back().get());
+        }
+        DMapMatrix::matrix_t L;
+        DMapMatrix::matrix_t C;
+        DMapMatrix::matrix_t W;
+        this->evaluateNystrom(dset, &pre, L, C, W);
+        // Scores l_i = L_i.(L^T.L + lambda)^-1.L_i^T, with the ridge lambda
+        // relative to the mean diagonal of the approximated kernel
+        int r = L.size2();
+        DMapMatrix::matrix_t G(r, r);
+        if (n > 0 && r > 0) soap::linalg::linalg_matrix_dot(L, L, G, 1.0, 0.0, true, false);
+        double trace = 0.0;
+        for (int q=0; q<r; ++q) trace += G(q,q);
+        double lambda = 1e-3*trace/std::max(n, 1);
+        ub::vector<double> S;
+        if (!soap::linalg::linalg_eigenvalues(S, G))
+            throw soap::base::SanityCheckFailed("Eigendecomposition failed");
+        std::vector<double> scores(n, 0.0);
+        for (int i=0; i<n; ++i) {
+            for (int q=0; q<r; ++q) {
+                double p = 0.0;
+                for (int a=0; a<r; ++a) p += L(i,a)*G(a,q);
+                scores[i] += p*p/(S(q) + lambda);
+            }
+        }
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        for (int k=0; k<n_landmarks; ++k) {
+            double sum = 0.0;
+            for (int i=0; i<n; ++i) sum += scores[i];
+            int pick = -1;
+            if (sum > 0.0) {
+                double u = uniform(engine)*sum;
+                for (int i=0; i<n; ++i) {
+                    if (scores[i] <= 0.0) continue;
+                    pick = i;
+                    u -= scores[i];
+                    if (u < 0.0) break;
+                }
+            }
+            if (pick < 0) {
+                // Degenerate scores: Fall back to a uniform pick
+                std::vector<int> remaining;
+                for (int i=0; i<n; ++i) {
+                    if (std::find(selected.begin(), selected.end(), i) == selected.end())
+                        remaining.push_back(i);
+                }
+                pick = remaining[engine() % remaining.size()];
+            }
+            selected.push_back(pick);
+            scores[pick] = 0.0;
+        }
+    } else {
+        throw soap::base::APIError("Unknown landmark selection method '" + method + "'");
+    }
+    std::sort(selected.begin(), selected.end());
+    return selected;
+}
+
+boost::python::list Kernel::selectLandmarksPython(DMapMatrixSet *dset, 
+        int n_landmarks, std::string method, int seed) {
+    std::vector<int> selected = this->selectLandmarks(dset, n_landmarks, method, seed);
+    boost::python::list res;
+    for (int i : selected) res.append(i);
+    return res;
 }
 
 double Kernel::evaluateTopkernel(boost::python::object &np_K, std::string np_dtype) {
@@ -384,11 +672,14 @@ void Kernel::attributeLeft(DMapMatrix *dmap1, DMapMatrixSet *dset2,
     int n_cols = dset2->size();
     assert(output.size1() == n_rows && output.size2() == n_cols 
         && "Inconsistent output matrix dimensions");
-    int j_col = 0;
-    for (auto jt=dset2->begin(); jt!=dset2->end(); ++jt, ++j_col) {
+    // dmap1 may itself be a matrix of (lazy) dset2
+    DMapMatrixPin pin_1(dset2, dmap1);
+    for (int j_col=0; j_col<n_cols; ++j_col) {
         GLOG() << "\r" << "Col " << j_col+1 << "/" << n_cols << std::flush;
-        DMapMatrix::matrix_t Kij(dmap1->rows(), (*jt)->rows());
-        basekernel->evaluate(dmap1, *jt, Kij);
+        DMapMatrixPin pin_j(dset2, j_col);
+        DMapMatrix *dmm_j = pin_j.get();
+        DMapMatrix::matrix_t Kij(dmap1->rows(), dmm_j->rows());
+        basekernel->evaluate(dmap1, dmm_j, Kij);
         int i_off = 0;
         int j_off = j_col;
         topkernels[0]->attributeLeft(Kij, output, i_off, j_off);
@@ -412,7 +703,137 @@ void Kernel::registerPython() {
         .def("attributeLeft", &Kernel::attributeLeftPython)
         .def("evaluate", evaluatePythonDset)
         .def("evaluate", evaluatePythonDmap)
-        .def("evaluateAll", &Kernel::evaluateAll);
+        .def("evaluateAll", &Kernel::evaluateAll)
+        .def("evaluateFile", &Kernel::evaluateFile)
+        .def("evaluateNystrom", &Kernel::evaluateNystromPython)
+        .def("selectLandmarks", &Kernel::selectLandmarksPython);
+}
+
+KernelDotCache::KernelDotCache(Options &options) : n_rows(0), n_cols(0), 
+        symmetric(false), filter(false), n_threads(0) {
+    filter = options.get<bool>("base_filter");
+    if (options.hasKey("kernel_n_threads"))
+        n_threads = options.get<int>("kernel_n_threads");
+}
+
+KernelDotCache::~KernelDotCache() {
+    this->clear();
+}
+
+void KernelDotCache::clear() {
+    for (auto it=blocks.begin(); it!=blocks.end(); ++it) delete *it;
+    blocks.clear();
+    n_rows = 0;
+    n_cols = 0;
+}
+
+void KernelDotCache::compute(DMapMatrixSet *dset1, DMapMatrixSet *dset2, 
+        bool symmetric_arg) {
+    this->clear();
+    symmetric = symmetric_arg;
+    if (symmetric) dset2 = dset1;
+    n_rows = dset1->size();
+    n_cols = dset2->size();
+    blocks.resize(std::size_t(n_rows)*n_cols, NULL);
+    std::vector<std::pair<int,int> > pairs;
+    for (int i=0; i<n_rows; ++i) {
+        for (int j=(symmetric) ? i : 0; j<n_cols; ++j) {
+            int rows_i = dset1->get(i)->rows();
+            blocks[std::size_t(i)*n_cols+j] = new block_t(rows_i, dset2->get(j)->rows());
+            pairs.push_back(std::pair<int,int>(i, j));
+        }
+    }
+    std::size_t n_pairs = pairs.size();
+    #ifdef _OPENMP
+    int n_threads_eff = (n_threads <= 0) ? omp_get_max_threads() : n_threads;
+    if (n_threads_eff < 1) n_threads_eff = 1;
+    #endif
+    GLOG() << "Caching " << n_pairs << " environment dot matrices" << std::endl;
+    #pragma omp parallel for schedule(dynamic) num_threads(n_threads_eff)
+    for (std::size_t p=0; p<n_pairs; ++p) {
+        int i = pairs[p].first;
+        int j = pairs[p].second;
+        DMapMatrixPin pin_i(dset1, i);
+        DMapMatrixPin pin_j(dset2, j);
+        dmm_inner_product_gemm(*pin_i.get(), *pin_j.get(), 1.0, filter, 
+            *blocks[std::size_t(i)*n_cols+j]);
+    }
+}
+
+void KernelDotCache::sweep(std::vector<Options*> &combinations, 
+        std::vector<block_t*> &outputs) {
+    // Top kernels and exponents are configured serially (Options::get
+    // is not thread-safe), the (combination, pair) items then in parallel
+    int n_comb = combinations.size();
+    assert(outputs.size() == n_comb && "Inconsistent number of outputs");
+    std::vector<TopKernel*> topkernels;
+    std::vector<double> exponents;
+    for (int c=0; c<n_comb; ++c) {
+        Options *options = combinations[c];
+        TopKernel *topkernel = TopKernelCreator().create(
+            options->get<std::string>("topkernel_type"));
+        topkernel->configure(*options);
+        topkernels.push_back(topkernel);
+        exponents.push_back(options->get<double>("base_exponent"));
+        assert(outputs[c]->size1() == n_rows && outputs[c]->size2() == n_cols 
+            && "Inconsistent output matrix dimensions");
+    }
+    std::vector<std::size_t> pairs;
+    for (std::size_t ij=0; ij<blocks.size(); ++ij) {
+        if (blocks[ij] != NULL) pairs.push_back(ij);
+    }
+    std::size_t n_pairs = pairs.size();
+    std::size_t n_items = n_comb*n_pairs;
+    #ifdef _OPENMP
+    int n_threads_eff = (n_threads <= 0) ? omp_get_max_threads() : n_threads;
+    if (n_threads_eff < 1) n_threads_eff = 1;
+    #endif
+    #pragma omp parallel num_threads(n_threads_eff)
+    {
+        // Per-thread scratch for the exponentiated base kernel
+        block_t Kij;
+        #pragma omp for schedule(dynamic)
+        for (std::size_t item=0; item<n_items; ++item) {
+            int c = item / n_pairs;
+            std::size_t ij = pairs[item % n_pairs];
+            block_t &K0 = *blocks[ij];
+            double xi = exponents[c];
+            Kij.resize(K0.size1(), K0.size2(), false);
+            for (int a=0; a<K0.size1(); ++a)
+                for (int b=0; b<K0.size2(); ++b)
+                    Kij(a,b) = std::pow(K0(a,b), xi);
+            (*outputs[c])(ij / n_cols, ij % n_cols) = topkernels[c]->evaluate(Kij);
+        }
+    }
+    for (auto it=topkernels.begin(); it!=topkernels.end(); ++it) delete *it;
+}
+
+boost::python::list KernelDotCache::sweepPython(boost::python::list &combinations, 
+        std::string np_dtype) {
+    std::vector<Options*> combs;
+    std::vector<block_t*> outputs;
+    for (int c=0; c<boost::python::len(combinations); ++c) {
+        combs.push_back(boost::python::extract<Options*>(combinations[c]));
+        outputs.push_back(new block_t(n_rows, n_cols, 0.0));
+    }
+    this->sweep(combs, outputs);
+    soap::linalg::numpy_converter npc(np_dtype.c_str());
+    boost::python::list res;
+    for (auto it=outputs.begin(); it!=outputs.end(); ++it) {
+        res.append(npc.ublas_to_numpy<DMapMatrix::dtype_t>(**it));
+        delete *it;
+    }
+    return res;
+}
+
+void KernelDotCache::registerPython() {
+    using namespace boost::python;
+    class_<KernelDotCache, KernelDotCache*>("KernelDotCache", init<Options&>())
+        .add_property("rows", &KernelDotCache::rows)
+        .add_property("cols", &KernelDotCache::cols)
+        .def("compute", &KernelDotCache::compute)
+        .def("sweep", &KernelDotCache::sweepPython)
+        .def("clear", &KernelDotCache::clear);
 }
 
 void BaseKernelFactory::registerAll(void) {
@@ -3,6 +3,8 @@
 
 #include "soap/base/objectfactory.hpp"
 #include "soap/dmap.hpp"
+#include "soap/kernelfile.hpp"
+#include "soap/linalg/sinkhorn.hpp"
 
 namespace soap {
 
@@ -60,6 +62,29 @@ class Kernel
         DMapMatrixSet *dset1,
         DMapMatrixSet *dset2,
         bool symmetric);
+    void evaluateFile(
+        DMapMatrixSet *dset,
+        std::string filename);
+    void evaluateNystrom(
+        DMapMatrixSet *dset,
+        DMapMatrixSet *landmarks,
+        DMapMatrix::matrix_t &L,
+        DMapMatrix::matrix_t &C,
+        DMapMatrix::matrix_t &W);
+    boost::python::tuple evaluateNystromPython(
+        DMapMatrixSet *dset,
+        DMapMatrixSet *landmarks,
+        std::string np_dtype);
+    std::vector<int> selectLandmarks(
+        DMapMatrixSet *dset,
+        int n_landmarks,
+        std::string method,
+        int seed);
+    boost::python::list selectLandmarksPython(
+        DMapMatrixSet *dset,
+        int n_landmarks,
+        std::string method,
+        int seed);
     double evaluateTopkernel(
         boost::python::object &np_K, 
         std::string np_dtype);
@@ -77,10 +102,23 @@ class Kernel
     void addTopkernel(Options &options);
     static void registerPython();
   private:
+    void evaluateTiled(
+        DMapMatrixSet *dset1,
+        DMapMatrixSet *dset2,
+        bool symmetric,
+        std::vector<output_t*> &outputs);
+    void evaluateColumn(
+        DMapMatrixSet *dset,
+        DMapMatrix *dmm,
+        std::vector<double> &output);
     BaseKernel *basekernel;
     metadata_t *metadata;
     std::vector<TopKernel*> topkernels;
     std::vector<output_t*> kernelmats_out;
+    int n_threads; // <= 0: All available threads
+    int tile_size; // Structures per tile edge of the output matrix
+    int file_tile_size; // Same for evaluateFile
+    double nystrom_eps; // Relative eigenvalue cutoff of the landmark kernel
 };
 
 class BaseKernelDot : public BaseKernel
@@ -92,6 +130,7 @@ class BaseKernelDot : public BaseKernel
   private:
     double exponent;
     bool filter;
+    bool gemm; // Channel-blocked GEMM evaluation, see dmm_inner_product_gemm
 };
 
 class TopKernelRematch : public TopKernel
@@ -105,9 +144,12 @@ class TopKernelRematch : public TopKernel
     void attributeLeft(DMapMatrix::matrix_t &K, 
         DMapMatrix::matrix_t &K_out, int i_off, int j_off);
   private:
+    linalg::SinkhornInfo match(DMapMatrix::matrix_t &K, DMapMatrix::matrix_t &P);
     double gamma; // Rematch temperature
     double eps;   // Convergence tolerance
     double omega; // Mixing factor, successive overrelaxation
+    int max_iter; // Iteration cap
+    double gamma_start; // Initial temperature of epsilon scaling (0: off)
 };
 
 class TopKernelCanonical : public TopKernel
@@ -137,6 +179,41 @@ class TopKernelAverage : public TopKernel
   private:
 };
 
+// Caches the raw (exponent 1) environment-level dot matrices of all
+// structure pairs of two DMapMatrixSets, such that many combinations of
+// base exponent and top kernel can be evaluated without recomputing the
+// dot products. Each combination is specified by an Options object with
+// keys base_exponent, topkernel_type (a single key) and the options of
+// that top kernel (e.g., rematch_gamma).
+class KernelDotCache
+{
+  public:
+    typedef DMapMatrix::matrix_t block_t;
+    KernelDotCache(Options &options);
+    ~KernelDotCache();
+    void clear();
+    int rows() { return n_rows; }
+    int cols() { return n_cols; }
+    void compute(
+        DMapMatrixSet *dset1,
+        DMapMatrixSet *dset2,
+        bool symmetric);
+    void sweep(
+        std::vector<Options*> &combinations,
+        std::vector<block_t*> &outputs);
+    boost::python::list sweepPython(
+        boost::python::list &combinations,
+        std::string np_dtype);
+    static void registerPython();
+  private:
+    std::vector<block_t*> blocks; // Pair (i,j) at i*n_cols+j, NULL if not evaluated
+    int n_rows;
+    int n_cols;
+    bool symmetric;
+    bool filter;
+    int n_threads; // <= 0: All available threads
+};
+
 class KernelInterface
 {
   public:
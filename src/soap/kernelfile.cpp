@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "soap/kernelfile.hpp"
+#include "soap/linalg/numpy.hpp"
+
+namespace soap {
+
+static const char KERNELFILE_MAGIC[8] = { 'S', 'O', 'A', 'P', 'K', 'M', 'A', 'T' };
+
+KernelFile::KernelFile() : fd(-1), data(NULL), n_bytes(0), flags(NULL),
+        values(NULL), n(0), tile_size(0), n_tiles(0) {
+    ;
+}
+
+KernelFile::KernelFile(std::string filename_arg) : fd(-1), data(NULL),
+        n_bytes(0), flags(NULL), values(NULL), n(0), tile_size(0), n_tiles(0) {
+    this->open(filename_arg);
+}
+
+KernelFile::~KernelFile() {
+    this->close();
+}
+
+void KernelFile::open(std::string filename_arg, int n_arg, int tile_size_arg) {
+    // Creates the file or, if it exists, reopens it for resumption
+    this->close();
+    if (n_arg < 0 || tile_size_arg < 1) throw soap::base::SanityCheckFailed(
+        "Invalid kernel file dimensions");
+    struct stat st;
+    bool exists = (::stat(filename_arg.c_str(), &st) == 0 && st.st_size > 0);
+    if (exists) {
+        this->map(filename_arg, false, true);
+        if (n != n_arg || tile_size != tile_size_arg) {
+            this->close();
+            throw soap::base::SanityCheckFailed("Kernel file '" + filename_arg
+                + "' exists with different dimensions or tile size");
+        }
+    } else {
+        n = n_arg;
+        tile_size = tile_size_arg;
+        n_tiles = (n + tile_size - 1)/tile_size;
+        this->map(filename_arg, true, true);
+    }
+}
+
+void KernelFile::open(std::string filename_arg) {
+    // Existing file, read-only
+    this->close();
+    this->map(filename_arg, false, false);
+}
+
+void KernelFile::map(std::string filename_arg, bool create, bool writable) {
+    filename = filename_arg;
+    int mode = (writable) ? O_RDWR : O_RDONLY;
+    if (create) mode |= O_CREAT;
+    fd = ::open(filename.c_str(), mode, 0644);
+    if (fd < 0) throw soap::base::IOError("Cannot open kernel file '" + filename + "'");
+    header_t header;
+    if (create) {
+        memcpy(header.magic, KERNELFILE_MAGIC, 8);
+        header.n = n;
+        header.tile_size = tile_size;
+        header.n_tiles = n_tiles;
+    } else {
+        if (::pread(fd, &header, sizeof(header_t), 0) != sizeof(header_t)
+                || memcmp(header.magic, KERNELFILE_MAGIC, 8) != 0) {
+            ::close(fd);
+            fd = -1;
+            throw soap::base::IOError("Not a kernel file: '" + filename + "'");
+        }
+        n = header.n;
+        tile_size = header.tile_size;
+        n_tiles = header.n_tiles;
+    }
+    int64_t n_flag_bytes = ((int64_t(n_tiles)*n_tiles + 7)/8)*8;
+    n_bytes = sizeof(header_t) + n_flag_bytes + int64_t(n)*(n+1)/2*sizeof(dtype_t);
+    if (create) {
+        // The file is extended sparsely, all entries and flags read as zero
+        if (::ftruncate(fd, n_bytes) != 0) {
+            ::close(fd);
+            fd = -1;
+            throw soap::base::IOError("Cannot allocate kernel file '" + filename + "'");
+        }
+    } else {
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size != n_bytes) {
+            ::close(fd);
+            fd = -1;
+            throw soap::base::IOError("Kernel file '" + filename + "' truncated");
+        }
+    }
+    int prot = (writable) ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    void *addr = ::mmap(NULL, n_bytes, prot, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        ::close(fd);
+        fd = -1;
+        throw soap::base::IOError("Cannot map kernel file '" + filename + "'");
+    }
+    data = static_cast<char*>(addr);
+    flags = reinterpret_cast<unsigned char*>(data + sizeof(header_t));
+    values = reinterpret_cast<dtype_t*>(data + sizeof(header_t) + n_flag_bytes);
+    if (create) memcpy(data, &header, sizeof(header_t));
+}
+
+void KernelFile::close() {
+    if (data != NULL) {
+        ::msync(data, n_bytes, MS_SYNC);
+        ::munmap(data, n_bytes);
+    }
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+    data = NULL;
+    flags = NULL;
+    values = NULL;
+    n_bytes = 0;
+}
+
+void KernelFile::sync() {
+    if (data != NULL) ::msync(data, n_bytes, MS_ASYNC);
+}
+
+int64_t KernelFile::countTilesDone() {
+    int64_t n_done = 0;
+    for (int ti=0; ti<n_tiles; ++ti)
+        for (int tj=ti; tj<n_tiles; ++tj)
+            if (this->isTileDone(ti, tj)) n_done += 1;
+    return n_done;
+}
+
+void KernelFile::setTileDone(int ti, int tj) {
+    // The values of the tile reach the disk before its flag does
+    this->syncTile(ti, tj);
+    flags[int64_t(ti)*n_tiles+tj] = 1;
+}
+
+void KernelFile::syncTile(int ti, int tj) {
+    // Each row of the tile is a contiguous segment of the packed values,
+    // flushed synchronously from the enclosing page boundary
+    int64_t page = ::sysconf(_SC_PAGESIZE);
+    int i0 = ti*tile_size;
+    int j0 = tj*tile_size;
+    int i1 = std::min(i0+tile_size, n);
+    int j1 = std::min(j0+tile_size, n);
+    for (int i=i0; i<i1; ++i) {
+        int j_first = std::max(i, j0);
+        if (j_first >= j1) continue;
+        int64_t begin = reinterpret_cast<char*>(&this->at(i, j_first)) - data;
+        int64_t end = reinterpret_cast<char*>(&this->at(i, j1-1) + 1) - data;
+        begin = (begin/page)*page;
+        if (::msync(data + begin, end - begin, MS_SYNC) != 0) throw soap::base::IOError(
+            "Cannot flush kernel file '" + filename + "'");
+    }
+}
+
+void KernelFile::readRows(int i0, int i1, matrix_t &output) {
+    if (data == NULL) throw soap::base::APIError("Kernel file not open");
+    if (i0 < 0 || i1 > n || i0 > i1) throw soap::base::OutOfRange(
+        "Rows " + lexical_cast<std::string>(i0, "") + ":"
+        + lexical_cast<std::string>(i1, ""));
+    output.resize(i1-i0, n, false);
+    for (int i=i0; i<i1; ++i) {
+        for (int j=0; j<i; ++j) output(i-i0, j) = this->at(j, i);
+        dtype_t *row = &this->at(i, i);
+        for (int j=i; j<n; ++j) output(i-i0, j) = row[j-i];
+    }
+}
+
+boost::python::object KernelFile::readRowsNumpy(int i0, int i1, std::string np_dtype) {
+    soap::linalg::numpy_converter npc(np_dtype.c_str());
+    matrix_t output;
+    this->readRows(i0, i1, output);
+    return npc.ublas_to_numpy<dtype_t>(output);
+}
+
+void KernelFile::registerPython() {
+    using namespace boost::python;
+    void (KernelFile::*openExisting)(std::string) = &KernelFile::open;
+    class_<KernelFile, KernelFile*>("KernelFile", init<>())
+        .def(init<std::string>())
+        .add_property("size", &KernelFile::size)
+        .add_property("tile_size", &KernelFile::getTileSize)
+        .add_property("n_tiles", &KernelFile::getNumberOfTiles)
+        .add_property("n_tiles_done", &KernelFile::countTilesDone)
+        .def("__len__", &KernelFile::size)
+        .def("open", openExisting)
+        .def("close", &KernelFile::close)
+        .def("readRows", &KernelFile::readRowsNumpy);
+}
+
+}
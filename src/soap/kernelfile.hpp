@@ -0,0 +1,72 @@
+#ifndef _SOAP_KERNELFILE_HPP
+#define _SOAP_KERNELFILE_HPP
+
+#include <stdint.h>
+#include <boost/numeric/ublas/matrix.hpp>
+
+#include "soap/types.hpp"
+#include "soap/base/exceptions.hpp"
+
+namespace soap {
+
+namespace ub = boost::numeric::ublas;
+
+// Symmetric n x n kernel matrix stored out-of-core in a memory-mapped file,
+// packed upper-triangular (row-major, j >= i). The matrix is filled in tiles
+// of tile_size x tile_size structures: Each tile (ti <= tj) has a completion
+// flag that is set only after all its entries have been written and flushed
+// to disk, such that an interrupted evaluation (also by a crash of the node)
+// can be resumed by skipping completed tiles.
+//
+// Layout: header_t | flags (n_tiles*n_tiles bytes, padded to 8) | values
+class KernelFile
+{
+  public:
+    typedef double dtype_t;
+    typedef ub::matrix<dtype_t> matrix_t;
+    struct header_t
+    {
+        char magic[8];
+        int64_t n;
+        int64_t tile_size;
+        int64_t n_tiles;
+    };
+    KernelFile();
+    KernelFile(std::string filename);
+    ~KernelFile();
+    void open(std::string filename, int n, int tile_size);
+    void open(std::string filename);
+    void close();
+    void sync();
+    bool isOpen() { return data != NULL; }
+    int size() { return n; }
+    int getTileSize() { return tile_size; }
+    int getNumberOfTiles() { return n_tiles; }
+    int64_t countTilesDone();
+    bool isTileDone(int ti, int tj) { return flags[int64_t(ti)*n_tiles+tj] != 0; }
+    void setTileDone(int ti, int tj);
+    // Entry (i,j), requires j >= i
+    dtype_t &at(int i, int j) {
+        return values[int64_t(i)*n - int64_t(i)*(i-1)/2 + (j-i)];
+    }
+    dtype_t get(int i, int j) { return (j >= i) ? this->at(i,j) : this->at(j,i); }
+    void readRows(int i0, int i1, matrix_t &output);
+    boost::python::object readRowsNumpy(int i0, int i1, std::string np_dtype);
+    static void registerPython();
+  private:
+    void map(std::string filename, bool create, bool writable);
+    void syncTile(int ti, int tj);
+    std::string filename;
+    int fd;
+    char *data;
+    int64_t n_bytes;
+    unsigned char *flags;
+    dtype_t *values;
+    int n;
+    int tile_size;
+    int n_tiles;
+};
+
+}
+
+#endif /* _SOAP_KERNELFILE_HPP */
@@ -156,5 +156,26 @@ void linalg_invert(ub::matrix<double> &A, ub::matrix<double> &V){
     // return (status != 0);
 }
 
+bool linalg_eigenvalues(ub::vector<double> &E, ub::matrix<double> &V){
+    // eigenvalues (ascending) and eigenvectors of a symmetric matrix
+    // using gsl: on input V holds the matrix, on output the eigenvectors
+    // (as columns)
+    const size_t N = V.size1();
+    E.resize(N, false);
+    if (N == 0) return true;
+    gsl_error_handler_t *handler = gsl_set_error_handler_off();
+    // make copy of V as the input is destroyed by GSL
+    ub::matrix<double> work = V;
+    gsl_matrix_view A_view = gsl_matrix_view_array(&work(0,0), N, N);
+    gsl_matrix_view V_view = gsl_matrix_view_array(&V(0,0), N, N);
+    gsl_vector_view E_view = gsl_vector_view_array(&E(0), N);
+    gsl_eigen_symmv_workspace *w = gsl_eigen_symmv_alloc(N);
+    int status = gsl_eigen_symmv(&A_view.matrix, &E_view.vector, &V_view.matrix, w);
+    gsl_eigen_symmv_sort(&E_view.vector, &V_view.matrix, GSL_EIGEN_SORT_VAL_ASC);
+    gsl_eigen_symmv_free(w);
+    gsl_set_error_handler(handler);
+    return (status == 0);
+}
+
 
 }}
@@ -296,5 +296,23 @@ void linalg_invert( ub::matrix<double> &A, ub::matrix<double> &V){
     info = LAPACKE_dgesv( LAPACK_ROW_MAJOR, n, n, pwork , n, ipiv, pV, n );
 }
 
+bool linalg_eigenvalues( ub::vector<double> &E, ub::matrix<double> &V ){
+    // eigenvalues (ascending) and eigenvectors of a symmetric matrix
+    // using MKL: on input V holds the matrix, on output the eigenvectors
+    // (as columns)
+    MKL_INT n = V.size1();
+    MKL_INT info;
+    E.resize(n, false);
+    if (n == 0) return true;
+
+    // pointers for LAPACK
+    double * pV = const_cast<double*>(&V.data().begin()[0]);
+    double * pE = const_cast<double*>(&E.data()[0]);
+
+    // solve
+    info = LAPACKE_dsyev( LAPACK_ROW_MAJOR, 'V', 'U', n, pV, n, pE );
+    return (info == 0);
+}
+
 
 }}
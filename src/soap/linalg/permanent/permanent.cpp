@@ -13,6 +13,7 @@
 #include <cmath>
 #include <iostream>
 #include "../numpy.hpp"
+#include "../sinkhorn.hpp"
 // Array access macros.
 
 #define SM(x0, x1) (*(npy_double*) (( (char*) PyArray_DATA(matrix) + \
@@ -134,40 +135,17 @@ static npy_double _shmatch(PyArrayObject* matrix, PyFloatObject *gamma, PyFloatO
 {
     int nx = (int) PyArray_DIM(matrix, 0);
     int ny = (int) PyArray_DIM(matrix, 1);
-    std::vector<double> u(nx), ou(nx), v(ny);
-    double ax = 1.0/nx, ay=1.0/ny;
-    Matrix<double> Kg(nx,ny);
-    for (int i=0; i<nx; ++i) u[i]=1.0;
-    for (int i=0; i<ny; ++i) v[i]=1.0;
-    double lambda=1.0/PyFloat_AS_DOUBLE(gamma), terr=PyFloat_AS_DOUBLE(eps)*PyFloat_AS_DOUBLE(eps), derr;
+    std::vector<double> K(nx*ny), P(nx*ny);
+    for (int i=0; i<nx; ++i) for (int j=0; j<ny; ++j) K[i*ny+j]=SM(i,j);
     
-    for (int i=0; i<nx; ++i) for (int j=0; j<ny; ++j) Kg(i,j)=std::exp(-(1-SM(i,j))*lambda);
+    soap::linalg::SinkhornOptions options;
+    options.gamma = PyFloat_AS_DOUBLE(gamma);
+    options.tol = PyFloat_AS_DOUBLE(eps)*PyFloat_AS_DOUBLE(eps);
+    soap::linalg::SinkhornSolver solver(options);
+    solver.solve(&K[0], nx, ny, &P[0]);
     
-    do 
-    {
-        // u<-1.0/Kg.v
-        for (int i=0; i<nx; ++i) { ou[i]=u[i]; u[i]=0.0; }            
-        for (int i=0; i<nx; ++i) for (int j=0; j<ny; ++j) u[i]+=Kg(i,j)*v[j];
-        // at this point we can compute how far off unity we are
-        derr = 0.0;
-        for (int i=0; i<nx; ++i) derr+=(ax-ou[i]*u[i])*(ax-ou[i]*u[i]);        
-        for (int i=0; i<nx; ++i) u[i]=ax/u[i];
-        
-        // v<-1.0/Kg.u
-        for (int i=0; i<ny; ++i) v[i]=0.0; 
-        for (int i=0; i<ny; ++i) for (int j=0; j<nx; ++j) v[i]+=Kg(j,i)*u[j];
-        for (int i=0; i<ny; ++i) v[i]=ay/v[i];
-        //std::cerr<<derr<<"\n";
-                
-    } while (derr>terr);
-    
-    double rval=0, rrow; 
-    for (int i=0; i<nx; ++i) 
-    {
-       rrow=0;
-       for (int j=0; j<ny; ++j) rrow+=Kg(i,j)*SM(i,j)*v[j];
-       rval+=u[i]*rrow;
-    }   
+    double rval=0; 
+    for (int i=0; i<nx*ny; ++i) rval+=P[i]*K[i];
     //std::cerr<<"regmatch "<< rval/n <<"\n";
     return rval;
 }
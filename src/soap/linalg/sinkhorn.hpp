@@ -0,0 +1,297 @@
+#ifndef _SOAP_LINALG_SINKHORN_HPP
+#define	_SOAP_LINALG_SINKHORN_HPP
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Regularised best-match (Sinkhorn) engine shared by the rematch top kernel,
+// the external smooth_match and the permanent module. The solver operates on
+// a row-major nx x ny kernel matrix K with entries in [-1,1] and returns the
+// transport matrix P with uniform marginals 1/nx, 1/ny that maximises
+// sum_ij P_ij K_ij - gamma*sum_ij P_ij (log P_ij - 1).
+//
+// Numerically, the iteration is the standard u <- a/(Kg.v), v <- b/(Kg^T.u)
+// scaling with Kg = exp(-(1-K)/gamma), including optional successive
+// overrelaxation (omega). In contrast to the plain iteration, the scalings are
+// periodically absorbed into log-domain potentials f, g (in units of 1-K),
+// such that Kg_ij = exp((f_i + g_j - (1-K_ij))/gamma) never under- or
+// overflows, even for very small gamma. Rows/columns that underflow
+// nevertheless are recovered by a log-sum-exp step. Optionally, the target
+// temperature is approached by epsilon scaling: gamma_start,
+// gamma_start*gamma_scaling, ... gamma, with the potentials of one stage
+// (converged to sqrt(tol)) seeding the next. This pays off for small gamma,
+// where the plain iteration converges slowly. The potentials can also be
+// passed in and out to warm-start related problems.
+//
+// Convergence is measured as in the original loops, that is, as the squared
+// deviation of the row marginals from 1/nx, sum_i (1/nx - u_i (Kg.v)_i)^2.
+
+namespace soap { namespace linalg {
+
+struct SinkhornOptions
+{
+    SinkhornOptions() : gamma(0.05), tol(1e-6), max_iter(100000), omega(1.0),
+        gamma_start(0.0), gamma_scaling(0.5), absorb_threshold(1e+30) {;}
+    double gamma;            // Target temperature
+    double tol;              // Tolerance on the squared row-marginal error
+    int max_iter;            // Iteration cap, summed over all temperature stages
+    double omega;            // Mixing factor, successive overrelaxation
+    double gamma_start;      // Epsilon scaling: initial temperature (<= gamma: off)
+    double gamma_scaling;    // Epsilon scaling: reduction factor per stage
+    double absorb_threshold; // Scalings beyond this are absorbed into f, g
+};
+
+struct SinkhornInfo
+{
+    SinkhornInfo() : converged(false), n_iter(0), n_stages(0), n_absorb(0),
+        err(0.) {;}
+    bool converged;          // Reached tol at the target temperature
+    int n_iter;              // Total number of iterations
+    int n_stages;            // Number of temperature stages
+    int n_absorb;            // Number of absorption steps
+    double err;              // Final squared row-marginal error
+};
+
+class SinkhornSolver
+{
+  public:
+    SinkhornSolver(const SinkhornOptions &options) : _options(options) {;}
+    const SinkhornOptions &getOptions() { return _options; }
+    // Computes P (nx x ny, row-major). f (nx) and g (ny) receive the
+    // potentials, and, if warm_start, are used as the initial guess.
+    SinkhornInfo solve(const double *K, int nx, int ny, double *P,
+            double *f, double *g, bool warm_start) {
+        SinkhornInfo info;
+        if (nx <= 0 || ny <= 0) {
+            info.converged = true;
+            return info;
+        }
+        _nx = nx;
+        _ny = ny;
+        _K = K;
+        _f = f;
+        _g = g;
+        _Kt.resize(nx*ny);
+        _u.resize(nx);
+        _v.resize(ny);
+        _r.resize(nx);
+        _c.resize(ny);
+        if (!warm_start) {
+            for (int i=0; i<nx; ++i) f[i] = 0.;
+            for (int j=0; j<ny; ++j) g[j] = 0.;
+        }
+        for (int i=0; i<nx; ++i) _u[i] = 1.;
+        for (int j=0; j<ny; ++j) _v[j] = 1.;
+        // Temperature stages: warm-started problems are assumed to be
+        // close enough to the solution to start at the target directly
+        double gamma = _options.gamma;
+        double gamma_s = gamma;
+        if (!warm_start && _options.gamma_start > gamma
+                && _options.gamma_scaling > 0. && _options.gamma_scaling < 1.) {
+            gamma_s = _options.gamma_start;
+        }
+        while (true) {
+            bool last = !(gamma_s > gamma);
+            info.n_stages += 1;
+            this->iterate(gamma_s, last ? _options.tol : std::sqrt(_options.tol), info);
+            if (last || info.n_iter >= _options.max_iter) break;
+            gamma_s *= _options.gamma_scaling;
+            if (gamma_s < gamma) gamma_s = gamma;
+        }
+        info.converged = (info.err < _options.tol) && !(_gamma > gamma);
+        // Transport matrix, potentials
+        for (int i=0; i<nx; ++i)
+            for (int j=0; j<ny; ++j)
+                P[i*ny+j] = _u[i]*_Kt[i*ny+j]*_v[j];
+        this->absorb();
+        return info;
+    }
+    SinkhornInfo solve(const double *K, int nx, int ny, double *P) {
+        _f_own.resize(nx);
+        _g_own.resize(ny);
+        return this->solve(K, nx, ny, P, &_f_own[0], &_g_own[0], false);
+    }
+  private:
+    void iterate(double gamma, double tol, SinkhornInfo &info) {
+        int nx = _nx;
+        int ny = _ny;
+        double ax = 1./nx;
+        double ay = 1./ny;
+        double omega = _options.omega;
+        double thr = _options.absorb_threshold;
+        // Scalings of the previous stage (if any) are absorbed at the
+        // temperature they were computed at, before switching to gamma
+        if (info.n_stages > 1) this->absorb();
+        _gamma = gamma;
+        this->rebuild();
+        while (info.n_iter < _options.max_iter) {
+            info.n_iter += 1;
+            // Update u
+            bool ok = true;
+            for (int i=0; i<nx; ++i) {
+                double ri = 0.;
+                const double *kt = &_Kt[i*ny];
+                for (int j=0; j<ny; ++j) ri += kt[j]*_v[j];
+                _r[i] = ri;
+                if (!(ri > 0.) || !(ri < thr)) ok = false;
+            }
+            if (!ok) {
+                info.n_absorb += 1;
+                info.err = this->logStep();
+                if (info.err < tol) break;
+                continue;
+            }
+            double err = 0.;
+            for (int i=0; i<nx; ++i) err += std::pow(ax-_r[i]*_u[i], 2);
+            for (int i=0; i<nx; ++i) _u[i] = omega*ax/_r[i] + (1-omega)*_u[i];
+            // Update v
+            for (int j=0; j<ny; ++j) _c[j] = 0.;
+            for (int i=0; i<nx; ++i) {
+                double ui = _u[i];
+                const double *kt = &_Kt[i*ny];
+                for (int j=0; j<ny; ++j) _c[j] += kt[j]*ui;
+            }
+            for (int j=0; j<ny; ++j) {
+                if (!(_c[j] > 0.) || !(_c[j] < thr)) ok = false;
+            }
+            if (!ok) {
+                info.n_absorb += 1;
+                info.err = this->logStep();
+                if (info.err < tol) break;
+                continue;
+            }
+            for (int j=0; j<ny; ++j) _v[j] = omega*ay/_c[j] + (1-omega)*_v[j];
+            info.err = err;
+            if (err < tol) break;
+            // Absorb large scalings into the potentials
+            bool large = false;
+            for (int i=0; i<nx; ++i) if (!(_u[i] < thr && _u[i] > 1./thr)) large = true;
+            for (int j=0; j<ny; ++j) if (!(_v[j] < thr && _v[j] > 1./thr)) large = true;
+            if (large) {
+                info.n_absorb += 1;
+                this->absorb();
+                this->rebuild();
+            }
+        }
+    }
+    // Kt_ij = exp((f_i + g_j - (1-K_ij))/gamma), u = v = 1
+    void rebuild() {
+        double lambda = 1./_gamma;
+        for (int i=0; i<_nx; ++i) {
+            double fi = _f[i];
+            const double *k = _K + i*_ny;
+            double *kt = &_Kt[i*_ny];
+            for (int j=0; j<_ny; ++j)
+                kt[j] = std::exp((fi + _g[j] - (1.-k[j]))*lambda);
+        }
+        for (int i=0; i<_nx; ++i) _u[i] = 1.;
+        for (int j=0; j<_ny; ++j) _v[j] = 1.;
+    }
+    // f <- f + gamma log u, g <- g + gamma log v
+    void absorb() {
+        for (int i=0; i<_nx; ++i) _f[i] += _gamma*std::log(_u[i]);
+        for (int j=0; j<_ny; ++j) _g[j] += _gamma*std::log(_v[j]);
+        for (int i=0; i<_nx; ++i) _u[i] = 1.;
+        for (int j=0; j<_ny; ++j) _v[j] = 1.;
+    }
+    // Full Sinkhorn step in the log domain, returns the row-marginal error
+    // prior to the update
+    double logStep() {
+        int nx = _nx;
+        int ny = _ny;
+        double lambda = 1./_gamma;
+        double inf = std::numeric_limits<double>::infinity();
+        double log_ax = -std::log(double(nx));
+        double log_ay = -std::log(double(ny));
+        for (int i=0; i<nx; ++i)
+            if (_u[i] > 0. && _u[i] < inf) _f[i] += _gamma*std::log(_u[i]);
+        for (int j=0; j<ny; ++j)
+            if (_v[j] > 0. && _v[j] < inf) _g[j] += _gamma*std::log(_v[j]);
+        // f_i = gamma*(log a - logsumexp_j (g_j - (1-K_ij))/gamma)
+        double err = 0.;
+        for (int i=0; i<nx; ++i) {
+            const double *k = _K + i*ny;
+            double *s = &_Kt[i*ny];
+            double smax = -inf;
+            for (int j=0; j<ny; ++j) {
+                s[j] = (_g[j] - (1.-k[j]))*lambda;
+                if (s[j] > smax) smax = s[j];
+            }
+            double sum = 0.;
+            for (int j=0; j<ny; ++j) sum += std::exp(s[j]-smax);
+            double lse = smax + std::log(sum);
+            err += std::pow(1./nx - std::exp(_f[i]*lambda + lse), 2);
+            _f[i] = _gamma*(log_ax - lse);
+        }
+        // g_j = gamma*(log b - logsumexp_i (f_i - (1-K_ij))/gamma)
+        for (int j=0; j<ny; ++j) _c[j] = -inf;
+        for (int i=0; i<nx; ++i) {
+            const double *k = _K + i*ny;
+            double *s = &_Kt[i*ny];
+            for (int j=0; j<ny; ++j) {
+                s[j] = (_f[i] - (1.-k[j]))*lambda;
+                if (s[j] > _c[j]) _c[j] = s[j];
+            }
+        }
+        _s.assign(ny, 0.);
+        for (int i=0; i<nx; ++i) {
+            const double *s = &_Kt[i*ny];
+            for (int j=0; j<ny; ++j) _s[j] += std::exp(s[j] - _c[j]);
+        }
+        for (int j=0; j<ny; ++j) _g[j] = _gamma*(log_ay - _c[j] - std::log(_s[j]));
+        this->rebuild();
+        return err;
+    }
+    SinkhornOptions _options;
+    int _nx;
+    int _ny;
+    double _gamma;
+    const double *_K;
+    double *_f;
+    double *_g;
+    std::vector<double> _Kt;
+    std::vector<double> _u;
+    std::vector<double> _v;
+    std::vector<double> _r;
+    std::vector<double> _c;
+    std::vector<double> _s;
+    std::vector<double> _f_own;
+    std::vector<double> _g_own;
+};
+
+// Solves a batch of independent (typically small) problems K[b] (nx[b] x ny[b])
+// with one solver per thread, n_threads <= 0 uses all available threads
+inline void sinkhorn_batch(
+        int n_problems,
+        const double *const *K,
+        const int *nx,
+        const int *ny,
+        double *const *P,
+        const SinkhornOptions &options,
+        SinkhornInfo *info,
+        int n_threads) {
+    #ifdef _OPENMP
+    if (n_threads <= 0) n_threads = omp_get_max_threads();
+    if (n_threads > n_problems) n_threads = n_problems;
+    if (n_threads < 1) n_threads = 1;
+    #else
+    n_threads = 1;
+    #endif
+    #pragma omp parallel num_threads(n_threads)
+    {
+        SinkhornSolver solver(options);
+        #pragma omp for schedule(dynamic)
+        for (int b=0; b<n_problems; ++b) {
+            SinkhornInfo info_b = solver.solve(K[b], nx[b], ny[b], P[b]);
+            if (info) info[b] = info_b;
+        }
+    }
+}
+
+}}
+
+#endif
@@ -0,0 +1,286 @@
+#include <algorithm>
+#include <limits>
+#include <random>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "soap/sampling.hpp"
+#include "soap/linalg/operations.hpp"
+
+namespace soap {
+
+DMapSampler::DMapSampler() : pinned_set(NULL), power(1.0), n_threads(0),
+        eps(1e-10) {
+    ;
+}
+
+DMapSampler::DMapSampler(double power_arg, int n_threads_arg) : pinned_set(NULL),
+        power(power_arg), n_threads(n_threads_arg), eps(1e-10) {
+    ;
+}
+
+DMapSampler::~DMapSampler() {
+    this->unpinMatrices();
+}
+
+void DMapSampler::unpinMatrices() {
+    if (pinned_set) {
+        for (int s=0; s<int(matrices.size()); ++s) pinned_set->unpin(s);
+        pinned_set = NULL;
+    }
+}
+
+void DMapSampler::setMatrix(DMapMatrix *dmm) {
+    this->unpinMatrices();
+    matrices.clear();
+    rows.clear();
+    matrices.push_back(dmm);
+    for (int r=0; r<dmm->rows(); ++r) rows.push_back(row_t(0, r));
+}
+
+void DMapSampler::setMatrixSet(DMapMatrixSet *dset) {
+    // All matrices are kept, hence pinned if the set is lazy
+    this->unpinMatrices();
+    matrices.clear();
+    rows.clear();
+    pinned_set = dset;
+    for (int s=0; s<dset->size(); ++s) {
+        matrices.push_back(dset->pin(s));
+        for (int r=0; r<matrices[s]->rows(); ++r) rows.push_back(row_t(s, r));
+    }
+}
+
+DMapSampler::row_t DMapSampler::locate(int idx) {
+    if (idx < 0 || idx >= int(rows.size())) throw soap::base::OutOfRange(
+        "Row " + lexical_cast<std::string>(idx, ""));
+    return rows[idx];
+}
+
+boost::python::tuple DMapSampler::locatePython(int idx) {
+    row_t row = this->locate(idx);
+    return boost::python::make_tuple(row.first, row.second);
+}
+
+double DMapSampler::kernel(int i, int j) {
+    DMapMatrix *a = matrices[rows[i].first];
+    DMapMatrix *b = matrices[rows[j].first];
+    double k = (a->isPacked() && b->isPacked()) ?
+        a->dotPacked(rows[i].second, b, rows[j].second) :
+        a->getRow(rows[i].second)->dot(b->getRow(rows[j].second));
+    return (power == 1.0) ? k : std::pow(k, power);
+}
+
+void DMapSampler::evaluateColumn(std::vector<int> &idcs, int i,
+        ub::vector<double> &output) {
+    output.resize(idcs.size(), false);
+    for (int a=0; a<int(idcs.size()); ++a) output(a) = this->kernel(i, idcs[a]);
+}
+
+std::vector<int> DMapSampler::selectFPS(int n_select, int first) {
+    // Selected indices in the order of selection, the squared distances at
+    // selection time (decreasing) are kept in fps_d2
+    int n = rows.size();
+    n_select = std::max(0, std::min(n_select, n));
+    std::vector<int> selected;
+    fps_d2.clear();
+    if (n_select == 0) return selected;
+    if (first < 0 || first >= n) throw soap::base::OutOfRange(
+        "First point " + lexical_cast<std::string>(first, ""));
+    #ifdef _OPENMP
+    int n_threads_eff = (n_threads <= 0) ? omp_get_max_threads() : n_threads;
+    if (n_threads_eff < 1) n_threads_eff = 1;
+    #endif
+    std::vector<double> k_self(n);
+    #pragma omp parallel for num_threads(n_threads_eff) schedule(static)
+    for (int i=0; i<n; ++i) k_self[i] = this->kernel(i, i);
+    std::vector<double> d2(n, std::numeric_limits<double>::infinity());
+    int next = first;
+    for (int k=0; k<n_select; ++k) {
+        selected.push_back(next);
+        fps_d2.push_back(d2[next]);
+        GLOG() << "\r" << "FPS " << k+1 << "/" << n_select << std::flush;
+        if (k+1 == n_select) break;
+        int curr = next;
+        double d2_max = -1.0;
+        #pragma omp parallel num_threads(n_threads_eff)
+        {
+            double d2_max_thread = -1.0;
+            int next_thread = -1;
+            #pragma omp for schedule(static)
+            for (int i=0; i<n; ++i) {
+                if (d2[i] > 0.0) {
+                    double d2_i = k_self[i] + k_self[curr] - 2*this->kernel(i, curr);
+                    if (d2_i < d2[i]) d2[i] = d2_i;
+                }
+                if (d2[i] > d2_max_thread) {
+                    d2_max_thread = d2[i];
+                    next_thread = i;
+                }
+            }
+            // Ties are resolved towards the lower index, independent of
+            // the number of threads
+            #pragma omp critical
+            {
+                if (d2_max_thread > d2_max ||
+                        (d2_max_thread == d2_max && next_thread < next)) {
+                    d2_max = d2_max_thread;
+                    next = next_thread;
+                }
+            }
+        }
+    }
+    GLOG() << std::endl;
+    return selected;
+}
+
+std::vector<int> DMapSampler::selectCUR(int n_select, int rank, int seed) {
+    // Presample P (rank points, uniform), W = K(P,P) = V.E.V^T and the
+    // Nystrom features z_i = E^-1/2.V^T.k(P,i), such that K ~ Z.Z^T. With
+    // G = Z^T.Z = Vg.S.Vg^T, the ridge leverage scores are
+    // l_i = sum_q (Vg^T.z_i)_q^2/(S_q + lambda). The first pass over the
+    // rows accumulates G, the second evaluates the scores. The selection
+    // samples without replacement with probabilities ~ l_i (exponential
+    // keys u_i^(1/l_i)), rows with zero score are drawn uniformly last.
+    int n = rows.size();
+    n_select = std::max(0, std::min(n_select, n));
+    if (rank <= 0) rank = n_select;
+    rank = std::min(rank, n);
+    std::vector<int> selected;
+    cur_scores.assign(n, 0.0);
+    if (n_select == 0) return selected;
+    std::mt19937 engine(seed);
+    std::vector<int> presample(n);
+    for (int i=0; i<n; ++i) presample[i] = i;
+    for (int a=0; a<rank; ++a) {
+        int r = a + engine() % (n-a);
+        std::swap(presample[a], presample[r]);
+    }
+    presample.resize(rank);
+    #ifdef _OPENMP
+    int n_threads_eff = (n_threads <= 0) ? omp_get_max_threads() : n_threads;
+    if (n_threads_eff < 1) n_threads_eff = 1;
+    #endif
+    // Presample kernel and Nystrom projection U = V.E^-1/2 (rank x q)
+    matrix_t W(rank, rank);
+    #pragma omp parallel for num_threads(n_threads_eff) schedule(dynamic)
+    for (int a=0; a<rank; ++a)
+        for (int b=0; b<=a; ++b)
+            W(a,b) = W(b,a) = this->kernel(presample[a], presample[b]);
+    ub::vector<double> E;
+    if (!soap::linalg::linalg_eigenvalues(E, W))
+        throw soap::base::SanityCheckFailed("Eigendecomposition of presample kernel failed");
+    std::vector<int> keep;
+    double lambda_max = (rank > 0) ? E(rank-1) : 0.0;
+    for (int a=0; a<rank; ++a) {
+        if (E(a) > eps*lambda_max && E(a) > 0.0) keep.push_back(a);
+    }
+    int q = keep.size();
+    matrix_t U(rank, q);
+    for (int c=0; c<q; ++c) {
+        double s = 1./std::sqrt(E(keep[c]));
+        for (int a=0; a<rank; ++a) U(a,c) = W(a,keep[c])*s;
+    }
+    // Pass 1: G = sum_i z_i.z_i^T
+    GLOG() << "CUR: Leverage scores, rank " << q << std::endl;
+    matrix_t G = ub::zero_matrix<double>(q, q);
+    #pragma omp parallel num_threads(n_threads_eff)
+    {
+        matrix_t G_thread = ub::zero_matrix<double>(q, q);
+        ub::vector<double> k_col;
+        ub::vector<double> z;
+        #pragma omp for schedule(static)
+        for (int i=0; i<n; ++i) {
+            this->evaluateColumn(presample, i, k_col);
+            z = ub::prod(k_col, U);
+            for (int c=0; c<q; ++c)
+                for (int d=0; d<=c; ++d) G_thread(c,d) += z(c)*z(d);
+        }
+        #pragma omp critical
+        {
+            G += G_thread;
+        }
+    }
+    for (int c=0; c<q; ++c)
+        for (int d=0; d<c; ++d) G(d,c) = G(c,d);
+    double trace = 0.0;
+    for (int c=0; c<q; ++c) trace += G(c,c);
+    double lambda = 1e-3*trace/std::max(n, 1);
+    ub::vector<double> S;
+    if (q > 0 && !soap::linalg::linalg_eigenvalues(S, G))
+        throw soap::base::SanityCheckFailed("Eigendecomposition failed");
+    matrix_t B(rank, q);
+    if (q > 0) B = ub::prod(U, G);
+    // Pass 2: Scores
+    #pragma omp parallel num_threads(n_threads_eff)
+    {
+        ub::vector<double> k_col;
+        ub::vector<double> y;
+        #pragma omp for schedule(static)
+        for (int i=0; i<n; ++i) {
+            this->evaluateColumn(presample, i, k_col);
+            y = ub::prod(k_col, B);
+            double l = 0.0;
+            for (int c=0; c<q; ++c) l += y(c)*y(c)/(S(c) + lambda);
+            cur_scores[i] = l;
+        }
+    }
+    // Weighted sampling without replacement
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::vector<std::pair<std::pair<int, double>, int> > keys(n);
+    for (int i=0; i<n; ++i) {
+        double u = std::max(uniform(engine), std::numeric_limits<double>::min());
+        if (cur_scores[i] > 0.0)
+            keys[i] = std::make_pair(std::make_pair(1, std::log(u)/cur_scores[i]), i);
+        else
+            keys[i] = std::make_pair(std::make_pair(0, u), i);
+    }
+    std::partial_sort(keys.begin(), keys.begin()+n_select, keys.end(),
+        std::greater<std::pair<std::pair<int, double>, int> >());
+    for (int k=0; k<n_select; ++k) selected.push_back(keys[k].second);
+    std::sort(selected.begin(), selected.end());
+    return selected;
+}
+
+boost::python::list DMapSampler::selectFPSPython(int n_select, int first) {
+    std::vector<int> selected = this->selectFPS(n_select, first);
+    boost::python::list res;
+    for (int i : selected) res.append(i);
+    return res;
+}
+
+boost::python::list DMapSampler::selectCURPython(int n_select, int rank, int seed) {
+    std::vector<int> selected = this->selectCUR(n_select, rank, seed);
+    boost::python::list res;
+    for (int i : selected) res.append(i);
+    return res;
+}
+
+boost::python::list DMapSampler::getDistancesPython() {
+    boost::python::list res;
+    for (double d2 : fps_d2) res.append(d2);
+    return res;
+}
+
+boost::python::list DMapSampler::getScoresPython() {
+    boost::python::list res;
+    for (double l : cur_scores) res.append(l);
+    return res;
+}
+
+void DMapSampler::registerPython() {
+    using namespace boost::python;
+    class_<DMapSampler, DMapSampler*>("DMapSampler", init<>())
+        .def(init<double, int>())
+        .def("__len__", &DMapSampler::size)
+        .add_property("distances", &DMapSampler::getDistancesPython)
+        .add_property("scores", &DMapSampler::getScoresPython)
+        .def("setMatrix", &DMapSampler::setMatrix, with_custodian_and_ward<1,2>())
+        .def("setMatrixSet", &DMapSampler::setMatrixSet, with_custodian_and_ward<1,2>())
+        .def("locate", &DMapSampler::locatePython)
+        .def("kernel", &DMapSampler::kernel)
+        .def("selectFPS", &DMapSampler::selectFPSPython)
+        .def("selectCUR", &DMapSampler::selectCURPython);
+}
+
+}
@@ -0,0 +1,57 @@
+#ifndef _SOAP_SAMPLING_HPP
+#define _SOAP_SAMPLING_HPP
+
+#include "soap/dmap.hpp"
+
+namespace soap {
+
+// Selection of sparse points among the rows (environments) of a DMapMatrix
+// or of all matrices in a DMapMatrixSet, based on the kernel
+// k_ij = (x_i.x_j)^power, with the dot product of DMap::dot (or
+// DMapMatrix::dotPacked if the matrices are packed). Kernel values are
+// evaluated on the fly, nothing of size N x N or N x n_select is stored:
+// "fps": Farthest-point sampling in d_ij^2 = k_ii + k_jj - 2 k_ij,
+//        O(N) memory, O(N*n_select) kernel evaluations
+// "cur": Sampling without replacement with probabilities given by the ridge
+//        leverage scores of a uniform Nystrom approximation of given rank r,
+//        O(N + r^2) memory, O(N*r) kernel evaluations (two passes)
+// Rows are addressed by their flat index, see locate(...) for the
+// (structure, row) pair in a DMapMatrixSet. The sampler does not own the
+// matrices, which have to be kept alive while it is used.
+class DMapSampler
+{
+  public:
+    typedef DMapMatrix::matrix_t matrix_t;
+    typedef std::pair<int, int> row_t; // (matrix index, row index)
+    DMapSampler();
+    DMapSampler(double power, int n_threads);
+    ~DMapSampler();
+    void setMatrix(DMapMatrix *dmm);
+    void setMatrixSet(DMapMatrixSet *dset);
+    int size() { return rows.size(); }
+    row_t locate(int idx);
+    boost::python::tuple locatePython(int idx);
+    double kernel(int i, int j);
+    std::vector<int> selectFPS(int n_select, int first);
+    std::vector<int> selectCUR(int n_select, int rank, int seed);
+    boost::python::list selectFPSPython(int n_select, int first);
+    boost::python::list selectCURPython(int n_select, int rank, int seed);
+    boost::python::list getDistancesPython();
+    boost::python::list getScoresPython();
+    static void registerPython();
+  private:
+    void evaluateColumn(std::vector<int> &idcs, int i, ub::vector<double> &output);
+    void unpinMatrices();
+    std::vector<DMapMatrix*> matrices;
+    DMapMatrixSet *pinned_set; // Matrices of a lazy set stay pinned until reset
+    std::vector<row_t> rows;
+    double power;
+    int n_threads; // <= 0: All available threads
+    double eps;    // Relative eigenvalue cutoff of the presample kernel
+    std::vector<double> fps_d2;     // Distances^2 at selection (last FPS)
+    std::vector<double> cur_scores; // Leverage scores (last CUR)
+};
+
+}
+
+#endif /* _SOAP_SAMPLING_HPP */
@@ -379,8 +379,9 @@ class PowerSpectrum(object):
         return self
     def exportSparse(self, coherent=False):
         return self.exportDMapMatrix(coherent=coherent)
-    def exportDMapMatrix(self, coherent=False):
+    def exportDMapMatrix(self, coherent=False, packed=False):
         dmap_mat = soap.DMapMatrix()
+        if packed: dmap_mat.pack()
         if coherent: dmap_mat.appendCoherent(self.spectrum)
         else: dmap_mat.append(self.spectrum)
         return dmap_mat
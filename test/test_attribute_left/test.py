@@ -59,6 +59,118 @@ def test_attribution_rematch(dset, options):
             assert_equal(KK_sum[j]-K[i,j], 0.0, 1e-6)
     log << log.endl
 
+def test_base_gemm(dset, options):
+    log << log.mg << "<test_base_gemm>" << log.flush
+    for filter in [False, True]:
+        K = []
+        for gemm in [False, True]:
+            kernel_options = soap.Options()
+            kernel_options.set("basekernel_type", "dot")
+            kernel_options.set("base_exponent", 3.)
+            kernel_options.set("base_filter", filter)
+            kernel_options.set("base_gemm", gemm)
+            kernel_options.set("topkernel_type", "average")
+            kernel = soap.Kernel(kernel_options)
+            K.append(kernel.evaluate(dset, dset, False, "float64"))
+        for i in range(len(dset)):
+            for j in range(len(dset)):
+                assert_equal(K[1][i,j]-K[0][i,j], 0.0, 1e-10)
+    log << log.endl
+
+def test_kernel_tiled(dset, options):
+    log << log.mg << "<test_kernel_tiled>" << log.flush
+    K = []
+    for n_threads, tile_size in [(1, 1000), (2, 1), (3, 2)]:
+        kernel_options = soap.Options()
+        kernel_options.set("basekernel_type", "dot")
+        kernel_options.set("base_exponent", 3.)
+        kernel_options.set("base_filter", False)
+        kernel_options.set("topkernel_type", "average")
+        kernel_options.set("kernel_n_threads", n_threads)
+        kernel_options.set("kernel_tile_size", tile_size)
+        kernel = soap.Kernel(kernel_options)
+        K.append(kernel.evaluate(dset, dset, False, "float64"))
+        K_sym = kernel.evaluate(dset, dset, True, "float64")
+        for i in range(len(dset)):
+            for j in range(len(dset)):
+                if j >= i: assert_equal(K_sym[i,j]-K[-1][i,j], 0.0, 1e-12)
+                else: assert_equal(K_sym[i,j], 0.0, 1e-12)
+    for k in range(1, len(K)):
+        assert_equal(np.max(np.abs(K[k]-K[0])), 0.0, 1e-12)
+    log << log.endl
+
+def test_kernel_dot_cache(dset, options):
+    log << log.mg << "<test_kernel_dot_cache>" << log.flush
+    combinations = []
+    for xi in [1., 2., 3.]:
+        for top in ["average", "rematch"]:
+            kernel_options = soap.Options()
+            kernel_options.set("basekernel_type", "dot")
+            kernel_options.set("base_exponent", xi)
+            kernel_options.set("base_filter", False)
+            kernel_options.set("topkernel_type", top)
+            kernel_options.set("rematch_gamma", 0.01)
+            kernel_options.set("rematch_eps", 1e-6)
+            kernel_options.set("rematch_omega", 1.0)
+            combinations.append(kernel_options)
+    cache = soap.KernelDotCache(combinations[0])
+    cache.compute(dset, dset, False)
+    K_sweep = cache.sweep(combinations, "float64")
+    for kernel_options, K_cache in zip(combinations, K_sweep):
+        kernel = soap.Kernel(kernel_options)
+        K = kernel.evaluate(dset, dset, False, "float64")
+        assert_equal(np.max(np.abs(K_cache-K)), 0.0, 1e-10)
+    log << log.endl
+
+def test_kernel_file(dset, options):
+    log << log.mg << "<test_kernel_file>" << log.flush
+    kernel_options = soap.Options()
+    kernel_options.set("basekernel_type", "dot")
+    kernel_options.set("base_exponent", 3.)
+    kernel_options.set("base_filter", False)
+    kernel_options.set("topkernel_type", "average")
+    kernel_options.set("kernel_tile_size", 2)
+    kernel = soap.Kernel(kernel_options)
+    K = kernel.evaluate(dset, dset, False, "float64")
+    filename = "kernel_file.bin"
+    if os.path.exists(filename): os.remove(filename)
+    kernel.evaluateFile(dset, filename)
+    kernel.evaluateFile(dset, filename) # Resumes, nothing left to do
+    kfile = soap.KernelFile(filename)
+    assert kfile.n_tiles_done == kfile.n_tiles*(kfile.n_tiles+1)/2
+    for i0 in range(0, len(dset), 3):
+        i1 = min(i0+3, len(dset))
+        K_rows = kfile.readRows(i0, i1, "float64")
+        assert_equal(np.max(np.abs(K_rows-K[i0:i1])), 0.0, 1e-12)
+    kfile.close()
+    os.remove(filename)
+    log << log.endl
+
+def test_kernel_nystrom(dset, options):
+    log << log.mg << "<test_kernel_nystrom>" << log.flush
+    kernel_options = soap.Options()
+    kernel_options.set("basekernel_type", "dot")
+    kernel_options.set("base_exponent", 3.)
+    kernel_options.set("base_filter", False)
+    kernel_options.set("topkernel_type", "average")
+    kernel = soap.Kernel(kernel_options)
+    K = kernel.evaluate(dset, dset, False, "float64")
+    # All structures as landmarks: Exact up to the eigenvalue cutoff
+    L, C, W = kernel.evaluateNystrom(dset, dset, "float64")
+    assert_equal(np.max(np.abs(C-K)), 0.0, 1e-12)
+    assert_equal(np.max(np.abs(L.dot(L.T)-K)), 0.0, 1e-4)
+    n_landmarks = len(dset)/2
+    for method in ["uniform", "fps", "leverage"]:
+        idcs = kernel.selectLandmarks(dset, n_landmarks, method, 7)
+        assert len(set(idcs)) == n_landmarks
+        landmarks = dset[idcs]
+        L, C, W = kernel.evaluateNystrom(dset, landmarks, "float64")
+        assert L.shape[0] == len(dset) and L.shape[1] <= n_landmarks
+        assert_equal(np.max(np.abs(C-K[:,idcs])), 0.0, 1e-12)
+        # Reproduces the landmark columns
+        assert_equal(np.max(np.abs(L.dot(L.T)[:,idcs]-K[:,idcs])), 0.0, 1e-4)
+    log << log.endl
+
 def test_reduction_matrix_average(options):
     log << log.mg << "<test_reduction_matrix_average>" << log.flush
     kernel_options = soap.Options()
@@ -101,6 +213,11 @@ if __name__ == "__main__":
     dset = evaluate_soap(configs, options)
     test_attribution_average(dset, options)
     test_attribution_rematch(dset, options)
+    test_base_gemm(dset, options)
+    test_kernel_tiled(dset, options)
+    test_kernel_dot_cache(dset, options)
+    test_kernel_file(dset, options)
+    test_kernel_nystrom(dset, options)
     test_reduction_matrix_average(options)
     test_reduction_matrix_rematch(options)
     log << "All passed." << log.endl
@@ -84,4 +84,439 @@ def test_dmap_convolve():
     log << log.endl
     log << log.mg << "All passed" << log.endl
 
+def test_dmap_packed():
+    log << log.mg << "<test_dmap_packed>" << log.endl
+    configs = soap.tools.io.read('structures.xyz')
+    soap_options = configure_default()
+    kernel_options = soap.Options()
+    kernel_options.set("basekernel_type", "dot")
+    kernel_options.set("base_exponent", 3.)
+    kernel_options.set("base_filter", False)
+    kernel_options.set("topkernel_type", "average")
+    kernel = soap.Kernel(kernel_options)
+    for idx, config in enumerate(configs):
+        spec = soap.soapy.PowerSpectrum(config, soap_options, "S%d" % idx)
+        soap.toggle_logger()
+        dmap_x = spec.exportDMapMatrix()
+        dmap_p = spec.exportDMapMatrix(packed=True)
+        dmap_q = soap.DMapMatrix()
+        dmap_q.pack()
+        dmap_q.appendCoherent(spec.spectrum)
+        dmap_q.convolve(9, 6)
+        assert dmap_p.packed and dmap_q.packed and not dmap_x.packed
+        kxx = dmap_x.dot(dmap_x, "float64")
+        kpp = dmap_p.dot(dmap_p, "float64")
+        kqq = dmap_q.dot(dmap_q, "float64")
+        kpx = dmap_p.dot(dmap_x, "float64")
+        assert_zero(np.max(np.abs(kxx-kpp)))
+        assert_zero(np.max(np.abs(kxx-kqq)))
+        assert_zero(np.max(np.abs(kxx-kpx)))
+        assert_zero(np.max(np.abs(
+            dmap_x.dotFilter(dmap_x, "float64")-dmap_p.dotFilter(dmap_p, "float64"))))
+        # Rows modified after packing: Kernels (stale rows fall back to the
+        # row DMaps) and dot (repacks) see the new values
+        for dmap in [ dmap_x, dmap_p ]:
+            dmap[0].multiply(2.)
+            dmap[len(dmap)-1].normalize()
+        assert_zero(np.abs(kernel.evaluate(dmap_x, dmap_x) 
+            - kernel.evaluate(dmap_p, dmap_p)))
+        kxx = dmap_x.dot(dmap_x, "float64")
+        assert_zero(np.max(np.abs(kxx-dmap_p.dot(dmap_p, "float64"))))
+        dmap_p.unpack()
+        assert_zero(np.max(np.abs(kxx-dmap_p.dot(dmap_p, "float64"))))
+        soap.toggle_logger()
+        if idx == 10: break
+    log << log.endl
+    log << log.mg << "All passed" << log.endl
+
+def test_hnsw():
+    log << log.mg << "<test_hnsw>" << log.endl
+    configs = soap.tools.io.read('structures.xyz')
+    soap_options = configure_default()
+    index = soap.HnswIndex("cosine", 8, 100, 0)
+    dmms = []
+    for idx, config in enumerate(configs):
+        spec = soap.soapy.PowerSpectrum(config, soap_options, "S%d" % idx)
+        dmms.append(spec.exportDMapMatrix())
+        index.addMatrix(dmms[-1])
+        if idx == 10: break
+    # Default ef_search, such that the search runs on the graph: Recall@5
+    # against the exact search, where hits are results at least as similar
+    # as the 5th exact neighbour (environments may be degenerate)
+    n_hits = 0
+    n_queries = 0
+    n_self = 0
+    for dmm in dmms:
+        K = np.concatenate([ dmm.dot(other, "float64") for other in dmms ], axis=1)
+        ids, sims = index.searchMatrix(dmm, 5, False, "float64")
+        ids_exact, sims_exact = index.searchMatrix(dmm, 5, True, "float64")
+        for i in range(len(dmm)):
+            assert_zero(np.max(np.abs(np.sort(K[i])[::-1][0:5]-sims_exact[i])))
+            n_hits += np.sum(sims[i] >= sims_exact[i][-1]-1e-10)
+            n_queries += 1
+            found = index.search(dmm[i], 1, False)
+            if 1.-found[0][1] < 1e-10: n_self += 1
+    recall = float(n_hits)/(5*n_queries)
+    log << "recall@5 = %1.3f" % recall << log.flush
+    assert recall >= 0.9
+    assert float(n_self)/n_queries >= 0.9
+    index.save("hnsw.arch")
+    index_loaded = soap.HnswIndex("hnsw.arch")
+    assert len(index_loaded) == len(index)
+    ids_loaded, sims_loaded = index_loaded.searchMatrix(dmms[0], 5, False, "float64")
+    ids, sims = index.searchMatrix(dmms[0], 5, False, "float64")
+    assert_zero(np.max(np.abs(sims-sims_loaded)))
+    log << log.endl
+    log << log.mg << "All passed" << log.endl
+
+def test_dmap_sampler():
+    log << log.mg << "<test_dmap_sampler>" << log.endl
+    configs = soap.tools.io.read('structures.xyz')
+    soap_options = configure_default()
+    dset = soap.DMapMatrixSet()
+    dmms = []
+    for idx, config in enumerate(configs):
+        spec = soap.soapy.PowerSpectrum(config, soap_options, "S%d" % idx)
+        dmms.append(spec.exportDMapMatrix(packed=(idx % 2 == 0)))
+        dset.append(dmms[-1])
+        if idx == 10: break
+    K = np.concatenate([
+        np.concatenate([ a.dot(b, "float64") for b in dmms ], axis=1)
+        for a in dmms ], axis=0)**2
+    sampler = soap.DMapSampler(2.0, 0)
+    sampler.setMatrixSet(dset)
+    assert len(sampler) == K.shape[0]
+    s, r = sampler.locate(len(sampler)-1)
+    assert s == len(dmms)-1 and r == len(dmms[-1])-1
+    # Farthest-point sampling vs. reference on the full kernel
+    n_select = 10
+    selected = sampler.selectFPS(n_select, 0)
+    d2 = np.diag(K)[:,None] + np.diag(K)[None,:] - 2*K
+    ref = [ 0 ]
+    d2_min = d2[0]
+    for k in range(n_select-1):
+        ref.append(int(np.argmax(d2_min)))
+        d2_min = np.minimum(d2_min, d2[ref[-1]])
+    assert selected == ref
+    assert_zero(np.max(np.abs(np.array(sampler.distances[1:]) - np.array(
+        [ np.min(d2[ref[k],ref[0:k]]) for k in range(1, n_select) ]))))
+    # Leverage scores with a full-rank presample sum to the effective rank
+    selected = sampler.selectCUR(n_select, len(sampler), 7)
+    assert len(set(selected)) == n_select
+    scores = np.array(sampler.scores)
+    lambda_, V = np.linalg.eigh(K)
+    lambda_ = lambda_[lambda_ > 1e-10*lambda_[-1]]
+    ridge = 1e-3*np.trace(K)/K.shape[0]
+    assert_zero(np.abs(np.sum(scores) - np.sum(lambda_/(lambda_+ridge))), 1e-3)
+    log << log.endl
+    log << log.mg << "All passed" << log.endl
+
+def test_encoder_freeze():
+    log << log.mg << "<test_encoder_freeze>" << log.endl
+    configs = soap.tools.io.read('structures.xyz')
+    soap_options = configure_default()
+    types = soap.encoder.types()
+    dset = soap.DMapMatrixSet()
+    for idx, config in enumerate(configs):
+        spec = soap.soapy.PowerSpectrum(config, soap_options, "S%d" % idx)
+        dset.append(spec.exportDMapMatrix())
+        if idx == 2: break
+    kxx = dset[0].dot(dset[1], "float64")
+    dset.save("dset.arch")
+    # Frozen encoder: No modifications, no datasets with other types
+    soap.encoder.clear()
+    for t in types[::-1]: soap.encoder.add(t)
+    soap.encoder.freeze()
+    assert soap.encoder.isFrozen()
+    try:
+        soap.encoder.add("U")
+        raise AssertionError("Frozen encoder modified")
+    except RuntimeError:
+        log << "+" << log.flush
+    try:
+        soap.DMapMatrixSet("dset.arch")
+        raise AssertionError("Dataset loaded with inconsistent encoder")
+    except RuntimeError:
+        log << "+" << log.flush
+    # Unfrozen encoder: An inconsistent order is not adopted either
+    soap.encoder.unfreeze()
+    try:
+        soap.DMapMatrixSet("dset.arch")
+        raise AssertionError("Dataset loaded with inconsistent encoder")
+    except RuntimeError:
+        log << "+" << log.flush
+    assert soap.encoder.types() == types[::-1]
+    # Encoder order is a prefix of the dataset types: Encoder is extended
+    soap.encoder.clear()
+    soap.encoder.add(types[0])
+    dset_loaded = soap.DMapMatrixSet("dset.arch")
+    assert soap.encoder.types() == types
+    assert_zero(np.max(np.abs(kxx-dset_loaded[0].dot(dset_loaded[1], "float64"))))
+    # Dataset types are a prefix of the encoder order: Loads also if frozen
+    soap.encoder.add("U")
+    soap.encoder.freeze()
+    dset_loaded = soap.DMapMatrixSet("dset.arch")
+    assert soap.encoder.types() == types + [ "U" ]
+    assert_zero(np.max(np.abs(kxx-dset_loaded[0].dot(dset_loaded[1], "float64"))))
+    soap.encoder.unfreeze()
+    soap.encoder.clear()
+    for t in types: soap.encoder.add(t)
+    log << log.endl
+    log << log.mg << "All passed" << log.endl
+
+def test_dmap_lazy():
+    log << log.mg << "<test_dmap_lazy>" << log.endl
+    configs = soap.tools.io.read('structures.xyz')
+    soap_options = configure_default()
+    dset = soap.DMapMatrixSet()
+    for idx, config in enumerate(configs):
+        spec = soap.soapy.PowerSpectrum(config, soap_options, "S%d" % idx)
+        dset.append(spec.exportDMapMatrix())
+        if idx == 5: break
+    dset.saveIndexed("dset.idx")
+    # Indexed archives can also be read eagerly
+    dset_eager = soap.DMapMatrixSet("dset.idx")
+    assert not dset_eager.is_lazy and len(dset_eager) == len(dset)
+    # Budget of (far) less than one matrix, no read-ahead: One resident
+    # matrix after each access
+    dset_lazy = soap.DMapMatrixSet()
+    dset_lazy.loadLazy("dset.idx", 1e-6, 0)
+    assert dset_lazy.is_lazy and len(dset_lazy) == len(dset)
+    assert dset_lazy.n_resident == 0
+    for i in range(len(dset)) + [ 3, 0, 5 ]:
+        kii = dset[i].dot(dset[i], "float64")
+        assert_zero(np.max(np.abs(kii-dset_lazy[i].dot(dset[i], "float64"))))
+        assert_zero(np.max(np.abs(kii-dset_eager[i].dot(dset[i], "float64"))))
+        assert dset_lazy.n_resident == 1
+        log << "+" << log.flush
+    # Matrices handed to Python stay valid across later accesses
+    dmap_0 = dset_lazy[0]
+    k00 = dset[0].dot(dset[0], "float64")
+    for i in range(1, len(dset)):
+        dset_lazy[i]
+        assert_zero(np.max(np.abs(k00-dmap_0.dot(dset[0], "float64"))))
+    try:
+        dset_lazy.append(dset_eager[0])
+        raise AssertionError("Lazy matrix set modified")
+    except RuntimeError:
+        log << "+" << log.flush
+    log << log.endl
+    log << log.mg << "All passed" << log.endl
+
+def test_kernel_lazy():
+    log << log.mg << "<test_kernel_lazy>" << log.endl
+    configs = soap.tools.io.read('structures.xyz')
+    soap_options = configure_default()
+    dset = soap.DMapMatrixSet()
+    for idx, config in enumerate(configs):
+        spec = soap.soapy.PowerSpectrum(config, soap_options, "S%d" % idx)
+        dset.append(spec.exportDMapMatrix())
+        if idx == 5: break
+    dset.saveIndexed("dset.idx")
+    # Budget of less than one matrix and a single thread (single tile, or
+    # no OpenMP): Matrices must stay valid while the kernel holds them
+    for n_threads, tile_size, n_prefetch in [ (1, 1000, 0), (1, 2, 2), (3, 1, 0) ]:
+        kernel_options = soap.Options()
+        kernel_options.set("basekernel_type", "dot")
+        kernel_options.set("base_exponent", 3.)
+        kernel_options.set("base_filter", False)
+        kernel_options.set("topkernel_type", "average")
+        kernel_options.set("kernel_n_threads", n_threads)
+        kernel_options.set("kernel_tile_size", tile_size)
+        kernel = soap.Kernel(kernel_options)
+        dset_lazy = soap.DMapMatrixSet()
+        dset_lazy.loadLazy("dset.idx", 1e-6, n_prefetch)
+        for symmetric in [ False, True ]:
+            K = kernel.evaluate(dset, dset, symmetric, "float64")
+            K_lazy = kernel.evaluate(dset_lazy, dset_lazy, symmetric, "float64")
+            assert_zero(np.max(np.abs(K_lazy-K)), 1e-10)
+            assert dset_lazy.n_pinned == 0
+            if n_prefetch == 0: assert dset_lazy.n_resident == 1
+        for i in range(len(dset)):
+            assert_zero(abs(kernel.evaluate(dset_lazy[i], dset_lazy[(i+1) % len(dset)])
+                - kernel.evaluate(dset[i], dset[(i+1) % len(dset)])), 1e-10)
+            KK = kernel.attributeLeft(dset[i], dset, "float64")
+            KK_lazy = kernel.attributeLeft(dset_lazy[i], dset_lazy, "float64")
+            assert_zero(np.max(np.abs(KK_lazy-KK)), 1e-10)
+            assert dset_lazy.n_pinned == 0
+        assert kernel.selectLandmarks(dset_lazy, 3, "leverage", 5) \
+            == kernel.selectLandmarks(dset, 3, "leverage", 5)
+        assert kernel.selectLandmarks(dset_lazy, 3, "fps", 5) \
+            == kernel.selectLandmarks(dset, 3, "fps", 5)
+        assert dset_lazy.n_pinned == 0
+    # Samplers keep the matrices of a lazy set pinned
+    sampler = soap.DMapSampler(2.0, 1)
+    sampler.setMatrixSet(dset_lazy)
+    assert dset_lazy.n_pinned == len(dset) and dset_lazy.n_resident == len(dset)
+    sampler_ref = soap.DMapSampler(2.0, 1)
+    sampler_ref.setMatrixSet(dset)
+    assert sampler.selectFPS(10, 0) == sampler_ref.selectFPS(10, 0)
+    del sampler
+    assert dset_lazy.n_pinned == 0
+    log << log.endl
+    log << log.mg << "All passed" << log.endl
+
+def test_dmap_quantized():
+    log << log.mg << "<test_dmap_quantized>" << log.endl
+    configs = soap.tools.io.read('structures.xyz')
+    soap_options = configure_default()
+    dset = soap.DMapMatrixSet()
+    for idx, config in enumerate(configs):
+        spec = soap.soapy.PowerSpectrum(config, soap_options, "S%d" % idx)
+        dset.append(spec.exportDMapMatrix())
+        if idx == 4: break
+    # Relative deviations from the double-precision kernel
+    for dtype, eps in [ ("int8", 1e-2), ("fp16", 1e-3) ]:
+        for i in range(len(dset)):
+            for j in range(i, len(dset)):
+                kij = dset[i].dot(dset[j], "float64")
+                xi = soap.DMapMatrix()
+                xi.loads(dset[i].dumps())
+                xi.quantize(dtype)
+                xj = soap.DMapMatrix()
+                xj.loads(dset[j].dumps())
+                xj.quantize(dtype)
+                scale = np.max(np.abs(kij))
+                assert_zero(np.max(np.abs(xi.dot(xj, "float64")-kij))/scale, eps)
+                assert_zero(np.max(np.abs(xi.dot(dset[j], "float64")-kij))/scale, eps)
+                # Quantized storage is archived as such
+                xk = soap.DMapMatrix()
+                xk.loads(xi.dumps())
+                assert_zero(np.max(np.abs(xk.dot(xj, "float64")-xi.dot(xj, "float64"))), 1e-12)
+                xi.dequantize()
+                assert_zero(np.max(np.abs(xi.dot(dset[j], "float64")-kij))/scale, eps)
+    log << log.endl
+    log << log.mg << "All passed" << log.endl
+
+def test_proto_project():
+    log << log.mg << "<test_proto_project>" << log.endl
+    configs = soap.tools.io.read('structures.xyz')
+    soap_options = configure_default()
+    np.random.seed(7)
+    # Environments AX (= BX) of four structures, one distance block each
+    AX = soap.DMapMatrix()
+    DAB = soap.BlockLaplacian()
+    dists = []
+    for idx, config in enumerate(configs):
+        spec = soap.soapy.PowerSpectrum(config, soap_options, "S%d" % idx)
+        if idx < 4:
+            n_env = len(spec.exportDMapMatrix())
+            AX.append(spec.spectrum)
+            dists.append(np.random.uniform(0.8, 4.0, size=(n_env, n_env)))
+            DAB.append(dists[-1], "float64")
+        elif idx == 4:
+            ax = spec.exportDMapMatrix()
+        else:
+            bx = spec.exportDMapMatrix()
+            break
+    # Dense reference -log(K_aA.G_n.K_Bb/(z_a z_b)), cutoff as in Proto()
+    xi = 2.
+    Rc = 3.75
+    Rc_width = 0.5
+    def weight(r):
+        w = 0.5*(1.+np.cos(np.pi*(r-Rc+Rc_width)/Rc_width))
+        w[r <= Rc-Rc_width] = 1.
+        w[r > Rc] = -1e-10
+        return w/r**2
+    K_aA = ax.dotFilter(AX, "float64")**xi
+    K_Bb = AX.dotFilter(bx, "float64")**xi
+    z_ab = np.outer(np.sum(K_aA, axis=1), np.sum(K_Bb, axis=0))
+    def project_dense(basis):
+        G = np.zeros((len(AX), len(AX)))
+        off = 0
+        for D in dists:
+            G[off:off+D.shape[0],off:off+D.shape[1]] = weight(D)*basis(D)
+            off += D.shape[0]
+        return -np.log(K_aA.dot(G).dot(K_Bb)/z_ab)
+    # One (flat) basis function
+    proto = soap.Proto()
+    proto.parametrize(AX, AX, DAB)
+    assert proto.n_basis == 1
+    E_ref = project_dense(lambda D: np.ones_like(D))
+    E = proto.project(ax, bx, xi, "float64")
+    assert_zero(np.max(np.abs(E-E_ref)), 1e-8)
+    E_all = proto.projectAll(ax, bx, xi, "float64")
+    assert len(E_all) == 1
+    assert_zero(np.max(np.abs(E_all[0]-E_ref)), 1e-8)
+    # Several Gaussian basis functions
+    centres = [ 1., 2., 3. ]
+    sigma = 0.5
+    proto.parametrizeBasis(AX, AX, DAB, centres, sigma)
+    assert proto.n_basis == len(centres)
+    E_all = proto.projectAll(ax, bx, xi, "float64")
+    for n, r_n in enumerate(centres):
+        E_ref = project_dense(lambda D: np.exp(-(D-r_n)**2/(2*sigma**2)))
+        assert_zero(np.max(np.abs(E_all[n]-E_ref)), 1e-8)
+    assert_zero(np.max(np.abs(proto.project(ax, bx, xi, "float64")-E_all[0])), 1e-12)
+    log << log.endl
+    log << log.mg << "All passed" << log.endl
+
+def test_block_laplacian():
+    log << log.mg << "<test_block_laplacian>" << log.endl
+    np.random.seed(11)
+    # Dense block, block with fill 0.25 (sparse at max_fill >= 0.25), block
+    # with fill 1/16 (sparse at the default max_fill = 0.1)
+    blocks = [ np.random.uniform(size=(3,5)), np.zeros((6,4)), np.zeros((8,8)) ]
+    for i in range(6): blocks[1][i,i%4] = i+1.
+    for i in range(0, 8, 2): blocks[2][i,(3*i)%8] = -0.5*i-1.
+    def block_diag(blocks):
+        n_rows = sum([ b.shape[0] for b in blocks ])
+        n_cols = sum([ b.shape[1] for b in blocks ])
+        M = np.zeros((n_rows, n_cols))
+        i0 = j0 = 0
+        for b in blocks:
+            M[i0:i0+b.shape[0],j0:j0+b.shape[1]] = b
+            i0 += b.shape[0]
+            j0 += b.shape[1]
+        return M
+    M = block_diag(blocks)
+    X = np.random.uniform(size=(M.shape[1], 4))
+    def check(L, n_sparse):
+        assert len(L) == len(blocks) and L.n_sparse == n_sparse
+        assert L.rows == M.shape[0] and L.cols == M.shape[1]
+        for k, b in enumerate(blocks):
+            assert_zero(np.max(np.abs(L.getBlock(k, "float64")-b)), 1e-14)
+        assert_zero(np.max(np.abs(L.dot(X, "float64")-M.dot(X))), 1e-12)
+    # max_fill threshold: Blocks with fill <= max_fill are compressed
+    for max_fill, sparse in [ (0.0, [ False, False, False ]),
+            (0.1, [ False, False, True ]), (0.25, [ False, True, True ]) ]:
+        L = soap.BlockLaplacian()
+        L.max_fill = max_fill
+        for b in blocks: L.append(b, "float64")
+        assert [ L.isSparse(k) for k in range(len(L)) ] == sparse
+        check(L, sum(sparse))
+    # Compressing later, with a raised threshold
+    L.max_fill = 0.
+    L.compress()
+    check(L, 2)
+    # Round trip, max_fill and the sparse blocks are archived
+    L.save("laplacian.arch")
+    L_loaded = soap.BlockLaplacian("laplacian.arch")
+    assert L_loaded.max_fill == 0.
+    assert [ L_loaded.isSparse(k) for k in range(len(L)) ] == [ False, True, True ]
+    check(L_loaded, 2)
+    # Archive written before the CSR blocks (class version 0): Dense blocks
+    # b_0(i,j) = i+2j+1 (3x3) and b_1(i,j) = i+1 if j == i%4 else 0 (6x4)
+    blocks = [ np.fromfunction(lambda i, j: i+2*j+1, (3,3)), np.zeros((6,4)) ]
+    for i in range(6): blocks[1][i,i%4] = i+1.
+    M = block_diag(blocks)
+    X = np.random.uniform(size=(M.shape[1], 4))
+    L_v0 = soap.BlockLaplacian("laplacian_v0.arch")
+    assert L_v0.max_fill == 0.1
+    check(L_v0, 0)
+    L_v0.max_fill = 0.25
+    L_v0.compress()
+    check(L_v0, 1)
+    log << log.endl
+    log << log.mg << "All passed" << log.endl
+
 test_dmap_convolve()
+test_dmap_packed()
+test_hnsw()
+test_dmap_sampler()
+test_encoder_freeze()
+test_dmap_lazy()
+test_dmap_quantized()
+test_proto_project()
+test_block_laplacian()
+test_kernel_lazy()
@@ -163,11 +163,35 @@ def test_dmap_gradients_single(config, soap_options, centre_idx, dim, gidx, h):
     log << "(overlaps= %+1.7e %+1.7e %+1.7e %+1.7e)" % (shh, sgg, sgh, dgh) << log.endl
     return
 
+def test_dmap_matrix_dot_gradients(config, config_prime, soap_options):
+    # Batched energy and force kernels vs. DMap.dotGradLeft
+    spec = soap.soapy.PowerSpectrum(config, soap_options)
+    X = spec.exportDMapMatrix(coherent=False)
+    spec_prime = soap.soapy.PowerSpectrum(config_prime, soap_options)
+    X_prime = spec_prime.exportDMapMatrix(coherent=False)
+    K, dK, pids = X.dotGradLeft(X_prime, 2., "float64")
+    assert K.shape == (len(X), len(X_prime))
+    assert dK.shape == (3*len(pids), len(X_prime))
+    for j in range(len(X_prime)):
+        k = soap.DMap()
+        for i in range(len(X)):
+            X[i].dotGradLeft(X_prime[j], 1., 2., k)
+            assert_equal(K[i,j] - X[i].dot(X_prime[j])**2, 0., 1e-10)
+        for g in k.gradients:
+            p = pids.index(g.pid)
+            assert_equal(dK[3*p+0,j] - g.x, 0., 1e-10)
+            assert_equal(dK[3*p+1,j] - g.y, 0., 1e-10)
+            assert_equal(dK[3*p+2,j] - g.z, 0., 1e-10)
+    log << log.endl
+    return
+
 def test_dmap_gradients():
     configs = soap.tools.io.read('structures.xyz')
     soap_options = configure_default()
     log << log.mg << "<test_dmap_dot_gradients>" << log.endl
     test_dmap_dot_gradients(configs[0], configs[1], soap_options, h=0.0000001)
+    log << log.mg << "<test_dmap_matrix_dot_gradients>" << log.endl
+    test_dmap_matrix_dot_gradients(configs[0], configs[1], soap_options)
     log << log.mg << "<test_dmap(_sum)_gradients(_single)>" << log.endl
     for centre_idx, dim, gidx in zip(
         [ 0, 0, 0, 2, 2 ],
@@ -71,7 +71,180 @@ def test_gylm_rotinv():
             assert_equal(diff, 0.0, 1e-10)
         log << log.endl
 
-def test_ylm(lmax=7):
+def test_gylm_threads():
+    log << log.mg << "<test_threads>" << log.endl
+    calc = get_calc(scale=1.)
+    configs = soap.tools.io.read('structures.xyz')
+    for cidx, config in enumerate(configs):
+        log << "Struct" << cidx << log.flush
+        calc.setNumThreads(1)
+        x0 = calc.evaluate(system=config, positions=config.positions)
+        for n_threads in [ 2, 4, 0 ]:
+            calc.setNumThreads(n_threads)
+            x1 = calc.evaluate(system=config, positions=config.positions)
+            assert_equal(np.max(np.abs(x1-x0)), 0.0, 0.0)
+        log << log.endl
+
+def test_gylm_batch():
+    log << log.mg << "<test_batch>" << log.endl
+    calc = get_calc(scale=1.)
+    configs = soap.tools.io.read('structures.xyz')
+    heavy = [ np.where(np.array(c.symbols) != "H")[0] for c in configs ]
+    for n_threads in [ 1, 0 ]:
+        log << "n_threads=%d" % n_threads << log.flush
+        calc.setNumThreads(n_threads)
+        X, offsets = calc.evaluateBatch(configs)
+        X_heavy, offsets_heavy = calc.evaluateBatch(configs, 
+            positions=[ c.positions[h] for c, h in zip(configs, heavy) ])
+        for cidx, config in enumerate(configs):
+            x = calc.evaluate(system=config)
+            assert_equal(np.max(np.abs(X[offsets[cidx]:offsets[cidx+1]]-x)), 0.0, 1e-12)
+            x = calc.evaluate(system=config, positions=config.positions[heavy[cidx]])
+            assert_equal(np.max(np.abs(
+                X_heavy[offsets_heavy[cidx]:offsets_heavy[cidx+1]]-x)), 0.0, 1e-12)
+        log << log.endl
+
+def test_gylm_grad(h=1e-5):
+    log << log.mg << "<test_grad>" << log.endl
+    calc = soap.external.GylmCalculator(
+        rcut=3.5,
+        rcut_width=0.5,
+        nmax=4,
+        lmax=4,
+        sigma=0.5,
+        wconstant=False,
+        normalize=True,
+        types="C,N,O,S,H,F,Cl,Br,I,B,P".split(","),
+        periodic=False)
+    configs = soap.tools.io.read('structures.xyz')
+    for cidx, config in enumerate(configs[0:2]):
+        log << "Struct" << cidx << log.flush
+        X, dX, pairs = calc.evaluate(system=config, gradients=True)
+        x0 = calc.evaluate(system=config)
+        assert_equal(np.max(np.abs(X-x0)), 0.0, 1e-10)
+        pos_orig = np.copy(config.positions)
+        for p in np.random.randint(0, len(pairs), size=(5,)):
+            i, j = pairs[p]
+            for d in range(3):
+                config.positions = np.copy(pos_orig)
+                config.positions[j,d] += h
+                xp = calc.evaluate(system=config)
+                config.positions[j,d] -= 2*h
+                xm = calc.evaluate(system=config)
+                dx_num = (xp[i]-xm[i])/(2*h)
+                assert_equal(np.max(np.abs(dX[p,d]-dx_num)), 0.0, 1e-6)
+        config.positions = pos_orig
+        log << log.endl
+
+def test_gylm_sketch(sketch_dim=1024, n_seeds=8):
+    log << log.mg << "<test_sketch>" << log.endl
+    types = "C,N,O,S,H,F,Cl,Br,I,B,P".split(",")
+    def get_calc_sketch(sketch_dim, sketch_seed):
+        return soap.external.GylmCalculator(
+            rcut=4.0, rcut_width=0.5, nmax=9, lmax=6, sigma=0.5,
+            types=types, periodic=False, 
+            sketch_dim=sketch_dim, sketch_seed=sketch_seed)
+    calc0 = get_calc_sketch(0, 0)
+    n_types = calc0.getNumberofTypes()
+    dim_nkl = calc0.getChannelDim(True)
+    # The sketch estimates the kernel of the full power spectrum, i.e.,
+    # with channels t != u counted twice
+    w = np.concatenate([ (1. if t == u else 2.)*np.ones((dim_nkl,)) \
+        for t in range(n_types) for u in range(t, n_types) ])
+    def normalized(K):
+        z = 1./np.diag(K)**0.5
+        return (K*z).T*z
+    configs = soap.tools.io.read('structures.xyz')
+    for cidx, config in enumerate(configs):
+        log << "Struct" << cidx << log.flush
+        x = calc0.evaluate(system=config)
+        K = normalized((x*w).dot(x.T))
+        K_avg = np.zeros_like(K)
+        rms = []
+        for seed in range(n_seeds):
+            xs = get_calc_sketch(sketch_dim, seed).evaluate(system=config)
+            assert_equal(xs.shape[1], sketch_dim*(6+1), 0)
+            Ks = normalized(xs.dot(xs.T))
+            rms.append(np.mean((Ks-K)**2)**0.5)
+            K_avg = K_avg + xs.dot(xs.T)/n_seeds
+        # Error bound, reproducibility, averaging over seeds
+        assert_equal(np.max(rms), 0.0, 0.1)
+        xs_0 = get_calc_sketch(sketch_dim, 0).evaluate(system=config)
+        xs_1 = get_calc_sketch(sketch_dim, 0).evaluate(system=config)
+        assert_equal(np.max(np.abs(xs_0-xs_1)), 0.0, 0.0)
+        rms_avg = np.mean((normalized(K_avg)-K)**2)**0.5
+        assert_equal(int(rms_avg < 0.6*np.mean(rms)), 1, 0)
+        log << log.endl
+
+def test_exp_batch(n=100003):
+    log << log.mg << "<test_exp_batch>" << log.endl
+    x = np.concatenate([
+        np.random.uniform(-40., 0., size=(n,)),
+        np.random.uniform(-708., 709., size=(n,)),
+        np.array([ 0., -750., 710., -1e-300 ]) ])
+    y_ref = np.exp(x)
+    for isa in [ 0, 1, 2 ]:
+        y = np.zeros_like(x)
+        used = soap.external.exp_batch(x, y, x.shape[0], isa)
+        log << "isa=%d" % used << log.flush
+        normal = np.where(y_ref > 2.3e-308)[0]
+        rel = np.abs(y[normal]-y_ref[normal])/y_ref[normal]
+        assert_equal(np.max(rel), 0.0, 1e-14)
+        assert_equal(y[-3], 0.0, 0.0)
+        assert_equal(int(np.isinf(y[-2])), 1, 0)
+        log << log.endl
+
+def test_smooth_match(gamma=0.05, eps=1e-12):
+    log << log.mg << "<test_smooth_match>" << log.endl
+    import scipy.optimize
+    Ks = [ np.random.uniform(0., 1., size=(nx,ny)) for nx, ny in [ 
+        (13,9), (8,8), (1,5), (20,31) ] ]
+    Ps = [ np.zeros_like(K) for K in Ks ]
+    conv, n_iter, err = soap.external.smooth_match_batch(Ps, Ks, gamma, eps, 2)
+    for K, P_batch, c in zip(Ks, Ps, conv):
+        log << "%dx%d" % K.shape << log.flush
+        P = np.zeros_like(K)
+        info = soap.external.smooth_match(P, K, K.shape[0], K.shape[1],
+            gamma, eps, False)
+        assert_equal(int(info[0]), 1, 0)
+        assert_equal(int(c), 1, 0)
+        assert_equal(np.max(np.abs(P-P_batch)), 0.0, 1e-15)
+        assert_equal(np.max(np.abs(np.sum(P, axis=1)-1./K.shape[0])), 0.0, 1e-6)
+        assert_equal(np.max(np.abs(np.sum(P, axis=0)-1./K.shape[1])), 0.0, 1e-12)
+        log << log.endl
+    # Small temperatures approach the best assignment without underflow
+    K = Ks[1]
+    rows, cols = scipy.optimize.linear_sum_assignment(-K)
+    k_best = np.sum(K[rows,cols])/K.shape[0]
+    for g in [ 1e-3, 1e-4 ]:
+        log << "gamma=%1.0e" % g << log.flush
+        P = np.zeros_like(K)
+        soap.external.smooth_match(P, K, K.shape[0], K.shape[1], g, 1e-8, False)
+        assert_equal(int(np.all(np.isfinite(P))), 1, 0)
+        assert_equal(np.sum(P*K), k_best, 100*g)
+        log << log.endl
+
+def test_smooth_match_scaling(eps=1e-10):
+    log << log.mg << "<test_smooth_match_scaling>" << log.endl
+    # Epsilon scaling carries the potentials over between temperatures: At
+    # small gamma, it converges in fewer iterations than the plain iteration
+    Ks = [ np.random.uniform(0., 1., size=(n,n)) for n in [ 8, 20, 40 ]*4 ]
+    for gamma in [ 1e-2, 2e-3 ]:
+        log << "gamma=%1.0e" % gamma << log.flush
+        Ps = [ np.zeros_like(K) for K in Ks ]
+        Ps_scaled = [ np.zeros_like(K) for K in Ks ]
+        conv, n_iter, err = soap.external.smooth_match_batch(
+            Ps, Ks, gamma, eps, 2)
+        conv_scaled, n_iter_scaled, err_scaled = soap.external.smooth_match_batch(
+            Ps_scaled, Ks, gamma, eps, 2, gamma_start=0.5)
+        assert_equal(int(all(conv_scaled)), 1, 0)
+        assert_equal(int(sum(n_iter_scaled) <= sum(n_iter)), 1, 0)
+        for K, P, P_scaled, c in zip(Ks, Ps, Ps_scaled, conv):
+            if not c: continue
+            assert_equal(np.sum(P_scaled*K), np.sum(P*K), 1e-4)
+        log << log.endl
+
+def test_ylm(lmax=16):
     log << log.mg << "<test_ylm>" << log.endl
     xyz_orig = np.random.normal(0, 1., size=(3,))
     xyz = xyz_orig/np.dot(xyz_orig,xyz_orig)**0.5
@@ -119,11 +292,18 @@ def test_ylm(lmax=7):
             log << "l=%d" % l << log.flush
             for m in range(-l,l+1):
                 lm = l**2+l+m
-                assert_equal(np.abs(dy[lm]), 0.0, 1e-7)
+                assert_equal(np.abs(dy[lm]), 0.0, 1e-10)
             log << log.endl
         
 if __name__ == "__main__":
+    test_exp_batch()
+    test_smooth_match()
+    test_smooth_match_scaling()
     test_ylm()
     test_gylm_rotinv()
     test_gylm_scaleinv()
+    test_gylm_threads()
+    test_gylm_batch()
+    test_gylm_grad()
+    test_gylm_sketch()
 
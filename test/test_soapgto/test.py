@@ -0,0 +1,76 @@
+import numpy as np
+import soap
+np.random.seed(7)
+log = soap.log
+
+def assert_equal(z, target, eps=1e-5):
+    if np.abs(z-target) > eps: raise ValueError(z)
+    else: log << "+" << log.flush
+
+def get_calc(nmax=6, lmax=6):
+    return soap.external.SoapGtoCalculator(
+        rcut=4.0,
+        nmax=nmax,
+        lmax=lmax,
+        sigma=0.5,
+        normalize=True,
+        types="C,N,O,S,H,F,Cl,Br,I,B,P".split(","),
+        periodic=False)
+
+def test_soapgto_rotinv():
+    log << log.mg << "<test_rotinv>" << log.endl
+    configs = soap.tools.io.read('structures.xyz')
+    for lmax in [ 6, 12 ]:
+        calc = get_calc(nmax=4, lmax=lmax)
+        for cidx, config in enumerate(configs[0:2]):
+            log << "Struct" << cidx << "lmax" << lmax << log.flush
+            heavy = np.where(np.array(config.symbols) != "H")[0]
+            x0 = calc.evaluate(system=config, positions=config.positions[heavy])
+            for i in range(2):
+                R = soap.tools.transformations.get_random_rotation_matrix()
+                config.positions = config.positions.dot(R)
+                x1 = calc.evaluate(system=config, positions=config.positions[heavy])
+                assert_equal(np.max(np.abs(x0.dot(x0.T) - x1.dot(x1.T))), 0.0, 1e-10)
+            log << log.endl
+
+def test_soapgto_threads():
+    log << log.mg << "<test_threads>" << log.endl
+    calc = get_calc()
+    configs = soap.tools.io.read('structures.xyz')
+    for cidx, config in enumerate(configs):
+        log << "Struct" << cidx << log.flush
+        calc.setNumThreads(1)
+        x0 = calc.evaluate(system=config)
+        for n_threads in [ 2, 4, 0 ]:
+            calc.setNumThreads(n_threads)
+            x1 = calc.evaluate(system=config)
+            assert_equal(np.max(np.abs(x1-x0)), 0.0, 0.0)
+        log << log.endl
+
+def test_soapgto_grad(h=1e-5):
+    log << log.mg << "<test_grad>" << log.endl
+    calc = get_calc(nmax=4, lmax=4)
+    configs = soap.tools.io.read('structures.xyz')
+    for cidx, config in enumerate(configs[0:2]):
+        log << "Struct" << cidx << log.flush
+        X, dX, pairs = calc.evaluate(system=config, gradients=True)
+        x0 = calc.evaluate(system=config)
+        assert_equal(np.max(np.abs(X-x0)), 0.0, 1e-10)
+        pos_orig = np.copy(config.positions)
+        for p in np.random.randint(0, len(pairs), size=(5,)):
+            i, j = pairs[p]
+            for d in range(3):
+                config.positions = np.copy(pos_orig)
+                config.positions[j,d] += h
+                xp = calc.evaluate(system=config)
+                config.positions[j,d] -= 2*h
+                xm = calc.evaluate(system=config)
+                dx_num = (xp[i]-xm[i])/(2*h)
+                assert_equal(np.max(np.abs(dX[p,d]-dx_num)), 0.0, 1e-6)
+        config.positions = pos_orig
+        log << log.endl
+
+if __name__ == "__main__":
+    test_soapgto_rotinv()
+    test_soapgto_threads()
+    test_soapgto_grad()